@@ -0,0 +1,704 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <linux/limits.h>
+#include <json.h>
+
+#include "probe.h"
+#include "server.h"
+#include "fixture.h"
+#include "common.h"
+#include "memory.h"
+#include "lutris.h"
+#include "net.h"
+#include "tar.h"
+
+/*
+ * benchmarks of the hot paths against a local mock server, run by `make bench'
+ * every run of a scenario is a fresh child process with an empty cache, so
+ * its peak RSS and allocation counts are its own, the syscalls are counted
+ * in one more run under ptrace that isn't timed
+ * results are written as JSON, --compare prints the change to an older file
+ */
+
+#define USAGE "usage: polecat-bench [options] [scenario...]"
+#define MAX_SYSCALLS 512
+#define INSTALLER_SLUG "bench-game"
+
+struct Sample {
+    bool ok;
+    double seconds;
+    uint64_t bytes;
+    long baseline;                      // KiB resident when the scenario started
+    struct ProbeCounters counters;
+};
+
+struct Bench {
+    char base[64];                      // http://127.0.0.1:<port>/
+    char root[PATH_MAX + 8];            // what the server serves
+    char scratch[PATH_MAX];             // per run, removed afterwards
+    bool verbose;
+};
+
+struct Scenario {
+    const char* name;
+    const char* description;
+    bool (*setup)(const struct Scenario*, const struct Bench*);
+    bool (*run)(const struct Scenario*, const struct Bench*, uint64_t* bytes);
+    struct Fixture* fixture;
+    const char* path;                   // below the server root, may start with server options
+};
+
+static struct Fixture fixtures[] = {
+    { .name = "wine.tar.xz",  .filter = "xz",   .layout = "wine-bench-x86_64/lib/wine/d%02zu/module%05zu.dll", .files = 160, .minSize = 8 * 1024, .maxSize = 800 * 1024 },
+    { .name = "wine.tar.zst", .filter = "zstd", .layout = "wine-bench-x86_64/lib/wine/d%02zu/module%05zu.dll", .files = 160, .minSize = 8 * 1024, .maxSize = 800 * 1024 },
+    { .name = "small.tar.zst", .filter = "zstd", .layout = "game/data/d%02zu/asset%05zu.txt", .files = 16000, .minSize = 256, .maxSize = 4096 },
+};
+
+static bool benchDownload(const struct Scenario* scenario, const struct Bench* bench, uint64_t* bytes)
+{
+    char url[PATH_MAX];
+    snprintf(url, sizeof(url), "%s%s", bench->base, scenario->path);
+
+    struct MemoryStruct* mem = downloadToRam(url);
+    if (!mem) return false;
+
+    *bytes = mem->size;
+    memoryFree(mem);
+
+    return true;
+}
+
+static bool benchExtractFile(const struct Scenario* scenario, const struct Bench* bench, uint64_t* bytes)
+{
+    char output[PATH_MAX + 8];
+    snprintf(output, sizeof(output), "%s/out", bench->scratch);
+
+    *bytes = scenario->fixture->content;
+    makePath(output);
+
+    return extractFile(scenario->fixture->path, output, NULL);
+}
+
+static bool benchExtractURL(const struct Scenario* scenario, const struct Bench* bench, uint64_t* bytes)
+{
+    char url[PATH_MAX], output[PATH_MAX + 8];
+    snprintf(url, sizeof(url), "%s%s", bench->base, scenario->path);
+    snprintf(output, sizeof(output), "%s/out", bench->scratch);
+
+    *bytes = scenario->fixture->content;
+    makePath(output);
+
+    return extractURL(url, output, NULL);
+}
+
+static bool benchInstaller(const struct Scenario* scenario, const struct Bench* bench, uint64_t* bytes)
+{
+    char path[PATH_MAX * 2];
+    snprintf(path, sizeof(path), "%s/%s", bench->root, scenario->path);
+
+    struct script_t installer = lutris_getInstaller(INSTALLER_SLUG);
+    bool success = installer.error == NONE && installer.directivecount;
+
+    *bytes = getStat(path).st_size;
+    lutris_freeInstaller(&installer);
+
+    return success;
+}
+
+static bool setupInstaller(const struct Scenario* scenario, const struct Bench* bench)
+{
+    uint64_t bytes;
+
+    return benchInstaller(scenario, bench, &bytes);
+}
+
+static bool benchReleases(const struct Scenario* scenario, const struct Bench* bench, uint64_t* bytes)
+{
+    char url[PATH_MAX], path[PATH_MAX * 2];
+    snprintf(url, sizeof(url), "%s%s", bench->base, scenario->path);
+    snprintf(path, sizeof(path), "%s/%s", bench->root, scenario->path);
+
+    struct json_object* releases = fetchJSON(url);
+    bool success = json_object_get_type(releases) == json_type_array && json_object_array_length(releases);
+
+    *bytes = getStat(path).st_size;
+    json_object_put(releases);
+
+    return success;
+}
+
+const static struct Scenario scenarios[] = {
+    { .name = "download-xz",         .run = benchDownload,    .fixture = &fixtures[0], .path = "files/wine.tar.xz",
+      .description = "wine sized .tar.xz into memory with downloadToRam" },
+    { .name = "download-throttled",  .run = benchDownload,    .fixture = &fixtures[0], .path = "latency/150/rate/33554432/files/wine.tar.xz",
+      .description = "the same at 32 MiB/s after 150 ms" },
+    { .name = "extract-xz",          .run = benchExtractFile, .fixture = &fixtures[0],
+      .description = "wine sized .tar.xz from disk with extractFile" },
+    { .name = "extract-zst",         .run = benchExtractFile, .fixture = &fixtures[1],
+      .description = "wine sized .tar.zst from disk with extractFile" },
+    { .name = "extract-small-files", .run = benchExtractFile, .fixture = &fixtures[2],
+      .description = "16000 small files from a .tar.zst with extractFile" },
+    { .name = "stream-xz",           .run = benchExtractURL,  .fixture = &fixtures[0], .path = "latency/50/files/wine.tar.xz",
+      .description = "wine sized .tar.xz extracted while it downloads with extractURL" },
+    { .name = "installer-cold",      .run = benchInstaller,   .path = "api/installers/" INSTALLER_SLUG,
+      .description = "lutris_getInstaller with an empty cache" },
+    { .name = "installer-warm",      .run = benchInstaller,   .setup = setupInstaller, .path = "api/installers/" INSTALLER_SLUG,
+      .description = "lutris_getInstaller once the installer is cached" },
+    { .name = "github-releases",     .run = benchReleases,    .path = "repos/lutris/dxvk/releases",
+      .description = "recorded GitHub releases JSON with fetchJSON" },
+};
+
+static const struct {
+    long nr;
+    const char* name;
+} syscallNames[] = {
+    { SYS_read, "read" },           { SYS_write, "write" },             { SYS_pread64, "pread64" },
+    { SYS_pwrite64, "pwrite64" },   { SYS_readv, "readv" },             { SYS_writev, "writev" },
+    { SYS_openat, "openat" },       { SYS_close, "close" },             { SYS_lseek, "lseek" },
+    { SYS_fstat, "fstat" },         { SYS_newfstatat, "newfstatat" },   { SYS_statx, "statx" },
+    { SYS_mkdirat, "mkdirat" },     { SYS_renameat2, "renameat2" },     { SYS_unlinkat, "unlinkat" },
+    { SYS_getdents64, "getdents64" },
+    { SYS_fchmod, "fchmod" },       { SYS_fchmodat, "fchmodat" },       { SYS_utimensat, "utimensat" },
+    { SYS_fsync, "fsync" },         { SYS_ftruncate, "ftruncate" },     { SYS_fallocate, "fallocate" },
+    { SYS_copy_file_range, "copy_file_range" }, { SYS_ioctl, "ioctl" }, { SYS_fcntl, "fcntl" },
+    { SYS_mmap, "mmap" },           { SYS_munmap, "munmap" },           { SYS_mprotect, "mprotect" },
+    { SYS_madvise, "madvise" },     { SYS_brk, "brk" },                 { SYS_mremap, "mremap" },
+    { SYS_futex, "futex" },         { SYS_clone, "clone" },             { SYS_clone3, "clone3" },
+    { SYS_ppoll, "ppoll" },         { SYS_epoll_pwait, "epoll_pwait" },
+    { SYS_socket, "socket" },       { SYS_connect, "connect" },         { SYS_recvfrom, "recvfrom" },
+    { SYS_sendto, "sendto" },       { SYS_recvmsg, "recvmsg" },         { SYS_sendmsg, "sendmsg" },
+    { SYS_getsockopt, "getsockopt" }, { SYS_setsockopt, "setsockopt" }, { SYS_pipe2, "pipe2" },
+    { SYS_eventfd2, "eventfd2" },   { SYS_rt_sigaction, "rt_sigaction" }, { SYS_rt_sigprocmask, "rt_sigprocmask" },
+    { SYS_getpid, "getpid" },       { SYS_gettid, "gettid" },           { SYS_tgkill, "tgkill" },
+    { SYS_getsockname, "getsockname" }, { SYS_sysinfo, "sysinfo" },
+    { SYS_getrandom, "getrandom" }, { SYS_nanosleep, "nanosleep" },     { SYS_clock_nanosleep, "clock_nanosleep" },
+#ifdef SYS_poll
+    { SYS_mkdir, "mkdir" },         { SYS_rename, "rename" },           { SYS_poll, "poll" },
+    { SYS_epoll_wait, "epoll_wait" },
+#endif
+};
+
+// the part of the kernel's struct ptrace_syscall_info used here
+struct syscallInfo {
+    uint8_t op;
+    uint8_t pad[3];
+    uint32_t arch;
+    uint64_t instructionPointer;
+    uint64_t stackPointer;
+    uint64_t nr;
+    uint64_t args[6];
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char* syscallName(long nr, char* buffer, size_t size)
+{
+    for (size_t i = 0; i < ARRAY_LEN(syscallNames); ++i)
+    {
+        if (syscallNames[i].nr == nr) return syscallNames[i].name;
+    }
+
+    snprintf(buffer, size, "syscall_%li", nr);
+    return buffer;
+}
+
+// what a child does, between the SIGUSR1 marks is what gets measured
+static void runScenario(const struct Scenario* scenario, const struct Bench* bench, bool traced, int result)
+{
+    struct Sample sample = {0};
+    struct rusage usage;
+    char path[PATH_MAX + 16];
+
+    if (!bench->verbose)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+
+    // a fresh cache and data directory every run
+    snprintf(path, sizeof(path), "%s/cache", bench->scratch);
+    setenv("XDG_CACHE_HOME", path, 1);
+    snprintf(path, sizeof(path), "%s/data", bench->scratch);
+    setenv("XDG_DATA_HOME", path, 1);
+    snprintf(path, sizeof(path), "%sapi/installers/", bench->base);
+    setenv("POLECAT_INSTALLER_API", path, 1);
+
+    // ignored, the tracer still sees it
+    signal(SIGUSR1, SIG_IGN);
+
+    if (traced)
+    {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+    }
+
+    if (!scenario->setup || scenario->setup(scenario, bench))
+    {
+        getrusage(RUSAGE_SELF, &usage);
+        sample.baseline = usage.ru_maxrss;
+
+        raise(SIGUSR1);
+        probeStart();
+        double start = now();
+
+        sample.ok = scenario->run(scenario, bench, &sample.bytes);
+
+        sample.seconds = now() - start;
+        probeStop(&sample.counters);
+        raise(SIGUSR1);
+    }
+
+    write(result, &sample, sizeof(sample));
+    _exit(0);
+}
+
+// follows every thread of `pid' until it is reaped, counts syscalls entered between the marks
+static void traceSyscalls(pid_t pid, uint64_t counts[MAX_SYSCALLS])
+{
+    bool counting = false;
+    int status;
+    pid_t tid;
+
+    if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)) return;
+
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    while ((tid = waitpid(-1, &status, __WALL)) > 0)
+    {
+        int deliver = 0;
+
+        // the server is a child as well, stop with the scenario
+        if (!WIFSTOPPED(status))
+        {
+            if (tid == pid) break;
+            continue;
+        }
+
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+        {
+            struct syscallInfo info;
+
+            if (counting && ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0
+                && info.op == 1 && info.nr < MAX_SYSCALLS)
+                counts[info.nr]++;
+        }
+        else if (WSTOPSIG(status) == SIGUSR1)
+        {
+            counting = !counting;
+        }
+        else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP && WSTOPSIG(status) != SIGTRAP)
+        {
+            // new threads start with a SIGSTOP, everything else is passed on
+            deliver = WSTOPSIG(status);
+        }
+
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void*)(long)deliver);
+    }
+}
+
+// one run in a child, `counts' asks for a traced run
+static bool runChild(const struct Scenario* scenario, struct Bench* bench, const char* work, struct Sample* sample,
+                     long* peak, uint64_t* counts)
+{
+    struct rusage usage;
+    int result[2], status;
+
+    snprintf(bench->scratch, sizeof(bench->scratch), "%s/run-XXXXXX", work);
+    if (!mkdtemp(bench->scratch) || pipe2(result, O_CLOEXEC)) return false;
+
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        close(result[0]);
+        runScenario(scenario, bench, counts != NULL, result[1]);
+    }
+
+    close(result[1]);
+
+    if (pid > 0 && counts) traceSyscalls(pid, counts);
+
+    bool success = pid > 0 && read(result[0], sample, sizeof(*sample)) == sizeof(*sample);
+
+    if (pid > 0 && !counts && wait4(pid, &status, 0, &usage) == pid) *peak = usage.ru_maxrss;
+
+    close(result[0]);
+    removePath(bench->scratch);
+
+    return success && sample->ok;
+}
+
+static int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+static double median(double* values, size_t count)
+{
+    qsort(values, count, sizeof(double), compareDoubles);
+
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+static void addInt(struct json_object* object, const char* key, int64_t value)
+{
+    json_object_object_add(object, key, json_object_new_int64(value));
+}
+
+static void addDouble(struct json_object* object, const char* key, double value)
+{
+    json_object_object_add(object, key, json_object_new_double(value));
+}
+
+// the scenario `repeat' times plus the traced run, medians of everything
+static struct json_object* measure(const struct Scenario* scenario, struct Bench* bench, const char* work, int repeat)
+{
+    double seconds[repeat], firstByte[repeat], peaks[repeat], allocations[repeat], frees[repeat], allocated[repeat];
+    uint64_t counts[MAX_SYSCALLS] = {0}, total = 0;
+    struct json_object* result = json_object_new_object();
+    struct Sample sample = {0};
+    bool ok = true;
+    long peak = 0;
+
+    for (int i = 0; ok && i < repeat; ++i)
+    {
+        ok = runChild(scenario, bench, work, &sample, &peak, NULL);
+
+        seconds[i] = sample.seconds;
+        firstByte[i] = sample.counters.firstByte;
+        peaks[i] = peak;
+        allocations[i] = sample.counters.allocations;
+        frees[i] = sample.counters.frees;
+        allocated[i] = sample.counters.allocated;
+    }
+
+    if (ok)
+    {
+        struct Sample traced;
+        ok = runChild(scenario, bench, work, &traced, &peak, counts);
+    }
+
+    json_object_object_add(result, "name", json_object_new_string(scenario->name));
+    json_object_object_add(result, "description", json_object_new_string(scenario->description));
+    json_object_object_add(result, "ok", json_object_new_boolean(ok));
+    if (!ok) return result;
+
+    double elapsed = median(seconds, repeat), first = median(firstByte, repeat);
+    struct json_object* names = json_object_new_object();
+    char buffer[32];
+
+    addInt(result, "runs", repeat);
+    addInt(result, "bytes", sample.bytes);
+    addDouble(result, "seconds", elapsed);
+    addDouble(result, "seconds_min", seconds[0]);
+    addDouble(result, "throughput_mib_s", elapsed > 0 ? sample.bytes / elapsed / (1024 * 1024) : 0);
+    addDouble(result, "first_byte_ms", first >= 0 ? first * 1000 : -1);
+    addInt(result, "peak_rss_kib", median(peaks, repeat));
+    addInt(result, "baseline_rss_kib", sample.baseline);
+    addInt(result, "allocations", median(allocations, repeat));
+    addInt(result, "frees", median(frees, repeat));
+    addInt(result, "allocated_bytes", median(allocated, repeat));
+
+    for (long nr = 0; nr < MAX_SYSCALLS; ++nr)
+    {
+        if (!counts[nr]) continue;
+
+        total += counts[nr];
+        addInt(names, syscallName(nr, buffer, sizeof(buffer)), counts[nr]);
+    }
+
+    addInt(result, "syscalls", total);
+    json_object_object_add(result, "syscalls_by_name", names);
+
+    return result;
+}
+
+static bool prepare(struct Bench* bench, const char* data, double scale)
+{
+    char files[PATH_MAX + 16], from[PATH_MAX], to[PATH_MAX + 64];
+
+    snprintf(files, sizeof(files), "%s/files", bench->root);
+
+    for (size_t i = 0; i < ARRAY_LEN(fixtures); ++i)
+    {
+        if (!fixtureCreate(&fixtures[i], files, scale)) return false;
+    }
+
+    // the recorded responses, where the scenarios ask for them
+    snprintf(from, sizeof(from), "%s/lutris-installer.json", data);
+    snprintf(to, sizeof(to), "%s/api/installers/" INSTALLER_SLUG, bench->root);
+    makeParentPath(to);
+    if (!copyFile(from, to, 0644))
+    {
+        printf("Cannot copy %s: %s\n", from, strerror(errno));
+        return false;
+    }
+
+    snprintf(from, sizeof(from), "%s/github-releases.json", data);
+    snprintf(to, sizeof(to), "%s/repos/lutris/dxvk/releases", bench->root);
+    makeParentPath(to);
+    if (!copyFile(from, to, 0644))
+    {
+        printf("Cannot copy %s: %s\n", from, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static void printResult(struct json_object* result)
+{
+    struct json_object* value;
+
+    json_object_object_get_ex(result, "name", &value);
+    printf("%-20s", json_object_get_string(value));
+
+    json_object_object_get_ex(result, "ok", &value);
+    if (!json_object_get_boolean(value))
+    {
+        puts(" failed");
+        return;
+    }
+
+    const char* keys[] = { "seconds", "throughput_mib_s", "first_byte_ms", "peak_rss_kib", "allocations", "syscalls" };
+    const char* formats[] = { " %8.3fs", " %9.1f MiB/s", " %9.1f ms", " %8.0f KiB", " %9.0f allocs", " %8.0f syscalls" };
+
+    for (size_t i = 0; i < ARRAY_LEN(keys); ++i)
+    {
+        json_object_object_get_ex(result, keys[i], &value);
+        printf(formats[i], json_object_get_double(value));
+    }
+    puts("");
+}
+
+static struct json_object* findScenario(struct json_object* results, const char* name)
+{
+    struct json_object* scenarios, *value;
+
+    json_object_object_get_ex(results, "scenarios", &scenarios);
+
+    for (size_t i = 0; i < json_object_array_length(scenarios); ++i)
+    {
+        struct json_object* scenario = json_object_array_get_idx(scenarios, i);
+
+        json_object_object_get_ex(scenario, "name", &value);
+        if (!strcmp(json_object_get_string(value), name)) return scenario;
+    }
+
+    return NULL;
+}
+
+// relative change of the metrics in `current' against `baseline'
+static void compare(struct json_object* current, struct json_object* baseline)
+{
+    const char* keys[] = { "seconds", "throughput_mib_s", "first_byte_ms", "peak_rss_kib", "allocations", "syscalls" };
+    struct json_object* scenarios, *value;
+
+    printf("\n%-20s %9s %9s %9s %9s %9s %9s\n", "change", "time", "MiB/s", "1st byte", "RSS", "allocs", "syscalls");
+
+    json_object_object_get_ex(current, "scenarios", &scenarios);
+
+    for (size_t i = 0; i < json_object_array_length(scenarios); ++i)
+    {
+        struct json_object* scenario = json_object_array_get_idx(scenarios, i), *old;
+
+        json_object_object_get_ex(scenario, "name", &value);
+        printf("%-20s", json_object_get_string(value));
+
+        if (!(old = findScenario(baseline, json_object_get_string(value))))
+        {
+            puts(" new");
+            continue;
+        }
+
+        for (size_t k = 0; k < ARRAY_LEN(keys); ++k)
+        {
+            struct json_object* before, *after;
+
+            if (!json_object_object_get_ex(scenario, keys[k], &after) || !json_object_object_get_ex(old, keys[k], &before)
+                || json_object_get_double(before) <= 0)
+            {
+                printf(" %9s", "-");
+                continue;
+            }
+
+            printf(" %+8.1f%%", (json_object_get_double(after) / json_object_get_double(before) - 1) * 100);
+        }
+        puts("");
+    }
+}
+
+static void printHelp(void)
+{
+    puts(USAGE "\n\n"
+         "Options:\n"
+         "\t--output <file>\t write the results as JSON\n"
+         "\t--compare <file>\t show the change to earlier results\n"
+         "\t--label <name>\t\t name of the results, like the commit\n"
+         "\t--scale <factor>\t files in the archives, 1 is about wine's size\n"
+         "\t--repeat <count>\t timed runs of each scenario, 3 by default\n"
+         "\t--latency <ms>\t\t added to every response of the mock server\n"
+         "\t--rate <bytes/s>\t limit of every response of the mock server\n"
+         "\t--work <dir>\t\t fixtures and scratch space, bench-work by default\n"
+         "\t--data <dir>\t\t recorded API responses, bench/data by default\n"
+         "\t--list\t\t\t show the scenarios\n"
+         "\t--verbose\t\t keep the output of the scenarios\n");
+}
+
+int main(int argc, char** argv)
+{
+    struct ServerOptions options = {0};
+    struct Server server;
+    struct Bench bench = {0};
+    const char* output = NULL, *baseline = NULL, *label = "", *data = "bench/data", *work = "bench-work";
+    double scale = 1;
+    int repeat = 3, first = 1;
+
+    for (; first < argc && !strncmp(argv[first], "--", 2); ++first)
+    {
+        const char* option = argv[first];
+        const char* value = first + 1 < argc ? argv[first + 1] : NULL;
+
+        if (!strcmp(option, "--list"))
+        {
+            for (size_t i = 0; i < ARRAY_LEN(scenarios); ++i) printf("%-20s %s\n", scenarios[i].name, scenarios[i].description);
+            return 0;
+        }
+        else if (!strcmp(option, "--verbose"))
+        {
+            bench.verbose = true;
+            continue;
+        }
+        else if (!value)
+        {
+            printHelp();
+            return 1;
+        }
+        else if (!strcmp(option, "--output")) output = value;
+        else if (!strcmp(option, "--compare")) baseline = value;
+        else if (!strcmp(option, "--label")) label = value;
+        else if (!strcmp(option, "--scale")) scale = atof(value);
+        else if (!strcmp(option, "--repeat")) repeat = atoi(value);
+        else if (!strcmp(option, "--latency")) options.latency = atol(value);
+        else if (!strcmp(option, "--rate")) options.rate = atol(value);
+        else if (!strcmp(option, "--work")) work = value;
+        else if (!strcmp(option, "--data")) data = value;
+        else
+        {
+            printf("unknown option `%s'\n", option);
+            printHelp();
+            return 1;
+        }
+
+        // all but the flags take a value
+        ++first;
+    }
+
+    if (repeat < 1 || scale <= 0)
+    {
+        printHelp();
+        return 1;
+    }
+
+    char workdir[PATH_MAX];
+    makePath(work);
+    if (!realpath(work, workdir)) return 1;
+
+    snprintf(bench.root, sizeof(bench.root), "%s/www", workdir);
+    if (!prepare(&bench, data, scale)) return 1;
+
+    options.root = bench.root;
+    if (!serverStart(&options, &server))
+    {
+        puts("Cannot start the mock server");
+        return 1;
+    }
+
+    snprintf(bench.base, sizeof(bench.base), "http://127.0.0.1:%i/", server.port);
+
+    struct json_object* results = json_object_new_object(), *list = json_object_new_array();
+    struct utsname host;
+    char date[32];
+    time_t t = time(NULL);
+    bool failed = false;
+
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    uname(&host);
+
+    json_object_object_add(results, "version", json_object_new_string(VERSION));
+    json_object_object_add(results, "label", json_object_new_string(label));
+    json_object_object_add(results, "date", json_object_new_string(date));
+    json_object_object_add(results, "kernel", json_object_new_string(host.release));
+    addInt(results, "cpus", sysconf(_SC_NPROCESSORS_ONLN));
+    addDouble(results, "scale", scale);
+    addInt(results, "repeat", repeat);
+
+    for (size_t i = 0; i < ARRAY_LEN(scenarios); ++i)
+    {
+        bool selected = first == argc;
+
+        for (int j = first; j < argc; ++j) selected |= !strcmp(argv[j], scenarios[i].name);
+        if (!selected) continue;
+
+        struct json_object* result = measure(&scenarios[i], &bench, workdir, repeat), *ok;
+
+        json_object_object_get_ex(result, "ok", &ok);
+        failed |= !json_object_get_boolean(ok);
+
+        printResult(result);
+        json_object_array_add(list, result);
+    }
+
+    serverStop(&server);
+
+    json_object_object_add(results, "scenarios", list);
+
+    if (output && json_object_to_file_ext(output, results, JSON_C_TO_STRING_PRETTY))
+    {
+        printf("Cannot write %s\n", output);
+        failed = true;
+    }
+    else if (output)
+    {
+        printf("Results in %s\n", output);
+    }
+
+    if (baseline)
+    {
+        struct json_object* old = json_object_from_file(baseline);
+
+        if (old) compare(results, old);
+        else printf("Cannot read %s\n", baseline);
+
+        json_object_put(old);
+    }
+
+    json_object_put(results);
+
+    return failed;
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <archive.h>
+#include <archive_entry.h>
+
+#include "fixture.h"
+#include "common.h"
+
+/*
+ * file contents come from a generator seeded with the fixture name, a mix
+ * of a small vocabulary and noise that compresses about as well as wine's
+ * dlls and shared objects do, entries have fixed owners and times
+ * a fixture is only written again when its description changes
+ */
+
+#define FIXTURE_VERSION 1
+#define VOCABULARY 256
+
+static uint64_t nextRandom(uint64_t* state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+static void fillContent(uint8_t* data, size_t size, const uint64_t vocabulary[VOCABULARY], uint64_t* state)
+{
+    size_t i = 0;
+
+    while (i < size)
+    {
+        uint64_t r = nextRandom(state);
+        uint64_t word = (r & 3) ? vocabulary[(r >> 8) % VOCABULARY] : nextRandom(state);
+        size_t length = size - i < sizeof(word) ? size - i : sizeof(word);
+
+        memcpy(data + i, &word, length);
+        i += length;
+    }
+}
+
+static void describe(const struct Fixture* fixture, char* buffer, size_t size)
+{
+    snprintf(buffer, size, "version %i\nfilter %s\nlayout %s\nfiles %zu\nmin %zu\nmax %zu\n", FIXTURE_VERSION,
+             fixture->filter, fixture->layout, fixture->count, fixture->minSize, fixture->maxSize);
+}
+
+// the description next to the archive, with the content size it ended up with
+static bool isCurrent(struct Fixture* fixture, const char* meta, const char* expected)
+{
+    char buffer[1024] = "", line[256], value[64];
+    size_t used = 0;
+    FILE* file = fopen(meta, "r");
+
+    if (!file || !isFile(fixture->path))
+    {
+        if (file) fclose(file);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), file))
+    {
+        if (readKeyValue(line, "content", value, sizeof(value))) fixture->content = strtoull(value, NULL, 10);
+        else if (used < sizeof(buffer)) used += snprintf(buffer + used, sizeof(buffer) - used, "%s", line);
+    }
+    fclose(file);
+
+    return !strcmp(buffer, expected);
+}
+
+static bool writeArchive(struct Fixture* fixture, const char* temp)
+{
+    uint64_t vocabulary[VOCABULARY], state = hashString(fixture->name) | 1;
+    uint8_t* data = malloc(fixture->maxSize ? fixture->maxSize : 1);
+    struct archive* archive = archive_write_new();
+    struct archive_entry* entry = archive_entry_new();
+    bool success = data && archive && entry;
+
+    for (size_t i = 0; i < VOCABULARY; ++i) vocabulary[i] = nextRandom(&state);
+
+    if (success)
+    {
+        archive_write_set_format_pax_restricted(archive);
+
+        if (!strcmp(fixture->filter, "xz"))
+        {
+            archive_write_add_filter_xz(archive);
+            archive_write_set_filter_option(archive, "xz", "compression-level", "1");
+        }
+        else
+        {
+            archive_write_add_filter_zstd(archive);
+        }
+
+        success = archive_write_open_filename(archive, temp) == ARCHIVE_OK;
+    }
+
+    fixture->content = 0;
+
+    for (size_t i = 0; success && i < fixture->count; ++i)
+    {
+        char name[PATH_MAX];
+        size_t size = fixture->minSize + nextRandom(&state) % (fixture->maxSize - fixture->minSize + 1);
+
+        snprintf(name, sizeof(name), fixture->layout, i % 64, i);
+        fillContent(data, size, vocabulary, &state);
+
+        archive_entry_clear(entry);
+        archive_entry_set_pathname(entry, name);
+        archive_entry_set_filetype(entry, AE_IFREG);
+        archive_entry_set_perm(entry, 0644);
+        archive_entry_set_size(entry, size);
+        archive_entry_set_mtime(entry, 1700000000, 0);
+
+        success = archive_write_header(archive, entry) == ARCHIVE_OK && archive_write_data(archive, data, size) == (la_ssize_t)size;
+        fixture->content += size;
+    }
+
+    if (archive)
+    {
+        if (archive_write_close(archive) != ARCHIVE_OK) success = false;
+        if (!success) printf("Cannot write %s: %s\n", fixture->name, archive_error_string(archive));
+        archive_write_free(archive);
+    }
+
+    archive_entry_free(entry);
+    free(data);
+
+    return success;
+}
+
+// writes the fixture below `dir' unless it is already there
+bool fixtureCreate(struct Fixture* fixture, const char* dir, double scale)
+{
+    char meta[PATH_MAX + 8], temp[PATH_MAX + 8], expected[1024];
+
+    fixture->count = fixture->files * scale > 1 ? fixture->files * scale : 1;
+
+    snprintf(fixture->path, sizeof(fixture->path), "%s/%s", dir, fixture->name);
+    snprintf(meta, sizeof(meta), "%s.meta", fixture->path);
+    snprintf(temp, sizeof(temp), "%s.tmp", fixture->path);
+
+    describe(fixture, expected, sizeof(expected));
+    if (isCurrent(fixture, meta, expected)) return true;
+
+    printf("Creating %s...\n", fixture->name);
+    makePath(dir);
+
+    if (!writeArchive(fixture, temp) || rename(temp, fixture->path))
+    {
+        unlink(temp);
+        return false;
+    }
+
+    FILE* file = fopen(meta, "w");
+    if (!file) return false;
+
+    fprintf(file, "%scontent %" PRIu64 "\n", expected, fixture->content);
+
+    return !fclose(file);
+}
@@ -0,0 +1,24 @@
+#ifndef FIXTURE_H
+#define FIXTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/limits.h>
+
+// a synthetic tarball, the same bytes for the same description every time
+struct Fixture {
+    const char* name;                   // file name below the fixture directory
+    const char* filter;                 // "xz" or "zstd"
+    const char* layout;                 // printf pattern for the entry of file i
+    size_t files;                       // at scale 1
+    size_t minSize, maxSize;            // of a file
+
+    char path[PATH_MAX];                // filled in by fixtureCreate
+    size_t count;                       // files at the chosen scale
+    uint64_t content;                   // bytes of all files
+};
+
+bool fixtureCreate(struct Fixture*, const char* dir, double scale);
+
+#endif
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "probe.h"
+#include "memory.h"
+
+/*
+ * counters for the scenario running in this process
+ * the allocator functions replace glibc's for the whole process, shared
+ * libraries included, and pass everything on to the __libc_ ones
+ * the first byte written is the first write to a regular file, through
+ * libc's write or pwrite, or the first memoryAppend (the bench binary is
+ * linked with --wrap=memoryAppend) for downloads kept in memory
+ */
+
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+extern void* __libc_memalign(size_t, size_t);
+extern void __libc_free(void*);
+extern size_t __real_memoryAppend(struct MemoryStruct*, const void*, size_t);
+
+static atomic_bool probing;
+static atomic_uint_fast64_t allocations, frees, allocated;
+static atomic_uint_fast64_t firstByte;
+static struct timespec started;
+
+static uint64_t elapsed(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - started.tv_sec) * 1000000000ull + now.tv_nsec - started.tv_nsec;
+}
+
+static void countAllocation(size_t size)
+{
+    if (!atomic_load_explicit(&probing, memory_order_relaxed)) return;
+
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocated, size, memory_order_relaxed);
+}
+
+// 0 means not yet, the stamp is at least 1ns
+static void stampFirstByte(void)
+{
+    uint_fast64_t none = 0;
+
+    if (atomic_load_explicit(&probing, memory_order_relaxed) && !atomic_load_explicit(&firstByte, memory_order_relaxed))
+        atomic_compare_exchange_strong(&firstByte, &none, elapsed() | 1);
+}
+
+static void stampFile(int fd)
+{
+    struct stat sb;
+
+    if (atomic_load_explicit(&probing, memory_order_relaxed) && !atomic_load_explicit(&firstByte, memory_order_relaxed)
+        && !fstat(fd, &sb) && S_ISREG(sb.st_mode))
+        stampFirstByte();
+}
+
+void probeStart(void)
+{
+    atomic_store(&allocations, 0);
+    atomic_store(&frees, 0);
+    atomic_store(&allocated, 0);
+    atomic_store(&firstByte, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    atomic_store(&probing, true);
+}
+
+void probeStop(struct ProbeCounters* counters)
+{
+    atomic_store(&probing, false);
+
+    counters->allocations = atomic_load(&allocations);
+    counters->frees = atomic_load(&frees);
+    counters->allocated = atomic_load(&allocated);
+    counters->firstByte = atomic_load(&firstByte) ? atomic_load(&firstByte) / 1e9 : -1;
+}
+
+void* malloc(size_t size)
+{
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    countAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size)
+{
+    countAllocation(size);
+    return __libc_realloc(pointer, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    countAllocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size)
+{
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size)
+{
+    void* allocation = memalign(alignment, size);
+    if (!allocation) return ENOMEM;
+
+    *pointer = allocation;
+    return 0;
+}
+
+void free(void* pointer)
+{
+    if (pointer && atomic_load_explicit(&probing, memory_order_relaxed))
+        atomic_fetch_add_explicit(&frees, 1, memory_order_relaxed);
+
+    __libc_free(pointer);
+}
+
+ssize_t write(int fd, const void* data, size_t size)
+{
+    stampFile(fd);
+    return syscall(SYS_write, fd, data, size);
+}
+
+ssize_t pwrite(int fd, const void* data, size_t size, off_t offset)
+{
+    stampFile(fd);
+    return syscall(SYS_pwrite64, fd, data, size, offset);
+}
+
+ssize_t pwrite64(int fd, const void* data, size_t size, off_t offset) __attribute__((alias("pwrite")));
+
+size_t __wrap_memoryAppend(struct MemoryStruct* mem, const void* data, size_t size)
+{
+    if (size) stampFirstByte();
+    return __real_memoryAppend(mem, data, size);
+}
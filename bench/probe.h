@@ -0,0 +1,17 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct ProbeCounters {
+    uint64_t allocations;               // malloc, calloc, realloc and the aligned ones
+    uint64_t frees;
+    uint64_t allocated;                 // bytes asked for
+    double firstByte;                   // seconds from probeStart to the first byte written, -1 if none
+};
+
+void probeStart(void);
+void probeStop(struct ProbeCounters*);
+
+#endif
@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/limits.h>
+
+#include "server.h"
+
+/*
+ * a small HTTP/1.1 file server on 127.0.0.1 for the benchmarks
+ * it serves files below the root with ETag, If-None-Match and
+ * "Range: bytes=N-", keeps connections alive like the real servers do,
+ * and takes per request options from the front of the path:
+ *   /latency/<ms>/rate/<bytes per second>/files/wine.tar.xz
+ * it runs in a process of its own so it doesn't show up in the counters
+ */
+
+#define SEND_CHUNK (64 * 1024)
+
+struct connection {
+    int fd;
+    const struct ServerOptions* options;
+};
+
+static void sleepFor(long ms)
+{
+    struct timespec delay = { ms / 1000, (ms % 1000) * 1000000 };
+
+    while (nanosleep(&delay, &delay) && errno == EINTR);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool sendAll(int fd, const void* data, size_t size)
+{
+    const char* bytes = data;
+
+    while (size)
+    {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+
+        if (sent < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        bytes += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+// strips "/latency/<ms>" and "/rate/<bps>" from the front of `path'
+static const char* pathOptions(const char* path, long* latency, long* rate)
+{
+    for (;;)
+    {
+        char* end;
+
+        if (!strncmp(path, "/latency/", 9)) *latency = strtol(path + 9, &end, 10);
+        else if (!strncmp(path, "/rate/", 6)) *rate = strtol(path + 6, &end, 10);
+        else return path;
+
+        path = end;
+    }
+}
+
+static bool sendStatus(int fd, int status, const char* reason, bool keepalive)
+{
+    char header[256];
+    int length = snprintf(header, sizeof(header), "HTTP/1.1 %i %s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+                          status, reason, keepalive ? "keep-alive" : "close");
+
+    return sendAll(fd, header, length);
+}
+
+// sends the file from `offset', `rate' bytes/s at most
+static bool sendBody(int sock, int fd, off_t offset, off_t size, long rate)
+{
+    char buffer[SEND_CHUNK];
+    double start = now();
+    off_t sent = 0;
+
+    if (lseek(fd, offset, SEEK_SET) < 0) return false;
+
+    while (sent < size - offset)
+    {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length <= 0) return false;
+
+        if (rate > 0)
+        {
+            double due = start + (double)(sent + length) / rate - now();
+            if (due > 0) sleepFor(due * 1000);
+        }
+
+        if (!sendAll(sock, buffer, length)) return false;
+        sent += length;
+    }
+
+    return true;
+}
+
+static bool respond(struct connection* conn, const char* method, const char* target, const char* range,
+                    const char* ifnonematch, bool keepalive)
+{
+    const struct ServerOptions* options = conn->options;
+    long latency = options->latency, rate = options->rate;
+    char path[PATH_MAX], etag[64], header[512];
+    struct stat sb;
+    off_t offset = 0;
+
+    const char* name = pathOptions(target, &latency, &rate);
+    name += strspn(name, "/");
+    name = strndupa(name, strcspn(name, "?#"));
+
+    if (latency > 0) sleepFor(latency);
+
+    snprintf(path, sizeof(path), "%s/%s", options->root, name);
+    if (strstr(name, "..") || stat(path, &sb) || !S_ISREG(sb.st_mode)) return sendStatus(conn->fd, 404, "Not Found", keepalive);
+
+    snprintf(etag, sizeof(etag), "\"%" PRIx64 "-%" PRIx64 "\"", (uint64_t)sb.st_size, (uint64_t)sb.st_mtime);
+
+    if (ifnonematch && !strcmp(ifnonematch, etag)) return sendStatus(conn->fd, 304, "Not Modified", keepalive);
+
+    if (range && !strncmp(range, "bytes=", 6)) offset = strtoll(range + 6, NULL, 10);
+    if (offset && offset >= sb.st_size) return sendStatus(conn->fd, 416, "Range Not Satisfiable", keepalive);
+
+    int length = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Length: %" PRId64 "\r\nETag: %s\r\n"
+                          "Accept-Ranges: bytes\r\nConnection: %s\r\n",
+                          offset ? "206 Partial Content" : "200 OK", (int64_t)(sb.st_size - offset), etag,
+                          keepalive ? "keep-alive" : "close");
+
+    if (offset)
+    {
+        length += snprintf(header + length, sizeof(header) - length, "Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n",
+                           (int64_t)offset, (int64_t)sb.st_size - 1, (int64_t)sb.st_size);
+    }
+
+    length += snprintf(header + length, sizeof(header) - length, "\r\n");
+    if (!sendAll(conn->fd, header, length)) return false;
+
+    if (!strcmp(method, "HEAD")) return true;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    bool success = fd >= 0 && sendBody(conn->fd, fd, offset, sb.st_size, rate);
+
+    if (fd >= 0) close(fd);
+
+    return success;
+}
+
+// value of `name' in the header block, NULL if it isn't there
+static char* headerValue(char* headers, const char* name)
+{
+    size_t length = strlen(name);
+
+    for (char* line = strstr(headers, "\r\n"); line && line[2]; line = strstr(line + 2, "\r\n"))
+    {
+        if (!strncasecmp(line + 2, name, length) && line[2 + length] == ':')
+        {
+            char* value = line + 3 + length;
+            value += strspn(value, " ");
+
+            return strndup(value, strcspn(value, "\r\n"));
+        }
+    }
+
+    return NULL;
+}
+
+static void* serveConnection(void* data)
+{
+    struct connection* conn = data;
+    char request[8192];
+    size_t used = 0;
+    bool keepalive = true;
+
+    while (keepalive)
+    {
+        char* end;
+        ssize_t length = 1;
+
+        // a request is small, everything up to the blank line
+        while (!(end = memmem(request, used, "\r\n\r\n", 4)) && length > 0)
+        {
+            length = used < sizeof(request) - 1 ? recv(conn->fd, request + used, sizeof(request) - 1 - used, 0) : -1;
+            if (length > 0) used += length;
+        }
+
+        if (!end) break;
+
+        end[2] = '\0';
+
+        char method[16], target[PATH_MAX];
+        if (sscanf(request, "%15s %4095s", method, target) != 2) break;
+
+        char* range = headerValue(request, "Range");
+        char* ifnonematch = headerValue(request, "If-None-Match");
+        char* connection = headerValue(request, "Connection");
+
+        keepalive = !connection || strcasecmp(connection, "close");
+        bool success = respond(conn, method, target, range, ifnonematch, keepalive);
+
+        free(range);
+        free(ifnonematch);
+        free(connection);
+
+        if (!success) break;
+
+        // pipelined requests stay in the buffer
+        used -= end + 4 - request;
+        memmove(request, end + 4, used);
+    }
+
+    close(conn->fd);
+    free(conn);
+
+    return NULL;
+}
+
+static void serve(int listener, const struct ServerOptions* options)
+{
+    for (;;)
+    {
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct connection* conn = malloc(sizeof(struct connection));
+        pthread_t thread;
+
+        if (!conn)
+        {
+            close(fd);
+            continue;
+        }
+
+        conn->fd = fd;
+        conn->options = options;
+
+        if (pthread_create(&thread, NULL, serveConnection, conn))
+        {
+            close(fd);
+            free(conn);
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+}
+
+// forks the server, it listens on a free port by the time this returns
+bool serverStart(const struct ServerOptions* options, struct Server* server)
+{
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t size = sizeof(address);
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+
+    if (listener < 0) return false;
+
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) || listen(listener, 64)
+        || getsockname(listener, (struct sockaddr*)&address, &size))
+    {
+        close(listener);
+        return false;
+    }
+
+    server->port = ntohs(address.sin_port);
+    server->pid = fork();
+
+    if (server->pid == 0)
+    {
+        serve(listener, options);
+        _exit(0);
+    }
+
+    close(listener);
+
+    return server->pid > 0;
+}
+
+void serverStop(struct Server* server)
+{
+    if (server->pid > 0)
+    {
+        kill(server->pid, SIGTERM);
+        waitpid(server->pid, NULL, 0);
+        server->pid = 0;
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// every response waits `latency' ms and is sent at most `rate' bytes/s, 0 is unlimited
+struct ServerOptions {
+    const char* root;
+    long latency;
+    long rate;
+};
+
+struct Server {
+    pid_t pid;
+    int port;
+};
+
+bool serverStart(const struct ServerOptions*, struct Server*);
+void serverStop(struct Server*);
+
+#endif
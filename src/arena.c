@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define ALIGNMENT sizeof(max_align_t)
+
+struct Arena* arenaNew(void)
+{
+    return calloc(1, sizeof(struct Arena));
+}
+
+void arenaFree(struct Arena* arena)
+{
+    if (arena)
+    {
+        struct ArenaBlock* block = arena->head;
+
+        while (block)
+        {
+            struct ArenaBlock* next = block->next;
+            free(block);
+            block = next;
+        }
+
+        free(arena);
+    }
+}
+
+// aligned for any type, requests larger than a block get a block of their own
+void* arenaAlloc(struct Arena* arena, size_t size)
+{
+    struct ArenaBlock* block = arena->head;
+
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+    if (!block || block->capacity - block->used < size)
+    {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+        block = malloc(sizeof(struct ArenaBlock) + capacity);
+        if (!block) return NULL;
+
+        block->used = 0;
+        block->capacity = capacity;
+
+        // a full sized head keeps serving small requests
+        if (arena->head && size > ARENA_BLOCK_SIZE)
+        {
+            block->next = arena->head->next;
+            arena->head->next = block;
+        }
+        else
+        {
+            block->next = arena->head;
+            arena->head = block;
+        }
+    }
+
+    void* pointer = (uint8_t*)block->data + block->used;
+    block->used += size;
+
+    return pointer;
+}
+
+/*
+ * copies `length' bytes of `str' with its length in front,
+ * the copy is still NUL terminated so it works as a plain string
+ */
+char* arenaString(struct Arena* arena, const char* str, size_t length)
+{
+    size_t* slice = arenaAlloc(arena, sizeof(size_t) + length + 1);
+    if (!slice) return NULL;
+
+    char* copy = (char*)(slice + 1);
+
+    *slice = length;
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+
+    return copy;
+}
+
+size_t arenaStringLength(const char* str)
+{
+    return ((const size_t*)str)[-1];
+}
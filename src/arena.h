@@ -0,0 +1,30 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+
+/*
+ * bump allocator, everything in it is released at once by arenaFree
+ * blocks never move, so pointers into the arena stay valid
+ */
+struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t capacity;
+    max_align_t data[];
+};
+
+struct Arena {
+    struct ArenaBlock* head;
+};
+
+struct Arena* arenaNew(void);
+void arenaFree(struct Arena*);
+
+void* arenaAlloc(struct Arena*, size_t);
+char* arenaString(struct Arena*, const char*, size_t);
+size_t arenaStringLength(const char*);
+
+#endif
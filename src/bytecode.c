@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "bytecode.h"
+#include "arena.h"
+#include "cache.h"
+#include "net.h"
+#include "common.h"
+#include "config.h"
+
+/*
+ * parsed installers compiled into <cache dir>/installers/<hash>.bin
+ *   header     magic, format version, size_t width, revision (updated_at),
+ *              stamp of the cached response, checksum, counts, metadata
+ *   files      filename and url offsets
+ *   opcodes    directive, task, argument count and first argument
+ *   arguments  pool offsets, identical strings are stored once
+ *   pool       arena strings: length in front, NUL terminated
+ * loading copies the pool into the script's arena in one piece and
+ * only builds the pointer arrays around it, nothing is parsed
+ */
+
+#define BYTECODE_MAGIC   "PCSCRPT"
+#define BYTECODE_VERSION 2
+#define NO_STRING        UINT32_MAX
+
+// the cache dir, "/installers/", the hash and ".bin"
+#define BYTECODE_PATH_MAX (PATH_MAX + 32)
+
+enum meta {
+    META_NAME,
+    META_VERSION,
+    META_DESCRIPTION,
+    META_NOTES,
+    META_WINE,
+
+    META_MAX
+};
+
+struct BytecodeHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t wordsize;
+    uint64_t revision;
+    uint64_t stamp;
+    uint64_t checksum;
+    uint64_t poolsize;
+    uint32_t runner;
+    uint32_t filecount;
+    uint32_t opcount;
+    uint32_t argcount;
+    uint32_t meta[META_MAX];
+    uint32_t reserved;
+};
+
+struct BytecodeFile {
+    uint32_t filename;
+    uint32_t url;
+};
+
+struct BytecodeOp {
+    uint8_t opcode;
+    uint8_t task;
+    uint16_t argc;
+    uint32_t args;
+};
+
+// strings of a script being compiled, interned by content
+struct StringPool {
+    char* data;
+    size_t size;
+    size_t capacity;
+
+    uint32_t* slots;
+    size_t slotcount;
+    size_t used;
+};
+
+static void getBytecodePath(char* buffer, size_t size, const char* URL)
+{
+    char cachedir[PATH_MAX];
+    getCacheDir(cachedir, sizeof(cachedir));
+
+    snprintf(buffer, size, "%s/installers/%016" PRIx64 ".bin", cachedir, hashString(URL));
+}
+
+static size_t alignWord(size_t size)
+{
+    return (size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+static size_t getPoolOffset(const struct BytecodeHeader* header)
+{
+    return alignWord(sizeof(struct BytecodeHeader) + (size_t)header->filecount * sizeof(struct BytecodeFile)
+                     + (size_t)header->opcount * sizeof(struct BytecodeOp) + (size_t)header->argcount * sizeof(uint32_t));
+}
+
+static uint64_t getChecksum(const struct BytecodeHeader* header, size_t size)
+{
+    return hashBytes(header + 1, size - sizeof(struct BytecodeHeader));
+}
+
+static uint64_t getRevision(const char* revision)
+{
+    return revision && revision[0] ? hashString(revision) : 0;
+}
+
+static bool growSlots(struct StringPool* pool)
+{
+    size_t count = pool->slotcount ? pool->slotcount * 2 : 256;
+    uint32_t* slots = malloc(count * sizeof(uint32_t));
+
+    if (!slots) return false;
+
+    memset(slots, 0xff, count * sizeof(uint32_t));
+
+    for (size_t i = 0; i < pool->slotcount; ++i)
+    {
+        if (pool->slots[i] == NO_STRING) continue;
+
+        size_t slot = hashString(pool->data + pool->slots[i]) & (count - 1);
+        while (slots[slot] != NO_STRING) slot = (slot + 1) & (count - 1);
+        slots[slot] = pool->slots[i];
+    }
+
+    free(pool->slots);
+    pool->slots = slots;
+    pool->slotcount = count;
+
+    return true;
+}
+
+// offset of `str' in the pool, added the first time it is seen
+static uint32_t intern(struct StringPool* pool, const char* str)
+{
+    if (!str) return NO_STRING;
+
+    if (pool->used * 2 >= pool->slotcount && !growSlots(pool)) return NO_STRING;
+
+    size_t slot = hashString(str) & (pool->slotcount - 1);
+
+    for (; pool->slots[slot] != NO_STRING; slot = (slot + 1) & (pool->slotcount - 1))
+    {
+        if (!strcmp(pool->data + pool->slots[slot], str)) return pool->slots[slot];
+    }
+
+    size_t length = strlen(str);
+    size_t start = alignWord(pool->size);
+    size_t end = start + sizeof(size_t) + length + 1;
+
+    if (end >= NO_STRING) return NO_STRING;
+
+    if (end > pool->capacity)
+    {
+        size_t capacity = pool->capacity ? pool->capacity * 2 : 4096;
+        while (capacity < end) capacity *= 2;
+
+        char* data = realloc(pool->data, capacity);
+        if (!data) return NO_STRING;
+
+        pool->data = data;
+        pool->capacity = capacity;
+    }
+
+    memset(pool->data + pool->size, 0, start - pool->size);
+    memcpy(pool->data + start, &length, sizeof(size_t));
+    memcpy(pool->data + start + sizeof(size_t), str, length + 1);
+    pool->size = end;
+
+    pool->slots[slot] = start + sizeof(size_t);
+    pool->used++;
+
+    return pool->slots[slot];
+}
+
+// one allocation holding the whole file
+static void* compile(const struct script_t* script, uint64_t revision, uint64_t stamp, size_t* imagesize)
+{
+    struct StringPool pool = {0};
+    struct BytecodeHeader header = {0};
+    struct BytecodeFile* files = calloc(script->filecount + 1, sizeof(struct BytecodeFile));
+    struct BytecodeOp* ops = calloc(script->directivecount + 1, sizeof(struct BytecodeOp));
+    uint32_t* args = NULL;
+    size_t argcount = 0;
+    void* image = NULL;
+    bool failed = !files || !ops;
+
+    const char* meta[META_MAX] = {
+        [META_NAME] = script->name,
+        [META_VERSION] = script->version,
+        [META_DESCRIPTION] = script->description,
+        [META_NOTES] = script->notes,
+        [META_WINE] = script->wine,
+    };
+
+    for (size_t i = 0; !failed && i < META_MAX; ++i)
+    {
+        header.meta[i] = intern(&pool, meta[i]);
+        failed = meta[i] && header.meta[i] == NO_STRING;
+    }
+
+    for (size_t i = 0; !failed && i < script->filecount; ++i)
+    {
+        files[i].filename = intern(&pool, script->files[i]->filename);
+        files[i].url = intern(&pool, script->files[i]->url);
+        failed = files[i].filename == NO_STRING || files[i].url == NO_STRING;
+    }
+
+    for (size_t i = 0; !failed && i < script->directivecount; ++i)
+    {
+        const struct directive_t* directive = script->directives[i];
+        uint32_t* grown = realloc(args, (argcount + directive->size + 1) * sizeof(uint32_t));
+
+        if (!grown || directive->size > UINT16_MAX)
+        {
+            failed = true;
+            break;
+        }
+
+        args = grown;
+        ops[i].opcode = directive->command;
+        ops[i].task = directive->task;
+        ops[i].argc = directive->size;
+        ops[i].args = argcount;
+
+        for (size_t j = 0; !failed && j < directive->size; ++j)
+        {
+            args[argcount] = intern(&pool, directive->arguments[j]);
+            failed = args[argcount++] == NO_STRING;
+        }
+    }
+
+    // an empty pool would not pass the checks
+    if (!failed && !pool.size) failed = intern(&pool, "") == NO_STRING;
+
+    if (!failed)
+    {
+        memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+        header.version = BYTECODE_VERSION;
+        header.wordsize = sizeof(size_t);
+        header.revision = revision;
+        header.stamp = stamp;
+        header.poolsize = pool.size;
+        header.runner = script->runner;
+        header.filecount = script->filecount;
+        header.opcount = script->directivecount;
+        header.argcount = argcount;
+
+        *imagesize = getPoolOffset(&header) + pool.size;
+        image = calloc(1, *imagesize);
+    }
+
+    if (image)
+    {
+        char* cursor = image;
+
+        memcpy(cursor, &header, sizeof(header));
+        cursor += sizeof(header);
+        memcpy(cursor, files, script->filecount * sizeof(struct BytecodeFile));
+        cursor += script->filecount * sizeof(struct BytecodeFile);
+        memcpy(cursor, ops, script->directivecount * sizeof(struct BytecodeOp));
+        cursor += script->directivecount * sizeof(struct BytecodeOp);
+        if (argcount) memcpy(cursor, args, argcount * sizeof(uint32_t));
+        memcpy((char*)image + getPoolOffset(&header), pool.data, pool.size);
+
+        ((struct BytecodeHeader*)image)->checksum = getChecksum(image, *imagesize);
+    }
+
+    free(pool.data);
+    free(pool.slots);
+    free(files);
+    free(ops);
+    free(args);
+
+    return image;
+}
+
+static bool validString(const char* pool, uint64_t poolsize, uint32_t offset)
+{
+    size_t length;
+
+    if (offset < sizeof(size_t) || offset >= poolsize || offset % sizeof(size_t)) return false;
+
+    memcpy(&length, pool + offset - sizeof(size_t), sizeof(size_t));
+
+    return length < poolsize - offset && !pool[offset + length];
+}
+
+// checks everything a load relies on, a bad file is just compiled again
+static const struct BytecodeHeader* checkImage(const void* data, size_t size)
+{
+    const struct BytecodeHeader* header = data;
+
+    if (size < sizeof(struct BytecodeHeader) || memcmp(header->magic, BYTECODE_MAGIC, sizeof(header->magic))
+        || header->version != BYTECODE_VERSION || header->wordsize != sizeof(size_t) || header->runner >= RUNNERMAX
+        || header->poolsize > size || size != getPoolOffset(header) + header->poolsize
+        || getChecksum(header, size) != header->checksum)
+    {
+        return NULL;
+    }
+
+    const struct BytecodeFile* files = (const struct BytecodeFile*)(header + 1);
+    const struct BytecodeOp* ops = (const struct BytecodeOp*)(files + header->filecount);
+    const uint32_t* args = (const uint32_t*)(ops + header->opcount);
+    const char* pool = (const char*)data + getPoolOffset(header);
+
+    for (size_t i = 0; i < META_MAX; ++i)
+    {
+        if (header->meta[i] != NO_STRING && !validString(pool, header->poolsize, header->meta[i])) return NULL;
+    }
+
+    for (size_t i = 0; i < header->filecount; ++i)
+    {
+        if (!validString(pool, header->poolsize, files[i].filename) || !validString(pool, header->poolsize, files[i].url)) return NULL;
+    }
+
+    for (size_t i = 0; i < header->opcount; ++i)
+    {
+        if (ops[i].opcode > UNKNOWN_DIRECTIVE || ops[i].task > UNKNOWN_TASK
+            || (uint64_t)ops[i].args + ops[i].argc > header->argcount)
+            return NULL;
+    }
+
+    for (size_t i = 0; i < header->argcount; ++i)
+    {
+        if (!validString(pool, header->poolsize, args[i])) return NULL;
+    }
+
+    return header;
+}
+
+static bool loadImage(const struct BytecodeHeader* header, struct script_t* script)
+{
+    struct Arena* arena = script->arena;
+    struct script_t loaded = *script;
+    const struct BytecodeFile* files = (const struct BytecodeFile*)(header + 1);
+    const struct BytecodeOp* ops = (const struct BytecodeOp*)(files + header->filecount);
+    const uint32_t* args = (const uint32_t*)(ops + header->opcount);
+    char* pool = arenaAlloc(arena, header->poolsize);
+
+    if (!pool) return false;
+
+    memcpy(pool, (const char*)header + getPoolOffset(header), header->poolsize);
+
+#define STRING(offset) ((offset) == NO_STRING ? NULL : pool + (offset))
+    loaded.name = STRING(header->meta[META_NAME]);
+    loaded.version = STRING(header->meta[META_VERSION]);
+    loaded.description = STRING(header->meta[META_DESCRIPTION]);
+    loaded.notes = STRING(header->meta[META_NOTES]);
+    loaded.wine = STRING(header->meta[META_WINE]);
+#undef STRING
+
+    loaded.runner = header->runner;
+    loaded.filecount = header->filecount;
+    loaded.directivecount = header->opcount;
+    loaded.error = NONE;
+
+    loaded.files = arenaAlloc(arena, header->filecount * sizeof(void*));
+    loaded.directives = arenaAlloc(arena, header->opcount * sizeof(void*));
+    if (!loaded.files || !loaded.directives) return false;
+
+    for (size_t i = 0; i < header->filecount; ++i)
+    {
+        if (!(loaded.files[i] = arenaAlloc(arena, sizeof(struct file_t)))) return false;
+
+        loaded.files[i]->filename = pool + files[i].filename;
+        loaded.files[i]->url = pool + files[i].url;
+    }
+
+    for (size_t i = 0; i < header->opcount; ++i)
+    {
+        struct directive_t* directive = arenaAlloc(arena, sizeof(struct directive_t));
+
+        if (!directive || !(directive->arguments = arenaAlloc(arena, ops[i].argc * sizeof(char*)))) return false;
+
+        directive->command = ops[i].opcode;
+        directive->task = ops[i].task;
+        directive->size = ops[i].argc;
+
+        for (size_t j = 0; j < ops[i].argc; ++j) directive->arguments[j] = pool + args[ops[i].args + j];
+
+        loaded.directives[i] = directive;
+    }
+
+    *script = loaded;
+
+    return true;
+}
+
+/*
+ * fills `script' from its compiled form
+ * without a revision the cached response has to be fresh and unchanged,
+ * with one a compiled script of the same installer revision is used too
+ */
+bool bytecodeLoad(const char* URL, const char* revision, struct script_t* script)
+{
+    char path[BYTECODE_PATH_MAX];
+    struct CacheEntry entry;
+    struct stat sb;
+    bool success = false;
+
+    if (!cacheLoadEntry(URL, &entry)) return false;
+    if (!revision && !netIsOffline() && !cacheIsFresh(&entry)) return false;
+
+    getBytecodePath(path, sizeof(path), URL);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    if (!fstat(fd, &sb) && sb.st_size >= sizeof(struct BytecodeHeader))
+    {
+        void* data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data != MAP_FAILED)
+        {
+            const struct BytecodeHeader* header = checkImage(data, sb.st_size);
+            uint64_t stamp = cacheStamp(&entry);
+
+            if (header && (header->stamp == stamp || (getRevision(revision) && header->revision == getRevision(revision))))
+            {
+                success = loadImage(header, script);
+
+                // the response changed but not the installer, later runs can skip the fetch again
+                if (success && header->stamp != stamp)
+                {
+                    if (pwrite(fd, &stamp, sizeof(stamp), offsetof(struct BytecodeHeader, stamp)) != sizeof(stamp)) unlink(path);
+                }
+            }
+
+            munmap(data, sb.st_size);
+        }
+    }
+
+    close(fd);
+
+    return success;
+}
+
+// compiles `script', which was parsed from the cached response of `URL'
+bool bytecodeStore(const char* URL, const char* revision, const struct script_t* script)
+{
+    char path[BYTECODE_PATH_MAX], temp[BYTECODE_PATH_MAX + 16];
+    struct CacheEntry entry;
+    size_t size;
+
+    if (!cacheLoadEntry(URL, &entry)) return false;
+
+    void* image = compile(script, getRevision(revision), cacheStamp(&entry), &size);
+    if (!image) return false;
+
+    getBytecodePath(path, sizeof(path), URL);
+    strncpy(temp, path, sizeof(temp) - 1);
+    temp[sizeof(temp) - 1] = '\0';
+    *strrchr(temp, '/') = '\0';
+    makePath(temp);
+
+    snprintf(temp, sizeof(temp), "%s.%i", path, getpid());
+
+    FILE* file = fopen(temp, "wb");
+    bool success = file && fwrite(image, 1, size, file) == size;
+
+    if (file && fclose(file)) success = false;
+    if (file && (!success || rename(temp, path)))
+    {
+        unlink(temp);
+        success = false;
+    }
+
+    free(image);
+
+    return success;
+}
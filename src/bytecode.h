@@ -0,0 +1,11 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stdbool.h>
+
+#include "lutris.h"
+
+bool bytecodeLoad(const char* URL, const char* revision, struct script_t*);
+bool bytecodeStore(const char* URL, const char* revision, const struct script_t*);
+
+#endif
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <linux/limits.h>
+
+#include "cache.h"
+#include "store.h"
+#include "memory.h"
+#include "common.h"
+#include "config.h"
+
+const static struct Command cache_commands[] = {
+    { .name = "gc",     .func = cache_gc,   .description = "trim the download cache to its size budget" },
+};
+
+int cache(int argc, char** argv)
+{
+    if (argc > 1)
+    {
+        for (int i = 0; i < ARRAY_LEN(cache_commands); ++i)
+        {
+            if (!strcmp(cache_commands[i].name, argv[1])) return cache_commands[i].func(argc-1, argv+1);
+        }
+    }
+
+    return cache_help(argc, argv);
+}
+
+int cache_gc(int argc, char** argv)
+{
+    uint64_t budget = storeBudget();
+
+    if (argc == 2)
+    {
+        char* end;
+        unsigned long long size = strtoull(argv[1], &end, 10);
+
+        if (*end)
+        {
+            puts(USAGE_STR " cache gc [size in MiB]");
+            return 1;
+        }
+
+        budget = size * 1024 * 1024;
+    }
+
+    uint64_t freed = storeTrim(budget, false);
+
+    printf("Freed %.1f MiB, cache budget is %.1f MiB\n", freed / 1048576.0, budget / 1048576.0);
+
+    return 0;
+}
+
+int cache_help(int argc, char** argv)
+{
+    puts(USAGE_STR " cache <command>\n\nList of commands:");
+
+    print_help(cache_commands, ARRAY_LEN(cache_commands));
+
+    return 0;
+}
+
+/*
+ * every cached response is a pair of files in <cache dir>/http
+ *   <hash>.body  raw response body
+ *   <hash>.meta  url, validators and fetch time, one per line
+ */
+static bool getEntryPath(char* buffer, size_t size, const char* URL, const char* extension)
+{
+    char cachedir[PATH_MAX];
+    getCacheDir(cachedir, sizeof(cachedir));
+
+    return snprintf(buffer, size, "%s/http/%016" PRIx64 ".%s", cachedir, hashString(URL), extension) < size;
+}
+
+static bool writeMeta(const char* URL, const struct CacheEntry* entry)
+{
+    char path[PATH_MAX], temp[PATH_MAX + 16];
+    if (!getEntryPath(path, sizeof(path), URL, "meta")) return false;
+    snprintf(temp, sizeof(temp), "%s.%i", path, getpid());
+
+    FILE* file = fopen(temp, "w");
+    if (!file) return false;
+
+    fprintf(file, "url %s\netag %s\nmodified %s\nfetched %lld\n",
+            URL, entry->etag, entry->modified, (long long)entry->fetched);
+
+    if (fclose(file) || rename(temp, path))
+    {
+        unlink(temp);
+        return false;
+    }
+
+    return true;
+}
+
+// only the validators and fetch time, not the body
+bool cacheLoadEntry(const char* URL, struct CacheEntry* entry)
+{
+    char path[PATH_MAX], line[PATH_MAX + 8], url[PATH_MAX] = {0}, fetched[32] = {0};
+    FILE* file;
+
+    memset(entry, 0, sizeof(struct CacheEntry));
+
+    if (!getEntryPath(path, sizeof(path), URL, "meta") || !(file = fopen(path, "r"))) return false;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        readKeyValue(line, "url", url, sizeof(url));
+        readKeyValue(line, "etag", entry->etag, sizeof(entry->etag));
+        readKeyValue(line, "modified", entry->modified, sizeof(entry->modified));
+        readKeyValue(line, "fetched", fetched, sizeof(fetched));
+    }
+    fclose(file);
+
+    // hash collision or a truncated meta file
+    if (strcmp(url, URL)) return false;
+    entry->fetched = strtoll(fetched, NULL, 10);
+
+    return true;
+}
+
+// fresh entries (POLECAT_CACHE_TTL seconds) are used without asking the server
+bool cacheIsFresh(const struct CacheEntry* entry)
+{
+    return time(NULL) - entry->fetched < getConfigNumber("POLECAT_CACHE_TTL", 300);
+}
+
+// identifies the cached response, it changes with every new body
+uint64_t cacheStamp(const struct CacheEntry* entry)
+{
+    char validators[sizeof(entry->etag) + sizeof(entry->modified) + 1];
+
+    if (!entry->etag[0] && !entry->modified[0]) return entry->fetched;
+
+    snprintf(validators, sizeof(validators), "%s\n%s", entry->etag, entry->modified);
+
+    return hashString(validators);
+}
+
+bool cacheLoad(const char* URL, struct CacheEntry* entry, struct MemoryStruct** body)
+{
+    char path[PATH_MAX];
+    FILE* file;
+
+    *body = NULL;
+
+    if (!cacheLoadEntry(URL, entry)) return false;
+
+    if (!getEntryPath(path, sizeof(path), URL, "body") || !(file = fopen(path, "rb"))) return false;
+
+    struct MemoryStruct* mem = memoryNew();
+    struct stat sb;
+    bool success = mem && !fstat(fileno(file), &sb) && memoryReserve(mem, sb.st_size ? sb.st_size : 1);
+
+    if (success)
+    {
+        struct MemoryChunk* chunk = mem->tail;
+
+        chunk->size = fread(chunk->data, 1, sb.st_size, file);
+        mem->size = chunk->size;
+        success = chunk->size == (size_t)sb.st_size;
+    }
+    fclose(file);
+
+    if (!success)
+    {
+        memoryFree(mem);
+        return false;
+    }
+
+    *body = mem;
+    return true;
+}
+
+bool cacheStore(const char* URL, const struct CacheEntry* entry, const struct MemoryStruct* body)
+{
+    char cachedir[PATH_MAX], path[PATH_MAX], temp[PATH_MAX + 16];
+
+    getCacheDir(cachedir, sizeof(cachedir));
+    strncat(cachedir, "/http", sizeof(cachedir) - strlen(cachedir) - 1);
+    makePath(cachedir);
+
+    if (!getEntryPath(path, sizeof(path), URL, "body")) return false;
+    snprintf(temp, sizeof(temp), "%s.%i", path, getpid());
+
+    FILE* file = fopen(temp, "wb");
+    if (!file) return false;
+
+    bool success = true;
+    for (struct MemoryChunk* chunk = body->head; chunk && success; chunk = chunk->next)
+    {
+        success = fwrite(chunk->data, 1, chunk->size, file) == chunk->size;
+    }
+
+    if (fclose(file) || !success || rename(temp, path))
+    {
+        unlink(temp);
+        return false;
+    }
+
+    return writeMeta(URL, entry);
+}
+
+bool cacheTouch(const char* URL, const struct CacheEntry* entry)
+{
+    return writeMeta(URL, entry);
+}
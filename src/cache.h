@@ -0,0 +1,27 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+struct MemoryStruct;
+
+struct CacheEntry {
+    char etag[256];
+    char modified[64];
+    time_t fetched;
+};
+
+bool cacheLoadEntry(const char* URL, struct CacheEntry*);
+bool cacheIsFresh(const struct CacheEntry*);
+uint64_t cacheStamp(const struct CacheEntry*);
+bool cacheLoad(const char* URL, struct CacheEntry*, struct MemoryStruct**);
+bool cacheStore(const char* URL, const struct CacheEntry*, const struct MemoryStruct*);
+bool cacheTouch(const char* URL, const struct CacheEntry*);
+
+int cache(int, char**);
+int cache_gc(int, char**);
+int cache_help(int, char**);
+
+#endif
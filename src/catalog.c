@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include <json.h>
+
+#include "catalog.h"
+#include "cache.h"
+#include "net.h"
+#include "common.h"
+#include "config.h"
+
+/*
+ * runner catalogs compiled into <cache dir>/catalog/<hash>.idx
+ *   header   magic, format version, record count, pool size,
+ *            stamp of the cached response it was built from, checksum
+ *   records  fixed width, name and url offsets into the pool, ID = index
+ *   pool     NUL terminated strings
+ * list and download map it and never parse JSON as long as the cached
+ * response is the one it was built from, fresh, stale or revalidated,
+ * it is only rebuilt when the server sent a new body
+ */
+
+#define CATALOG_MAGIC   "PCCATLG"
+#define CATALOG_VERSION 1
+
+struct CatalogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t poolsize;
+    uint64_t stamp;
+    uint64_t checksum;
+};
+
+struct CatalogRecord {
+    uint32_t name;
+    uint32_t url;
+};
+
+struct Catalog {
+    void* data;
+    size_t size;
+    bool mapped;
+
+    const struct CatalogHeader* header;
+    const struct CatalogRecord* records;
+    const char* pool;
+};
+
+static bool getIndexPath(char* buffer, size_t size, const char* URL)
+{
+    char cachedir[PATH_MAX];
+    getCacheDir(cachedir, sizeof(cachedir));
+
+    return snprintf(buffer, size, "%s/catalog/%016" PRIx64 ".idx", cachedir, hashString(URL)) < size;
+}
+
+static uint64_t getChecksum(const struct CatalogHeader* header)
+{
+    return hashBytes(header + 1, header->count * sizeof(struct CatalogRecord) + header->poolsize);
+}
+
+// checks everything a lookup relies on, a bad index is just rebuilt
+static struct Catalog* useImage(void* data, size_t size, bool mapped)
+{
+    const struct CatalogHeader* header = data;
+    struct Catalog* catalog;
+
+    if (size < sizeof(struct CatalogHeader) || memcmp(header->magic, CATALOG_MAGIC, sizeof(header->magic))
+        || header->version != CATALOG_VERSION || header->poolsize > size
+        || size != sizeof(struct CatalogHeader) + header->count * sizeof(struct CatalogRecord) + header->poolsize
+        || !header->poolsize || getChecksum(header) != header->checksum)
+    {
+        return NULL;
+    }
+
+    const struct CatalogRecord* records = (const struct CatalogRecord*)(header + 1);
+    const char* pool = (const char*)(records + header->count);
+
+    if (pool[header->poolsize - 1]) return NULL;
+
+    for (uint32_t i = 0; i < header->count; ++i)
+    {
+        if (records[i].name >= header->poolsize || records[i].url >= header->poolsize) return NULL;
+    }
+
+    if (!(catalog = malloc(sizeof(struct Catalog)))) return NULL;
+
+    catalog->data = data;
+    catalog->size = size;
+    catalog->mapped = mapped;
+    catalog->header = header;
+    catalog->records = records;
+    catalog->pool = pool;
+
+    return catalog;
+}
+
+// the stamp is left for the caller to check
+static struct Catalog* mapIndex(const char* path)
+{
+    struct Catalog* catalog = NULL;
+    struct stat sb;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) return NULL;
+
+    if (!fstat(fd, &sb) && sb.st_size >= sizeof(struct CatalogHeader))
+    {
+        void* data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data != MAP_FAILED)
+        {
+            catalog = useImage(data, sb.st_size, true);
+            if (!catalog) munmap(data, sb.st_size);
+        }
+    }
+
+    close(fd);
+
+    return catalog;
+}
+
+static uint32_t addString(char** pool, size_t* size, size_t* capacity, const char* str)
+{
+    size_t length = strlen(str ? str : "") + 1;
+    uint32_t offset = *size;
+
+    if (*size + length > *capacity)
+    {
+        size_t grown = *capacity ? *capacity * 2 : 4096;
+        while (grown < *size + length) grown *= 2;
+
+        char* buffer = realloc(*pool, grown);
+        if (!buffer) return UINT32_MAX;
+
+        *pool = buffer;
+        *capacity = grown;
+    }
+
+    memcpy(*pool + *size, str ? str : "", length);
+    *size += length;
+
+    return offset;
+}
+
+// lays out the index in memory, one allocation that is written as is
+static void* buildImage(struct json_object* json, catalogRecord record, uint64_t stamp, size_t* imagesize)
+{
+    struct CatalogRecord* records = NULL;
+    char* pool = NULL;
+    size_t count = 0, poolsize = 0, poolcapacity = 0;
+    const char* name, *url;
+    void* image = NULL;
+    bool failed = false;
+
+    while (!failed && count < UINT32_MAX && record(json, count, &name, &url))
+    {
+        struct CatalogRecord* grown = realloc(records, (count + 1) * sizeof(struct CatalogRecord));
+
+        if (!grown)
+        {
+            failed = true;
+            break;
+        }
+
+        records = grown;
+        records[count].name = addString(&pool, &poolsize, &poolcapacity, name);
+        records[count].url = addString(&pool, &poolsize, &poolcapacity, url);
+        failed = records[count].name == UINT32_MAX || records[count].url == UINT32_MAX;
+        ++count;
+    }
+
+    // an empty pool would not pass the checks
+    if (!failed && !poolsize) failed = addString(&pool, &poolsize, &poolcapacity, "") == UINT32_MAX;
+
+    if (!failed)
+    {
+        *imagesize = sizeof(struct CatalogHeader) + count * sizeof(struct CatalogRecord) + poolsize;
+        image = calloc(1, *imagesize);
+    }
+
+    if (image)
+    {
+        struct CatalogHeader* header = image;
+
+        memcpy(header->magic, CATALOG_MAGIC, sizeof(header->magic));
+        header->version = CATALOG_VERSION;
+        header->count = count;
+        header->poolsize = poolsize;
+        header->stamp = stamp;
+
+        memcpy(header + 1, records, count * sizeof(struct CatalogRecord));
+        memcpy((char*)(header + 1) + count * sizeof(struct CatalogRecord), pool, poolsize);
+        header->checksum = getChecksum(header);
+    }
+
+    free(records);
+    free(pool);
+
+    return image;
+}
+
+static void writeIndex(const char* path, const void* image, size_t size)
+{
+    char dir[PATH_MAX], temp[PATH_MAX + 16];
+
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    *strrchr(dir, '/') = '\0';
+    makePath(dir);
+
+    snprintf(temp, sizeof(temp), "%s.%i", path, getpid());
+
+    FILE* file = fopen(temp, "wb");
+    if (!file) return;
+
+    bool success = fwrite(image, 1, size, file) == size;
+
+    if (fclose(file) || !success || rename(temp, path)) unlink(temp);
+}
+
+/*
+ * `keys' and `record' are only used when the index has to be rebuilt,
+ * see fetchJSONKeys
+ */
+struct Catalog* catalogOpen(const char* URL, const char* const* keys, catalogRecord record)
+{
+    char path[PATH_MAX];
+    struct CacheEntry entry;
+    struct Catalog* catalog;
+    bool indexed = getIndexPath(path, sizeof(path), URL);
+    bool unchanged;
+
+    catalog = indexed ? mapIndex(path) : NULL;
+
+    // no request at all, the body is not even read
+    if (catalog && cacheLoadEntry(URL, &entry) && (netIsOffline() || cacheIsFresh(&entry))
+        && catalog->header->stamp == cacheStamp(&entry))
+    {
+        return catalog;
+    }
+
+    struct json_object* json = fetchJSONIfChanged(URL, keys, catalog ? catalog->header->stamp : 0, &unchanged);
+
+    if (unchanged && catalog) return catalog;
+
+    catalogClose(catalog);
+    if (!json) return NULL;
+
+    // the fetch revalidated or replaced the cached response
+    uint64_t stamp = cacheLoadEntry(URL, &entry) ? cacheStamp(&entry) : 0;
+    size_t size;
+    void* image = buildImage(json, record, stamp, &size);
+
+    json_object_put(json);
+
+    if (!image) return NULL;
+
+    if (stamp && indexed) writeIndex(path, image, size);
+
+    if (!(catalog = useImage(image, size, false))) free(image);
+
+    return catalog;
+}
+
+void catalogClose(struct Catalog* catalog)
+{
+    if (catalog)
+    {
+        if (catalog->mapped) munmap(catalog->data, catalog->size);
+        else free(catalog->data);
+
+        free(catalog);
+    }
+}
+
+size_t catalogCount(const struct Catalog* catalog)
+{
+    return catalog->header->count;
+}
+
+const char* catalogName(const struct Catalog* catalog, size_t id)
+{
+    return id < catalog->header->count ? catalog->pool + catalog->records[id].name : NULL;
+}
+
+const char* catalogURL(const struct Catalog* catalog, size_t id)
+{
+    return id < catalog->header->count ? catalog->pool + catalog->records[id].url : NULL;
+}
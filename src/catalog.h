@@ -0,0 +1,20 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct json_object;
+struct Catalog;
+
+// fills in record `index' of a parsed catalog, false past the last one
+typedef bool (*catalogRecord)(struct json_object*, size_t index, const char** name, const char** url);
+
+struct Catalog* catalogOpen(const char* URL, const char* const* keys, catalogRecord);
+void catalogClose(struct Catalog*);
+
+size_t catalogCount(const struct Catalog*);
+const char* catalogName(const struct Catalog*, size_t id);
+const char* catalogURL(const struct Catalog*, size_t id);
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <json.h>
+#include <linux/limits.h>
+
+#include "checksum.h"
+#include "net.h"
+#include "common.h"
+#include "config.h"
+
+/*
+ * the SHA-256 a download has to have, in this order
+ *   <config dir>/checksums  sha256sum output, the name is the file name
+ *                           or the whole URL, for hashes a project
+ *                           publishes or ones pinned by hand
+ *   GitHub                  the digest GitHub keeps for release assets
+ * downloads hash inline, so checking costs no extra read
+ */
+
+#define GITHUB_DOWNLOAD "https://github.com/"
+
+// 64 hex digits, "sha256:" in front is fine, `sha' gets them in lower case
+bool checksumParse(const char* text, char sha[SHA256_HEX_SIZE])
+{
+    size_t i;
+
+    if (!strncmp(text, "sha256:", 7)) text += 7;
+
+    for (i = 0; i < SHA256_HEX_SIZE - 1; ++i)
+    {
+        if (!isxdigit((unsigned char)text[i])) return false;
+        sha[i] = tolower((unsigned char)text[i]);
+    }
+
+    sha[i] = '\0';
+
+    return !text[i] || isspace((unsigned char)text[i]);
+}
+
+// an empty or missing expectation matches everything
+bool checksumMatches(const char* expected, const char* actual)
+{
+    return !expected || !expected[0] || !strcmp(expected, actual);
+}
+
+static bool lookupManifest(const char* URL, char sha[SHA256_HEX_SIZE])
+{
+    char path[PATH_MAX + 16], line[PATH_MAX + SHA256_HEX_SIZE + 8];
+    const char* name = strrchr(URL, '/') ? strrchr(URL, '/') + 1 : URL;
+    bool found = false;
+
+    getConfigDir(path, sizeof(path));
+    strncat(path, "/checksums", sizeof(path) - strlen(path) - 1);
+
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+
+    while (!found && fgets(line, sizeof(line), file))
+    {
+        char* entry = line + SHA256_HEX_SIZE - 1;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || !checksumParse(line, sha)) continue;
+
+        // "<hash>  <name>", binary mode marks the name with a '*'
+        while (*entry == ' ') ++entry;
+        if (*entry == '*') ++entry;
+
+        found = !strcmp(entry, URL) || !strcmp(entry, name);
+    }
+
+    fclose(file);
+
+    return found;
+}
+
+// release assets are https://github.com/<owner>/<repo>/releases/download/<tag>/<name>
+static bool lookupGitHub(const char* URL, char sha[SHA256_HEX_SIZE])
+{
+    const static char* const keys[] = { "assets", "name", "digest", NULL };
+    char repo[256], tag[256], name[NAME_MAX + 1], api[1024];
+    struct json_object* release, *assets, *field;
+    bool found = false;
+
+    if (strncmp(URL, GITHUB_DOWNLOAD, strlen(GITHUB_DOWNLOAD)) || netIsOffline()) return false;
+
+    const char* path = URL + strlen(GITHUB_DOWNLOAD);
+    const char* owner = strchr(path, '/');
+    const char* download = owner ? strstr(owner, "/releases/download/") : NULL;
+
+    if (!download) return false;
+
+    const char* tagstart = download + strlen("/releases/download/");
+    const char* tagend = strchr(tagstart, '/');
+
+    if (!tagend || strchr(tagend + 1, '/') || download - path >= sizeof(repo) || tagend - tagstart >= sizeof(tag)) return false;
+
+    snprintf(repo, sizeof(repo), "%.*s", (int)(download - path), path);
+    snprintf(tag, sizeof(tag), "%.*s", (int)(tagend - tagstart), tagstart);
+    snprintf(name, sizeof(name), "%s", tagend + 1);
+    snprintf(api, sizeof(api), GITHUB_API "%s/releases/tags/%s", repo, tag);
+
+    if (!(release = fetchJSONKeys(api, keys))) return false;
+
+    if (json_object_object_get_ex(release, "assets", &assets) && json_object_is_type(assets, json_type_array))
+    {
+        for (size_t i = 0; !found && i < json_object_array_length(assets); ++i)
+        {
+            struct json_object* asset = json_object_array_get_idx(assets, i);
+
+            if (!json_object_object_get_ex(asset, "name", &field) || strcmp(json_object_get_string(field), name)) continue;
+
+            // older assets have no digest
+            found = json_object_object_get_ex(asset, "digest", &field) && json_object_is_type(field, json_type_string)
+                    && checksumParse(json_object_get_string(field), sha);
+        }
+    }
+
+    json_object_put(release);
+
+    return found;
+}
+
+// `source' tells where the hash came from, for messages
+bool checksumLookup(const char* URL, char sha[SHA256_HEX_SIZE], const char** source)
+{
+    if (lookupManifest(URL, sha))
+    {
+        *source = "checksums file";
+        return true;
+    }
+
+    if (lookupGitHub(URL, sha))
+    {
+        *source = "GitHub release";
+        return true;
+    }
+
+    return false;
+}
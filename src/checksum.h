@@ -0,0 +1,12 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdbool.h>
+
+#include "sha256.h"
+
+bool checksumParse(const char* text, char sha[SHA256_HEX_SIZE]);
+bool checksumLookup(const char* URL, char sha[SHA256_HEX_SIZE], const char** source);
+bool checksumMatches(const char* expected, const char* actual);
+
+#endif
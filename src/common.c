@@ -1,7 +1,15 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/limits.h>
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include "common.h"
 
@@ -24,7 +32,7 @@ void print_help(const struct Command* commands, const size_t size)
 
 struct stat getStat(const char* path)
 {
-    struct stat sb;
+    struct stat sb = {0};
 
     stat(path, &sb);
 
@@ -55,3 +63,159 @@ void makeDir(const char* path)
     }
 }
 
+
+void makePath(const char* path)
+{
+    char buffer[PATH_MAX];
+
+    strncpy(buffer, path, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    for (char* p = buffer + 1; *p; ++p)
+    {
+        if (*p == '/')
+        {
+            *p = '\0';
+            makeDir(buffer);
+            *p = '/';
+        }
+    }
+
+    makeDir(buffer);
+}
+
+// creates the directory `path' is in
+void makeParentPath(const char* path)
+{
+    char parent[PATH_MAX];
+
+    snprintf(parent, sizeof(parent), "%s", path);
+    char* slash = strrchr(parent, '/');
+    if (slash && slash != parent)
+    {
+        *slash = '\0';
+        makePath(parent);
+    }
+}
+
+// removes `name' below `dirfd', whole trees included, even read only ones
+bool removeAt(int dirfd, const char* name)
+{
+    struct stat sb;
+
+    if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) return false;
+
+    if (S_ISDIR(sb.st_mode))
+    {
+        fchmodat(dirfd, name, S_IRWXU, 0);
+
+        int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+
+        if (!dir)
+        {
+            if (fd >= 0) close(fd);
+            return false;
+        }
+
+        struct dirent* entry;
+        while ((entry = readdir(dir)))
+        {
+            if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) removeAt(fd, entry->d_name);
+        }
+
+        closedir(dir);
+
+        return !unlinkat(dirfd, name, AT_REMOVEDIR);
+    }
+
+    return !unlinkat(dirfd, name, 0);
+}
+
+bool removePath(const char* path)
+{
+    return removeAt(AT_FDCWD, path);
+}
+
+/*
+ * copies the contents of `src' to a new `dst', as a reflink when the
+ * file system can share the data and through the kernel otherwise
+ */
+bool copyFile(const char* src, const char* dst, mode_t mode)
+{
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode & 07777);
+    bool success = out >= 0;
+    ssize_t copied;
+
+    if (success && !ioctl(out, FICLONE, in))
+    {
+        close(out);
+        close(in);
+        return true;
+    }
+
+    while (success && (copied = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) != 0)
+    {
+        if (copied > 0) continue;
+
+        // no copy_file_range between these file systems, copy through a buffer
+        char buffer[65536];
+        ssize_t size;
+
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+        {
+            success = false;
+            break;
+        }
+
+        while (success && (size = read(in, buffer, sizeof(buffer))) > 0) success = write(out, buffer, size) == size;
+        if (size < 0) success = false;
+        break;
+    }
+
+    int error = errno;
+    if (out >= 0 && close(out)) success = false;
+    close(in);
+    errno = error;
+
+    return success;
+}
+
+// FNV-1a, names cache files and checks cache indexes, not for anything hostile
+uint64_t hashBytes(const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+uint64_t hashString(const char* str)
+{
+    return hashBytes(str, strlen(str));
+}
+
+// reads `value' from a "key value" line
+bool readKeyValue(const char* line, const char* key, char* value, size_t size)
+{
+    size_t keylen = strlen(key);
+
+    if (!strncmp(line, key, keylen) && line[keylen] == ' ')
+    {
+        strncpy(value, line + keylen + 1, size - 1);
+        value[size - 1] = '\0';
+        value[strcspn(value, "\n")] = '\0';
+        return true;
+    }
+
+    return false;
+}
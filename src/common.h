@@ -9,7 +9,8 @@
 #define ARRAY_LEN(arr) sizeof(arr) / sizeof(arr[0])
 
 #define WINE_API "https://lutris.net/api/runners/wine"
-#define DXVK_API "https://api.github.com/repos/lutris/dxvk/releases"
+#define GITHUB_API "https://api.github.com/repos/"
+#define DXVK_API GITHUB_API "lutris/dxvk/releases"
 #define INSTALLER_API "https://lutris.net/api/installers/"
 
 #ifndef NAME
@@ -30,8 +31,20 @@
 #include <assert.h>
 #define unreachable assert(0 && "unreachable code reached")
 
+/*
+ * chain of chunks, data that was already stored never moves
+ * walk it with `for (chunk = mem->head; chunk; chunk = chunk->next)'
+ */
+struct MemoryChunk {
+    struct MemoryChunk* next;
+    size_t size;
+    size_t capacity;
+    uint8_t data[];
+};
+
 struct MemoryStruct {
-    uint8_t* memory;
+    struct MemoryChunk* head;
+    struct MemoryChunk* tail;
     size_t size;
 };
 
@@ -48,5 +61,14 @@ bool isFile(const char*);
 bool isDir(const char*);
 
 void makeDir(const char* path);
+void makePath(const char* path);
+void makeParentPath(const char* path);
+bool removeAt(int dirfd, const char* name);
+bool removePath(const char* path);
+bool copyFile(const char* src, const char* dst, mode_t mode);
+
+uint64_t hashBytes(const void*, size_t);
+uint64_t hashString(const char*);
+bool readKeyValue(const char* line, const char* key, char* value, size_t size);
 
 #endif
@@ -38,3 +38,18 @@ void getCacheDir(char* config, const size_t size)
     getXDGDir("XDG_CACHE_HOME", "/.cache/" NAME, config, size);
 }
 
+long getConfigNumber(const char* envvar, long fallback)
+{
+    char* value = getenv(envvar);
+    char* end;
+
+    if (value && *value)
+    {
+        long number = strtol(value, &end, 10);
+        if (!*end) return number;
+
+        printf("ignoring invalid %s `%s'\n", envvar, value);
+    }
+
+    return fallback;
+}
@@ -7,4 +7,6 @@ void getConfigDir(char*, const size_t);
 void getDataDir(char*, const size_t);
 void getCacheDir(char*, const size_t);
 
+long getConfigNumber(const char*, long);
+
 #endif
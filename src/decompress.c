@@ -0,0 +1,638 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+#include "config.h"
+#include "trace.h"
+
+/*
+ * decompression in front of the tar parser that uses all cores
+ *   xz    liblzma's threaded decoder, which decodes blocks in parallel
+ *         when their sizes are stored in the block headers (xz -T)
+ *   zstd  independent frames (zstd -T --rsyncable, pzstd, ...) are split
+ *         off the input and decoded by a worker pool, output stays in order
+ * anything else, single frame zstd and builds without the libraries pass
+ * the input through untouched and libarchive's own filters take over
+ */
+
+#define DECOMPRESS_OUT_SIZE    (1024 * 1024)
+#define DECOMPRESS_MAX_THREADS 16
+// frames bigger than this are not worth splitting and would pile up in memory
+#define ZSTD_FRAME_LIMIT       (32 * 1024 * 1024)
+
+enum decompressMode {
+    PASSTHROUGH,
+    XZ,
+    ZSTD_FRAMES,
+    ZSTD_STREAM,
+};
+
+struct frameJob {
+    struct frameJob* next;
+    struct frameJob* ordered;
+
+    uint8_t* input;
+    size_t insize;
+    uint8_t* output;
+    size_t outsize;
+
+    bool done;
+    bool failed;
+};
+
+struct Decompressor {
+    sourceRead read;
+    void* data;
+    enum decompressMode mode;
+    size_t threads;
+
+    const uint8_t* first;
+    ssize_t firstsize;
+    bool eof;
+    bool failed;
+
+    uint8_t* out;
+
+#ifdef HAVE_LZMA
+    lzma_stream lzma;
+    bool finished;
+#endif
+
+#ifdef HAVE_ZSTD
+    // compressed input that is not part of a job yet
+    uint8_t* pending;
+    size_t pendingstart;
+    size_t pendingsize;
+    size_t pendingcapacity;
+
+    ZSTD_DStream* dstream;
+    ZSTD_inBuffer zin;
+    size_t zret;
+
+    pthread_t workers[DECOMPRESS_MAX_THREADS];
+    size_t workercount;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finishedjob;
+    struct frameJob* queue;
+    struct frameJob* queuetail;
+    struct frameJob* head;
+    struct frameJob* tail;
+    size_t inflight;
+    struct frameJob* delivered;
+    bool closing;
+#endif
+};
+
+static ssize_t readSource(struct Decompressor* d, const void** buffer)
+{
+    ssize_t size;
+
+    // the block used for detection is handed out first
+    if (d->first)
+    {
+        *buffer = d->first;
+        size = d->firstsize;
+        d->first = NULL;
+        return size;
+    }
+
+    if (d->eof) return 0;
+
+    size = d->read(d->data, buffer);
+    if (size <= 0) d->eof = true;
+    if (size < 0) d->failed = true;
+
+    return size;
+}
+
+#ifdef HAVE_LZMA
+static bool startXZ(struct Decompressor* d)
+{
+#if LZMA_VERSION >= 50040002
+    lzma_mt mt;
+
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = d->threads;
+    mt.memlimit_threading = lzma_physmem() / 4;
+    mt.memlimit_stop = UINT64_MAX;
+
+    d->lzma = (lzma_stream)LZMA_STREAM_INIT;
+
+    return lzma_stream_decoder_mt(&d->lzma, &mt) == LZMA_OK;
+#else
+    // no threaded decoder, libarchive does just as well
+    return false;
+#endif
+}
+
+static ssize_t readXZ(struct Decompressor* d, const void** buffer)
+{
+    lzma_stream* strm = &d->lzma;
+
+    if (d->finished) return 0;
+
+    strm->next_out = d->out;
+    strm->avail_out = DECOMPRESS_OUT_SIZE;
+
+    for (;;)
+    {
+        if (!strm->avail_in && !d->eof)
+        {
+            const void* input;
+            ssize_t size = readSource(d, &input);
+
+            if (size < 0) return -1;
+
+            strm->next_in = input;
+            strm->avail_in = size;
+        }
+
+        lzma_ret ret = lzma_code(strm, d->eof ? LZMA_FINISH : LZMA_RUN);
+        size_t produced = DECOMPRESS_OUT_SIZE - strm->avail_out;
+
+        if (ret == LZMA_STREAM_END)
+        {
+            d->finished = true;
+            *buffer = d->out;
+            return produced;
+        }
+
+        if (ret != LZMA_OK)
+        {
+            printf("xz decompression failed (%i)\n", ret);
+            return -1;
+        }
+
+        // don't sit on output while waiting for more input
+        if (!strm->avail_out || (produced && !strm->avail_in))
+        {
+            *buffer = d->out;
+            return produced;
+        }
+    }
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static void decodeFrame(ZSTD_DCtx* dctx, struct frameJob* job)
+{
+    uint64_t span = traceStart();
+    unsigned long long size = ZSTD_getFrameContentSize(job->input, job->insize);
+
+    if (size == ZSTD_CONTENTSIZE_ERROR)
+    {
+        job->failed = true;
+    }
+    else if (size != ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        job->output = malloc(size ? size : 1);
+
+        size_t result = job->output ? ZSTD_decompressDCtx(dctx, job->output, size, job->input, job->insize) : 0;
+
+        if (!job->output || ZSTD_isError(result)) job->failed = true;
+        else job->outsize = result;
+    }
+    else
+    {
+        ZSTD_inBuffer in = { job->input, job->insize, 0 };
+        size_t capacity = job->insize * 4;
+        size_t result = 1;
+
+        ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+        while (result && !job->failed)
+        {
+            uint8_t* grown = realloc(job->output, capacity);
+            if (!grown)
+            {
+                job->failed = true;
+                break;
+            }
+            job->output = grown;
+
+            ZSTD_outBuffer out = { job->output, capacity, job->outsize };
+            result = ZSTD_decompressStream(dctx, &out, &in);
+            job->outsize = out.pos;
+
+            if (ZSTD_isError(result) || (result && in.pos == in.size && out.pos < out.size)) job->failed = true;
+            if (out.pos == out.size) capacity *= 2;
+        }
+    }
+
+    free(job->input);
+    job->input = NULL;
+
+    traceEnd("decompress", "frame", span, NULL);
+}
+
+static void* frameWorker(void* data)
+{
+    struct Decompressor* d = data;
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+
+    traceThread("zstd worker");
+
+    for (;;)
+    {
+        struct frameJob* job;
+
+        pthread_mutex_lock(&d->lock);
+        while (!d->queue && !d->closing) pthread_cond_wait(&d->work, &d->lock);
+
+        job = d->queue;
+        if (job)
+        {
+            d->queue = job->next;
+            if (!d->queue) d->queuetail = NULL;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        if (!job) break;
+
+        if (dctx) decodeFrame(dctx, job);
+        else job->failed = true;
+
+        pthread_mutex_lock(&d->lock);
+        job->done = true;
+        pthread_cond_broadcast(&d->finishedjob);
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    ZSTD_freeDCtx(dctx);
+
+    return NULL;
+}
+
+static bool appendPending(struct Decompressor* d, const void* data, size_t size)
+{
+    // drop what jobs already took before growing
+    if (d->pendingstart)
+    {
+        memmove(d->pending, d->pending + d->pendingstart, d->pendingsize - d->pendingstart);
+        d->pendingsize -= d->pendingstart;
+        d->pendingstart = 0;
+    }
+
+    if (d->pendingsize + size > d->pendingcapacity)
+    {
+        size_t capacity = d->pendingcapacity ? d->pendingcapacity : DECOMPRESS_OUT_SIZE;
+        while (capacity < d->pendingsize + size) capacity *= 2;
+
+        uint8_t* grown = realloc(d->pending, capacity);
+        if (!grown) return false;
+
+        d->pending = grown;
+        d->pendingcapacity = capacity;
+    }
+
+    memcpy(d->pending + d->pendingsize, data, size);
+    d->pendingsize += size;
+
+    return true;
+}
+
+// splits the next complete frame off the input, false if there is none
+static bool submitFrame(struct Decompressor* d)
+{
+    for (;;)
+    {
+        size_t available = d->pendingsize - d->pendingstart;
+
+        if (available)
+        {
+            size_t size = ZSTD_findFrameCompressedSize(d->pending + d->pendingstart, available);
+
+            if (!ZSTD_isError(size))
+            {
+                unsigned long long content = ZSTD_getFrameContentSize(d->pending + d->pendingstart, size);
+
+                // a worker would allocate whatever the header claims, decode the rest as one stream instead
+                if (content != ZSTD_CONTENTSIZE_UNKNOWN && content > ZSTD_FRAME_LIMIT)
+                {
+                    d->mode = ZSTD_STREAM;
+                    return false;
+                }
+
+                struct frameJob* job = calloc(1, sizeof(struct frameJob));
+                if (!job || !(job->input = malloc(size)))
+                {
+                    free(job);
+                    d->failed = true;
+                    return false;
+                }
+
+                memcpy(job->input, d->pending + d->pendingstart, size);
+                job->insize = size;
+                d->pendingstart += size;
+
+                pthread_mutex_lock(&d->lock);
+                if (d->queuetail) d->queuetail->next = job;
+                else d->queue = job;
+                d->queuetail = job;
+
+                if (d->tail) d->tail->ordered = job;
+                else d->head = job;
+                d->tail = job;
+
+                d->inflight++;
+                pthread_cond_signal(&d->work);
+                pthread_mutex_unlock(&d->lock);
+
+                return true;
+            }
+
+            // no frame boundary in sight, decode the rest as one stream
+            if (available >= ZSTD_FRAME_LIMIT || d->eof)
+            {
+                d->mode = ZSTD_STREAM;
+                return false;
+            }
+        }
+        else if (d->eof)
+        {
+            return false;
+        }
+
+        const void* input;
+        ssize_t size = readSource(d, &input);
+
+        if (size < 0) return false;
+        if (size && !appendPending(d, input, size))
+        {
+            d->failed = true;
+            return false;
+        }
+    }
+}
+
+static ssize_t readZstdStream(struct Decompressor* d, const void** buffer)
+{
+    ZSTD_outBuffer out = { d->out, DECOMPRESS_OUT_SIZE, 0 };
+
+    *buffer = d->out;
+
+    if (!d->dstream && !(d->dstream = ZSTD_createDStream())) return -1;
+
+    for (;;)
+    {
+        if (d->zin.pos == d->zin.size)
+        {
+            if (d->pendingstart < d->pendingsize)
+            {
+                // pending is not appended to anymore, so it can be used in place
+                d->zin.src = d->pending + d->pendingstart;
+                d->zin.size = d->pendingsize - d->pendingstart;
+                d->zin.pos = 0;
+                d->pendingstart = d->pendingsize;
+            }
+            else if (!d->eof)
+            {
+                const void* input;
+                ssize_t size = readSource(d, &input);
+
+                if (size < 0) return -1;
+
+                d->zin.src = input;
+                d->zin.size = size;
+                d->zin.pos = 0;
+                continue;
+            }
+            else
+            {
+                if (!out.pos && d->zret)
+                {
+                    puts("zstd stream is truncated");
+                    return -1;
+                }
+
+                return out.pos;
+            }
+        }
+
+        size_t ret = ZSTD_decompressStream(d->dstream, &out, &d->zin);
+        if (ZSTD_isError(ret))
+        {
+            printf("zstd decompression failed: %s\n", ZSTD_getErrorName(ret));
+            return -1;
+        }
+        d->zret = ret;
+
+        if (out.pos == out.size || (out.pos && d->zin.pos == d->zin.size)) return out.pos;
+    }
+}
+
+static ssize_t readZstd(struct Decompressor* d, const void** buffer)
+{
+    for (;;)
+    {
+        // the block handed out last time is done with
+        if (d->delivered)
+        {
+            free(d->delivered->output);
+            free(d->delivered);
+            d->delivered = NULL;
+        }
+
+        // keep every worker busy and the next few frames queued
+        while (d->mode == ZSTD_FRAMES && !d->failed && d->inflight < d->workercount * 2 && submitFrame(d));
+
+        if (d->head)
+        {
+            struct frameJob* job = d->head;
+
+            pthread_mutex_lock(&d->lock);
+            while (!job->done) pthread_cond_wait(&d->finishedjob, &d->lock);
+            d->head = job->ordered;
+            if (!d->head) d->tail = NULL;
+            d->inflight--;
+            pthread_mutex_unlock(&d->lock);
+
+            d->delivered = job;
+
+            if (job->failed)
+            {
+                puts("zstd frame could not be decompressed");
+                return -1;
+            }
+
+            if (!job->outsize) continue;
+
+            *buffer = job->output;
+            return job->outsize;
+        }
+
+        if (d->failed) return -1;
+        if (d->mode == ZSTD_STREAM) return readZstdStream(d, buffer);
+
+        return 0;
+    }
+}
+
+static bool startZstd(struct Decompressor* d)
+{
+    unsigned long long size = ZSTD_getFrameContentSize(d->first, d->firstsize);
+
+    // one huge frame can't be split, leave it to libarchive
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size > ZSTD_FRAME_LIMIT) return false;
+
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->work, NULL);
+    pthread_cond_init(&d->finishedjob, NULL);
+
+    for (size_t i = 0; i < d->threads; ++i)
+    {
+        if (pthread_create(&d->workers[i], NULL, frameWorker, d)) break;
+        d->workercount++;
+    }
+
+    if (!d->workercount) return false;
+
+    // the detection block is regular input from here on
+    if (!appendPending(d, d->first, d->firstsize)) return false;
+    d->first = NULL;
+
+    return true;
+}
+#endif
+
+struct Decompressor* decompressorNew(sourceRead read, void* data)
+{
+    struct Decompressor* d = calloc(1, sizeof(struct Decompressor));
+
+    if (!d) return NULL;
+
+    d->read = read;
+    d->data = data;
+    d->mode = PASSTHROUGH;
+
+    long threads = getConfigNumber("POLECAT_DECOMPRESS_THREADS", sysconf(_SC_NPROCESSORS_ONLN));
+    if (threads > DECOMPRESS_MAX_THREADS) threads = DECOMPRESS_MAX_THREADS;
+    d->threads = threads > 0 ? threads : 1;
+
+    const void* first = NULL;
+    d->firstsize = readSource(d, &first);
+    d->first = first;
+
+    // nothing to gain on a single core
+    if (d->firstsize < 6 || d->threads < 2) return d;
+
+#ifdef HAVE_LZMA
+    if (!memcmp(first, "\xFD" "7zXZ\0", 6) && (d->out = malloc(DECOMPRESS_OUT_SIZE)))
+    {
+        if (startXZ(d)) d->mode = XZ;
+        else lzma_end(&d->lzma);
+    }
+#endif
+
+#ifdef HAVE_ZSTD
+    if (!memcmp(first, "\x28\xB5\x2F\xFD", 4) && (d->out = malloc(DECOMPRESS_OUT_SIZE)))
+    {
+        if (startZstd(d)) d->mode = ZSTD_FRAMES;
+    }
+#endif
+
+    return d;
+}
+
+// a span per block, it includes waiting on the source and on frame workers
+ssize_t decompressorRead(struct Decompressor* d, const void** buffer)
+{
+    uint64_t span = traceStart();
+    ssize_t size;
+
+    switch (d->mode)
+    {
+#ifdef HAVE_LZMA
+        case XZ:
+            size = readXZ(d, buffer);
+            break;
+#endif
+
+#ifdef HAVE_ZSTD
+        case ZSTD_FRAMES:
+        case ZSTD_STREAM:
+            size = readZstd(d, buffer);
+            break;
+#endif
+
+        default:
+            size = readSource(d, buffer);
+            break;
+    }
+
+    traceEnd("decompress", "read", span, NULL);
+
+    return size;
+}
+
+/*
+ * reads the source to its end, false if it failed there
+ * a download only reports a bad checksum once it is complete
+ */
+bool decompressorDrain(struct Decompressor* d)
+{
+    const void* buffer;
+
+    while (readSource(d, &buffer) > 0);
+
+    return !d->failed;
+}
+
+void decompressorFree(struct Decompressor* d)
+{
+    if (!d) return;
+
+#ifdef HAVE_LZMA
+    if (d->mode == XZ) lzma_end(&d->lzma);
+#endif
+
+#ifdef HAVE_ZSTD
+    if (d->workercount)
+    {
+        pthread_mutex_lock(&d->lock);
+        d->closing = true;
+        pthread_cond_broadcast(&d->work);
+        pthread_mutex_unlock(&d->lock);
+
+        for (size_t i = 0; i < d->workercount; ++i) pthread_join(d->workers[i], NULL);
+
+        while (d->head)
+        {
+            struct frameJob* job = d->head;
+            d->head = job->ordered;
+            free(job->input);
+            free(job->output);
+            free(job);
+        }
+
+        if (d->delivered)
+        {
+            free(d->delivered->output);
+            free(d->delivered);
+        }
+
+        pthread_cond_destroy(&d->finishedjob);
+        pthread_cond_destroy(&d->work);
+        pthread_mutex_destroy(&d->lock);
+    }
+
+    ZSTD_freeDStream(d->dstream);
+    free(d->pending);
+#endif
+
+    free(d->out);
+    free(d);
+}
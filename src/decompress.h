@@ -0,0 +1,20 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * pulls the next block of compressed input, returns its size,
+ * 0 at the end and -1 on error, the block stays valid until the next call
+ */
+typedef ssize_t (*sourceRead)(void* data, const void** buffer);
+
+struct Decompressor;
+
+struct Decompressor* decompressorNew(sourceRead, void*);
+ssize_t decompressorRead(struct Decompressor*, const void** buffer);
+bool decompressorDrain(struct Decompressor*);
+void decompressorFree(struct Decompressor*);
+
+#endif
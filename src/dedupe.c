@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/limits.h>
+
+#include "dedupe.h"
+#include "common.h"
+#include "config.h"
+
+/*
+ * every unique file of the installed runners is kept once in
+ * <data dir>/.store/<sha256>-<mode> and the version trees link to it,
+ * the mode is part of the name because hard links share it
+ * a store object only linked from the store itself is unused
+ */
+
+void getDedupeStore(char* buffer, size_t size)
+{
+    getDataDir(buffer, size);
+    strncat(buffer, "/.store", size - strlen(buffer) - 1);
+}
+
+// reflink copy for when the object can't take another hard link
+static bool cloneFile(const char* object, const char* path, const char* temp, const struct stat* sb)
+{
+    int source = open(object, O_RDONLY | O_CLOEXEC);
+    if (source < 0) return false;
+
+    int dest = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, sb->st_mode & 07777);
+    bool success = false;
+
+    if (dest >= 0)
+    {
+        struct timespec times[2] = { sb->st_atim, sb->st_mtim };
+
+        success = !ioctl(dest, FICLONE, source) && !fchmod(dest, sb->st_mode & 07777)
+                  && !futimens(dest, times) && !rename(temp, path);
+
+        close(dest);
+        if (!success) unlink(temp);
+    }
+
+    close(source);
+
+    return success;
+}
+
+/*
+ * replaces `path' with a link to the store object with the same content,
+ * or makes it the object if there is none yet
+ * returns true if the file now shares its data with other files
+ */
+bool dedupeFile(const char* store, const char* path, const char sha[SHA256_HEX_SIZE])
+{
+    char object[PATH_MAX], temp[PATH_MAX + 16];
+    struct stat sb, ob;
+
+    if (lstat(path, &sb) < 0 || !S_ISREG(sb.st_mode)) return false;
+
+    snprintf(object, sizeof(object), "%s/%s-%o", store, sha, (unsigned)(sb.st_mode & 07777));
+
+    // the first copy becomes the object
+    if (!link(path, object) || errno != EEXIST) return false;
+
+    if (stat(object, &ob) < 0 || ob.st_size != sb.st_size) return false;
+    if (ob.st_ino == sb.st_ino && ob.st_dev == sb.st_dev) return false;
+
+    snprintf(temp, sizeof(temp), "%s.polecat-dedupe", path);
+
+    if (!link(object, temp))
+    {
+        if (!rename(temp, path)) return true;
+
+        unlink(temp);
+        return false;
+    }
+
+    // too many links or no hard links on this file system
+    return cloneFile(object, path, temp, &sb);
+}
+
+// removes objects no runner uses anymore, returns the bytes freed
+uint64_t dedupePrune(const char* store)
+{
+    DIR* dir = opendir(store);
+    struct dirent* entry;
+    uint64_t freed = 0;
+
+    if (!dir) return 0;
+
+    while ((entry = readdir(dir)))
+    {
+        struct stat sb;
+
+        if (entry->d_name[0] == '.') continue;
+
+        if (!fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) && S_ISREG(sb.st_mode) && sb.st_nlink == 1
+            && !unlinkat(dirfd(dir), entry->d_name, 0))
+        {
+            freed += sb.st_size;
+        }
+    }
+
+    closedir(dir);
+
+    return freed;
+}
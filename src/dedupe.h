@@ -0,0 +1,15 @@
+#ifndef DEDUPE_H
+#define DEDUPE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sha256.h"
+
+void getDedupeStore(char* buffer, size_t size);
+
+bool dedupeFile(const char* store, const char* path, const char sha[SHA256_HEX_SIZE]);
+uint64_t dedupePrune(const char* store);
+
+#endif
@@ -0,0 +1,957 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include <json.h>
+
+#include "directive.h"
+#include "launch.h"
+#include "memory.h"
+#include "staging.h"
+#include "tar.h"
+#include "common.h"
+#include "config.h"
+#include "trace.h"
+
+/*
+ * runs the install directives of a lutris script
+ * every step knows the paths it reads and writes from its arguments,
+ * it waits for each earlier step it shares a path with, so the result
+ * is the same as running them in order while steps on separate trees
+ * (extracting game data while the prefix is created) run side by side
+ * extract merges into its destination like lutris does, a later archive
+ * or patch only replaces the files it ships
+ */
+
+#define MAX_ARGUMENTS 5
+#define MAX_PATHS 2
+
+struct variable {
+    char* name;
+    char* value;
+};
+
+struct variables {
+    struct variable* list;
+    size_t count;
+};
+
+enum stepState {
+    WAITING,
+    RUNNING,
+    DONE
+};
+
+struct step {
+    size_t index;
+    const struct directive_t* directive;
+    char* args[MAX_ARGUMENTS];          // expanded, paths made absolute
+    const char* reads[MAX_PATHS];
+    const char* writes[MAX_PATHS];
+    char* prefix;                       // of wine tasks
+    bool barrier;                       // may touch anything, ordered against every step
+    enum stepState state;
+    size_t pending;                     // earlier steps it still waits for
+};
+
+struct scheduler {
+    const struct InstallContext* context;
+    struct step* steps;
+    size_t count;
+    bool* after;                        // after[i * count + j]: step j waits for step i
+    size_t running;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+static void addVariable(struct variables* vars, const char* name, const char* value)
+{
+    struct variable* list = realloc(vars->list, (vars->count + 1) * sizeof(struct variable));
+    if (!list) return;
+
+    vars->list = list;
+    vars->list[vars->count].name = strdup(name);
+    vars->list[vars->count].value = strdup(value);
+    vars->count++;
+}
+
+static void freeVariables(struct variables* vars)
+{
+    for (size_t i = 0; i < vars->count; ++i)
+    {
+        free(vars->list[i].name);
+        free(vars->list[i].value);
+    }
+    free(vars->list);
+}
+
+// replaces $NAME with known variables, unknown ones stay as they are
+static char* expand(const struct variables* vars, const char* str)
+{
+    char* result = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&result, &size);
+
+    if (!out) return NULL;
+
+    while (*str)
+    {
+        size_t length = 0;
+
+        if (*str == '$')
+        {
+            while (isalnum((unsigned char)str[1 + length]) || str[1 + length] == '_') ++length;
+        }
+
+        const struct variable* var = NULL;
+        for (size_t i = 0; length && i < vars->count; ++i)
+        {
+            if (strlen(vars->list[i].name) == length && !strncmp(vars->list[i].name, str + 1, length)) var = &vars->list[i];
+        }
+
+        if (var)
+        {
+            fputs(var->value, out);
+            str += length + 1;
+        }
+        else
+        {
+            fputc(*str++, out);
+        }
+    }
+
+    fclose(out);
+
+    return result;
+}
+
+// installer files live in $CACHE/<id>/<name from the url>
+static void stagedPath(char* buffer, size_t size, const char* cachedir, const struct file_t* file)
+{
+    const char* name = strrchr(file->url, '/');
+    name = name ? name + 1 : file->url;
+
+    size_t length = strcspn(name, "?#");
+    if (!length)
+    {
+        name = file->filename;
+        length = strlen(name);
+    }
+
+    snprintf(buffer, size, "%s/%s/%.*s", cachedir, file->filename, (int)length, name);
+}
+
+static const char* argument(const struct step* step, size_t i)
+{
+    return i < step->directive->size ? step->directive->arguments[i] : "";
+}
+
+// a file id or a path, relative ones start in $GAMEDIR
+static char* pathArgument(const struct step* step, size_t i, const struct script_t* installer,
+                          const struct InstallContext* context, const struct variables* vars)
+{
+    const char* raw = argument(step, i);
+    char buffer[PATH_MAX];
+    char* path;
+
+    for (size_t f = 0; f < installer->filecount; ++f)
+    {
+        if (!strcmp(raw, installer->files[f]->filename))
+        {
+            stagedPath(buffer, sizeof(buffer), context->cachedir, installer->files[f]);
+            return strdup(buffer);
+        }
+    }
+
+    char* expanded = expand(vars, raw);
+    if (!expanded) return NULL;
+
+    if (expanded[0] == '/') path = expanded;
+    else
+    {
+        if (asprintf(&path, expanded[0] ? "%s/%s" : "%s", context->gamedir, expanded) < 0) path = NULL;
+        free(expanded);
+    }
+
+    // trailing slashes would hide overlaps
+    for (size_t length = path ? strlen(path) : 0; length > 1 && path[length - 1] == '/'; --length) path[length - 1] = '\0';
+
+    return path;
+}
+
+static bool planStep(struct step* step, const struct script_t* installer, const struct InstallContext* context, struct variables* vars)
+{
+    const struct directive_t* directive = step->directive;
+    size_t prefix = 0;
+
+    for (size_t i = 0; i < directive->size && i < MAX_ARGUMENTS; ++i)
+    {
+        if (!(step->args[i] = expand(vars, directive->arguments[i]))) return false;
+    }
+
+    switch (directive->command)
+    {
+        case MOVE:
+        case COPY:
+        case MERGE:
+            free(step->args[0]);
+            free(step->args[1]);
+            step->args[0] = pathArgument(step, 0, installer, context, vars);
+            step->args[1] = pathArgument(step, 1, installer, context, vars);
+
+            if (directive->command == MOVE) step->writes[1] = step->args[0];
+            else step->reads[0] = step->args[0];
+            step->writes[0] = step->args[1];
+            break;
+
+        case EXTRACT:
+            free(step->args[0]);
+            free(step->args[1]);
+            step->args[0] = pathArgument(step, 0, installer, context, vars);
+            step->args[1] = pathArgument(step, 1, installer, context, vars);
+
+            step->reads[0] = step->args[0];
+            step->writes[0] = step->args[1];
+            break;
+
+        case CHMODX:
+        case WRITE_FILE:
+        case WRITE_CONFIG:
+        case WRITE_JSON:
+            free(step->args[0]);
+            step->args[0] = pathArgument(step, 0, installer, context, vars);
+
+            step->writes[0] = step->args[0];
+            break;
+
+        case EXECUTE:
+            if (argument(step, 0)[0])
+            {
+                free(step->args[0]);
+                step->args[0] = pathArgument(step, 0, installer, context, vars);
+            }
+            step->barrier = true;
+            break;
+
+        case INPUT_MENU:
+            // nobody is asked, the script's choice is taken
+            addVariable(vars, "INPUT", argument(step, 1));
+            {
+                char name[128];
+                snprintf(name, sizeof(name), "INPUT_%s", argument(step, 0));
+                addVariable(vars, name, argument(step, 1));
+            }
+            printf("Using %s for \"%s\"\n", argument(step, 1), argument(step, 2));
+            break;
+
+        case INSERT_DISC:
+            puts("Installers that need a disc are not supported");
+            return false;
+
+        case TASK:
+            if (!context->wine)
+            {
+                puts("This installer needs wine, install the version it asks for first");
+                return false;
+            }
+
+            switch (directive->task)
+            {
+                case WINEEXEC:
+                    free(step->args[0]);
+                    step->args[0] = pathArgument(step, 0, installer, context, vars);
+                    // the program can write anywhere
+                    step->barrier = true;
+                    prefix = 2;
+                    break;
+
+                case WINETRICKS:
+                    prefix = 1;
+                    break;
+
+                case CREATE_PREFIX:
+                case WINEKILL:
+                    prefix = 0;
+                    break;
+
+                case SET_REGEDIT:
+                    prefix = 4;
+                    break;
+
+                default:
+                    puts("Unknown task in installer");
+                    return false;
+            }
+
+            // a script without a prefix installs into the game directory
+            step->prefix = pathArgument(step, prefix, installer, context, vars);
+            step->writes[0] = step->prefix;
+            break;
+
+        default:
+            printf("Unknown directive %i\nIf you see this please report it.\n", directive->command);
+            return false;
+    }
+
+    for (size_t i = 0; i < MAX_ARGUMENTS; ++i)
+    {
+        if (i < directive->size && !step->args[i]) return false;
+    }
+
+    return directive->command != TASK || step->prefix;
+}
+
+// `a' and `b' are the same path or one is inside the other
+static bool overlaps(const char* a, const char* b)
+{
+    if (!a || !b) return false;
+
+    size_t la = strlen(a), lb = strlen(b);
+    size_t length = la < lb ? la : lb;
+
+    if (strncmp(a, b, length)) return false;
+    if (la == lb) return true;
+
+    const char* longer = la > lb ? a : b;
+    return longer[length] == '/' || longer[length - 1] == '/';
+}
+
+static bool inside(const char* path, const char* dir)
+{
+    size_t length = strlen(dir);
+
+    return path && !strncmp(path, dir, length) && (path[length] == '/' || !path[length]);
+}
+
+// $CACHE may sit in $GAMEDIR, but it is only ever used through $CACHE
+static bool touches(const char* a, const char* b, const char* cachedir)
+{
+    return inside(a, cachedir) == inside(b, cachedir) && overlaps(a, b);
+}
+
+static bool conflicts(const struct step* first, const struct step* second, const char* cachedir)
+{
+    if (first->barrier || second->barrier) return true;
+
+    for (size_t i = 0; i < MAX_PATHS; ++i)
+    {
+        for (size_t j = 0; j < MAX_PATHS; ++j)
+        {
+            if (touches(first->writes[i], second->writes[j], cachedir) || touches(first->writes[i], second->reads[j], cachedir)
+                || touches(first->reads[i], second->writes[j], cachedir))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+// copies `src' to `dst', directories are merged into existing ones
+static bool copyTree(const char* src, const char* dst)
+{
+    struct stat sb;
+
+    if (lstat(src, &sb) < 0)
+    {
+        printf("Cannot copy %s: %s\n", src, strerror(errno));
+        return false;
+    }
+
+    if (S_ISLNK(sb.st_mode))
+    {
+        char target[PATH_MAX];
+        ssize_t length = readlink(src, target, sizeof(target) - 1);
+
+        if (length < 0) return false;
+        target[length] = '\0';
+
+        unlink(dst);
+        return !symlink(target, dst);
+    }
+
+    if (!S_ISDIR(sb.st_mode))
+    {
+        if (copyFile(src, dst, sb.st_mode)) return true;
+
+        printf("Cannot copy %s to %s: %s\n", src, dst, strerror(errno));
+        return false;
+    }
+
+    if (mkdir(dst, (sb.st_mode & 07777) | S_IRWXU) < 0 && errno != EEXIST) return false;
+
+    DIR* dir = opendir(src);
+    struct dirent* entry;
+    bool success = dir != NULL;
+
+    while (success && (entry = readdir(dir)))
+    {
+        char from[PATH_MAX], to[PATH_MAX];
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+
+        snprintf(from, sizeof(from), "%s/%s", src, entry->d_name);
+        snprintf(to, sizeof(to), "%s/%s", dst, entry->d_name);
+        success = copyTree(from, to);
+    }
+
+    if (dir) closedir(dir);
+
+    return success;
+}
+
+// files go into `dst' if it is a directory, directories are merged into it
+static void copyTarget(char* buffer, size_t size, const char* src, const char* dst, bool into)
+{
+    const char* name = strrchr(src, '/');
+
+    if (into && isDir(dst)) snprintf(buffer, size, "%s/%s", dst, name ? name + 1 : src);
+    else snprintf(buffer, size, "%s", dst);
+}
+
+// a staged file is copied from where it is, the target is named after it
+static bool copyStep(const struct step* step, const struct InstallContext* context)
+{
+    char target[PATH_MAX], src[PATH_MAX];
+
+    if (!stagingResolve(context->staging, step->args[0], false, src, sizeof(src))) return false;
+
+    copyTarget(target, sizeof(target), step->args[0], step->args[1], !isDir(src));
+
+    if (isDir(src)) makePath(target);
+    else makeParentPath(target);
+
+    return copyTree(src, target);
+}
+
+// staged files are on the target file system, so this is a rename
+static bool moveStep(const struct step* step, const struct InstallContext* context)
+{
+    char target[PATH_MAX], src[PATH_MAX];
+
+    if (!stagingResolve(context->staging, step->args[0], true, src, sizeof(src))) return false;
+
+    copyTarget(target, sizeof(target), src, step->args[1], true);
+    makeParentPath(target);
+
+    if (!rename(src, target)) return true;
+
+    // another file system or a directory that has to be merged
+    if (errno != EXDEV && errno != ENOTEMPTY && errno != EEXIST && errno != EISDIR)
+    {
+        printf("Cannot move %s to %s: %s\n", src, target, strerror(errno));
+        return false;
+    }
+
+    return copyTree(src, target) && removePath(src);
+}
+
+// small archives are still in memory, others are read where they are
+static bool extractStep(const struct step* step, const struct InstallContext* context)
+{
+    const struct MemoryStruct* memory = stagingMemory(context->staging, step->args[0]);
+    // what earlier steps put into the destination stays, see ExtractOptions
+    const struct ExtractOptions options = { .replace = false };
+    char src[PATH_MAX];
+
+    makePath(step->args[1]);
+
+    if (memory) return extract(memory, step->args[1], &options);
+
+    return stagingResolve(context->staging, step->args[0], false, src, sizeof(src)) && extractFile(src, step->args[1], &options);
+}
+
+static bool chmodxStep(const char* path)
+{
+    struct stat sb;
+
+    if (stat(path, &sb) < 0 || chmod(path, (sb.st_mode & 07777) | S_IXUSR | S_IXGRP | S_IXOTH) < 0)
+    {
+        printf("Cannot make %s executable: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool writeFileStep(const struct step* step)
+{
+    makeParentPath(step->args[0]);
+
+    FILE* file = fopen(step->args[0], "w");
+    if (!file) return false;
+
+    fputs(step->args[1], file);
+
+    return !fclose(file);
+}
+
+static bool isKeyLine(const char* line, const char* key)
+{
+    while (isspace((unsigned char)*line)) ++line;
+
+    size_t length = strlen(key);
+    if (strncmp(line, key, length)) return false;
+
+    for (line += length; *line == ' ' || *line == '\t'; ++line);
+
+    return *line == '=';
+}
+
+// sets `key' in `section' of an ini file, everything else is kept
+static bool writeConfigStep(const struct step* step)
+{
+    const char* path = step->args[0], *section = step->args[1], *key = step->args[2], *value = step->args[3];
+    char* result = NULL, *line = NULL;
+    size_t resultsize = 0, linesize = 0;
+    bool inside = false, written = false;
+    FILE* out = open_memstream(&result, &resultsize);
+    FILE* in = fopen(path, "r");
+
+    if (!out)
+    {
+        if (in) fclose(in);
+        return false;
+    }
+
+    while (in && getline(&line, &linesize, in) > 0)
+    {
+        const char* start = line;
+        while (isspace((unsigned char)*start)) ++start;
+
+        if (*start == '[')
+        {
+            if (inside && !written)
+            {
+                fprintf(out, "%s = %s\n", key, value);
+                written = true;
+            }
+
+            size_t length = strlen(section);
+            inside = !strncmp(start + 1, section, length) && start[1 + length] == ']';
+        }
+        else if (inside && !written && isKeyLine(line, key))
+        {
+            fprintf(out, "%s = %s\n", key, value);
+            written = true;
+            continue;
+        }
+
+        fputs(line, out);
+        if (!strchr(line, '\n')) fputc('\n', out);
+    }
+
+    if (!written)
+    {
+        if (!inside) fprintf(out, "%s[%s]\n", ftell(out) ? "\n" : "", section);
+        fprintf(out, "%s = %s\n", key, value);
+    }
+
+    free(line);
+    if (in) fclose(in);
+    fclose(out);
+
+    makeParentPath(path);
+
+    FILE* file = fopen(path, "w");
+    bool success = file && fwrite(result, 1, resultsize, file) == resultsize;
+
+    if (file && fclose(file)) success = false;
+    free(result);
+
+    return success;
+}
+
+// merges the keys of `data' into the object in the file
+static bool writeJsonStep(const struct step* step)
+{
+    struct json_object* data = json_tokener_parse(step->args[1]);
+    struct json_object* object = isFile(step->args[0]) ? json_object_from_file(step->args[0]) : NULL;
+    bool success;
+
+    if (!object || !json_object_is_type(object, json_type_object))
+    {
+        json_object_put(object);
+        object = json_object_new_object();
+    }
+
+    if (data && json_object_is_type(data, json_type_object))
+    {
+        json_object_object_foreach(data, name, value)
+        {
+            json_object_object_add(object, name, json_object_get(value));
+        }
+    }
+
+    makeParentPath(step->args[0]);
+    success = !json_object_to_file_ext(step->args[0], object, JSON_C_TO_STRING_PRETTY);
+
+    json_object_put(data);
+    json_object_put(object);
+
+    return success;
+}
+
+static bool runShell(const char* script, char* const args[], size_t count, const struct LaunchProfile* profile)
+{
+    char* argv[8] = { "/bin/sh", "-c", (char*)script };
+
+    for (size_t i = 0; i < count && i < 4; ++i) argv[3 + i] = args[i];
+
+    return !launchProgram(argv[0], argv, profile, true);
+}
+
+static bool executeStep(const struct step* step, const struct InstallContext* context)
+{
+    const char* file = step->args[0], *args = step->directive->size > 1 ? step->args[1] : "";
+    const char* command = step->directive->size > 2 ? step->args[2] : "";
+
+    char path[PATH_MAX];
+
+    // a command may use any installer file
+    if (!stagingResolve(context->staging, file[0] ? file : context->cachedir, true, path, sizeof(path))) return false;
+
+    // arguments are split like a shell would, in $GAMEDIR
+    if (file[0])
+    {
+        char* shargs[] = { (char*)context->gamedir, (char*)file, (char*)args };
+
+        return chmodxStep(file) && runShell("cd \"$0\" && eval \"exec \\\"\\$1\\\" $2\"", shargs, 3, NULL);
+    }
+
+    char* shargs[] = { (char*)context->gamedir, (char*)command };
+
+    return runShell("cd \"$0\" && eval \"$1\"", shargs, 2, NULL);
+}
+
+// prints `str' as a quoted .reg string
+static void regString(FILE* file, const char* str)
+{
+    fputc('"', file);
+    for (; *str; ++str)
+    {
+        if (*str == '\\' || *str == '"') fputc('\\', file);
+        fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+static bool taskStep(const struct step* step, const struct InstallContext* context)
+{
+    struct LaunchProfile profile;
+    char wineserver[PATH_MAX], regfile[PATH_MAX], path[PATH_MAX], winetricks[PATH_MAX];
+    bool success = false;
+
+    if (!launchProfileLoad(context->version, &profile) || !launchProfileSet(&profile, "WINEPREFIX", step->prefix)
+        || !launchProfileSet(&profile, "WINE", context->wine))
+    {
+        launchProfileFree(&profile);
+        return false;
+    }
+
+    switch (step->directive->task)
+    {
+        case CREATE_PREFIX:
+        {
+            char* argv[] = { (char*)context->wine, "wineboot", "--init", NULL };
+
+            makePath(step->prefix);
+            success = !launchProgram(context->wine, argv, &profile, true);
+            break;
+        }
+
+        case WINEEXEC:
+        {
+            // under its own name, wine goes by the extension
+            if (!stagingResolve(context->staging, step->args[0], true, path, sizeof(path))) break;
+
+            char* shargs[] = { (char*)context->wine, step->args[0], step->directive->size > 1 ? step->args[1] : "" };
+
+            success = runShell("eval \"exec \\\"\\$0\\\" \\\"\\$1\\\" $2\"", shargs, 3, &profile);
+            break;
+        }
+
+        case WINETRICKS:
+        {
+            if (!launchFindProgram("winetricks", winetricks, sizeof(winetricks)))
+            {
+                puts("winetricks was not found in PATH");
+                break;
+            }
+
+            char* shargs[] = { winetricks, step->args[0] };
+
+            success = runShell("exec \"$0\" -q $1", shargs, 2, &profile);
+            break;
+        }
+
+        case SET_REGEDIT:
+        {
+            // lutris defaults to a string
+            const char* type = step->args[3][0] ? step->args[3] : "REG_SZ";
+            bool dword = !strcmp(type, "REG_DWORD");
+
+            if (!dword && strcmp(type, "REG_SZ"))
+            {
+                printf("Registry values of type %s are not supported\n", type);
+                break;
+            }
+
+            snprintf(regfile, sizeof(regfile), "%s/regedit-%zu.reg", context->cachedir, step->index);
+
+            FILE* file = fopen(regfile, "w");
+            if (!file) break;
+
+            fprintf(file, "REGEDIT4\n\n[%s]\n", step->args[0]);
+            regString(file, step->args[1]);
+            fputc('=', file);
+
+            // decimal like `reg add' takes it, or hex with 0x in front
+            const char* value = step->args[2];
+            if (dword) fprintf(file, "dword:%08x", (unsigned)strtoul(value, NULL, value[0] == '0' && tolower(value[1]) == 'x' ? 16 : 10));
+            else regString(file, value);
+            fputc('\n', file);
+
+            if (fclose(file)) break;
+
+            char* argv[] = { (char*)context->wine, "regedit", "/S", regfile, NULL };
+            success = !launchProgram(context->wine, argv, &profile, true);
+            break;
+        }
+
+        case WINEKILL:
+        {
+            snprintf(wineserver, sizeof(wineserver), "%s", context->wine);
+            char* slash = strrchr(wineserver, '/');
+            snprintf(slash ? slash + 1 : wineserver, sizeof(wineserver) - (slash ? slash + 1 - wineserver : 0), "wineserver");
+
+            char* argv[] = { wineserver, "-k", NULL };
+
+            // there may be no server to kill
+            if (isFile(wineserver)) launchProgram(wineserver, argv, &profile, true);
+            success = true;
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    launchProfileFree(&profile);
+
+    return success;
+}
+
+static bool runStep(const struct step* step, const struct InstallContext* context, size_t count)
+{
+    const struct directive_t* directive = step->directive;
+    char path[PATH_MAX];
+
+    printf("[%zu/%zu] %s", step->index + 1, count, keywordstr[directive->command]);
+    if (directive->command == TASK) printf(" %s", taskKeywordstr[directive->task]);
+    if (step->args[0] && step->args[0][0] && directive->command != INPUT_MENU) printf(" %s", step->args[0]);
+    puts("");
+
+    switch (directive->command)
+    {
+        case MOVE:
+            return moveStep(step, context);
+
+        case COPY:
+        case MERGE:
+            return copyStep(step, context);
+
+        case EXTRACT:
+            return extractStep(step, context);
+
+        case CHMODX:
+            return stagingResolve(context->staging, step->args[0], true, path, sizeof(path)) && chmodxStep(step->args[0]);
+
+        case EXECUTE:
+            return executeStep(step, context);
+
+        case WRITE_FILE:
+            return writeFileStep(step);
+
+        case WRITE_CONFIG:
+            return writeConfigStep(step);
+
+        case WRITE_JSON:
+            return writeJsonStep(step);
+
+        case INPUT_MENU:
+            return true;
+
+        case TASK:
+            return taskStep(step, context);
+
+        default:
+            return false;
+    }
+}
+
+static void* stepWorker(void* data)
+{
+    struct scheduler* scheduler = data;
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    for (;;)
+    {
+        struct step* next = NULL;
+
+        // lowest ready step first, after a failure only running ones finish
+        for (size_t i = 0; !scheduler->failed && !next && i < scheduler->count; ++i)
+        {
+            if (scheduler->steps[i].state == WAITING && !scheduler->steps[i].pending) next = &scheduler->steps[i];
+        }
+
+        if (!next)
+        {
+            if (!scheduler->running) break;
+
+            pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+            continue;
+        }
+
+        next->state = RUNNING;
+        scheduler->running++;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        uint64_t span = traceStart();
+        bool success = runStep(next, scheduler->context, scheduler->count);
+        traceEnd("directive", next->directive->command == TASK ? taskKeywordstr[next->directive->task] : keywordstr[next->directive->command],
+                 span, next->args[0]);
+
+        pthread_mutex_lock(&scheduler->lock);
+        next->state = DONE;
+        scheduler->running--;
+
+        if (!success)
+        {
+            printf("Step %zu (%s) failed, stopping the install\n", next->index + 1, keywordstr[next->directive->command]);
+            scheduler->failed = true;
+        }
+
+        for (size_t j = next->index + 1; j < scheduler->count; ++j)
+        {
+            if (scheduler->after[next->index * scheduler->count + j]) scheduler->steps[j].pending--;
+        }
+
+        pthread_cond_broadcast(&scheduler->changed);
+    }
+
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return NULL;
+}
+
+// tells `staging' where the directives expect the installer files
+bool directivesStage(const struct script_t* installer, struct Staging* staging)
+{
+    for (size_t i = 0; i < installer->filecount; ++i)
+    {
+        char path[PATH_MAX];
+
+        stagedPath(path, sizeof(path), stagingDir(staging), installer->files[i]);
+        if (!stagingAdd(staging, installer->files[i]->url, path)) return false;
+    }
+
+    return true;
+}
+
+bool directivesRun(const struct script_t* installer, const struct InstallContext* context)
+{
+    struct scheduler scheduler = {
+        .context = context,
+        .count = installer->directivecount,
+    };
+    struct variables vars = {0};
+    bool success = true;
+    char path[PATH_MAX];
+
+    if (!scheduler.count) return true;
+
+    scheduler.steps = calloc(scheduler.count, sizeof(struct step));
+    scheduler.after = calloc(scheduler.count * scheduler.count, sizeof(bool));
+    if (!scheduler.steps || !scheduler.after)
+    {
+        free(scheduler.steps);
+        free(scheduler.after);
+        return false;
+    }
+
+    addVariable(&vars, "GAMEDIR", context->gamedir);
+    addVariable(&vars, "CACHE", context->cachedir);
+    addVariable(&vars, "HOME", getenv("HOME") ? getenv("HOME") : "");
+    for (size_t i = 0; i < installer->filecount; ++i)
+    {
+        stagedPath(path, sizeof(path), context->cachedir, installer->files[i]);
+        addVariable(&vars, installer->files[i]->filename, path);
+    }
+
+    // in order, an input_menu sets variables for the steps after it
+    for (size_t i = 0; success && i < scheduler.count; ++i)
+    {
+        struct step* step = &scheduler.steps[i];
+
+        step->index = i;
+        step->directive = installer->directives[i];
+        success = planStep(step, installer, context, &vars);
+
+        for (size_t j = 0; success && j < i; ++j)
+        {
+            if (conflicts(&scheduler.steps[j], step, context->cachedir))
+            {
+                scheduler.after[j * scheduler.count + i] = true;
+                step->pending++;
+            }
+        }
+    }
+
+    if (success)
+    {
+        long threads = getConfigNumber("POLECAT_INSTALL_THREADS", sysconf(_SC_NPROCESSORS_ONLN));
+        if (threads < 1) threads = 1;
+        if (threads > scheduler.count) threads = scheduler.count;
+
+        pthread_t* workers = malloc(threads * sizeof(pthread_t));
+        long started = 0;
+
+        pthread_mutex_init(&scheduler.lock, NULL);
+        pthread_cond_init(&scheduler.changed, NULL);
+
+        makePath(context->gamedir);
+
+        while (workers && started < threads - 1 && !pthread_create(&workers[started], NULL, stepWorker, &scheduler)) ++started;
+        stepWorker(&scheduler);
+        for (long i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+
+        pthread_cond_destroy(&scheduler.changed);
+        pthread_mutex_destroy(&scheduler.lock);
+        free(workers);
+
+        success = !scheduler.failed;
+    }
+
+    for (size_t i = 0; i < scheduler.count; ++i)
+    {
+        for (size_t j = 0; j < MAX_ARGUMENTS; ++j) free(scheduler.steps[i].args[j]);
+        free(scheduler.steps[i].prefix);
+    }
+
+    free(scheduler.steps);
+    free(scheduler.after);
+    freeVariables(&vars);
+
+    return success;
+}
@@ -0,0 +1,22 @@
+#ifndef DIRECTIVE_H
+#define DIRECTIVE_H
+
+#include <stdbool.h>
+
+#include "lutris.h"
+
+struct Staging;
+
+// where an installer runs, every path is absolute
+struct InstallContext {
+    const char* gamedir;                // $GAMEDIR, relative paths start here
+    const char* cachedir;               // $CACHE, the installer files are staged below it
+    struct Staging* staging;            // holds the installer files, see staging.h
+    const char* wine;                   // wine binary for tasks, NULL if there is none
+    const char* version;                // wine version whose launch profile tasks use
+};
+
+bool directivesStage(const struct script_t*, struct Staging*);
+bool directivesRun(const struct script_t*, const struct InstallContext*);
+
+#endif
@@ -1,7 +1,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <json.h>
-#include <libgen.h>
 #include <linux/limits.h>
 
 #include "dxvk.h"
@@ -9,6 +8,34 @@
 #include "tar.h"
 #include "common.h"
 #include "config.h"
+#include "catalog.h"
+#include "registry.h"
+#include "checksum.h"
+
+// the releases carry large asset and author metadata, only these are read
+static const char* const releaseKeys[] = { "name", "assets", "browser_download_url", NULL };
+
+static bool releaseRecord(struct json_object* releases, size_t index, const char** name, const char** url)
+{
+    struct json_object* release, *assets, *field;
+
+    // an error object instead of the releases, e.g. when rate limited
+    if (!json_object_is_type(releases, json_type_array) || index >= json_object_array_length(releases)) return false;
+
+    release = json_object_array_get_idx(releases, index);
+
+    *name = json_object_object_get_ex(release, "name", &field) ? json_object_get_string(field) : NULL;
+    *url = NULL;
+
+    // the first asset is the tarball
+    if (json_object_object_get_ex(release, "assets", &assets)
+        && json_object_object_get_ex(json_object_array_get_idx(assets, 0), "browser_download_url", &field))
+    {
+        *url = json_object_get_string(field);
+    }
+
+    return true;
+}
 
 const static struct Command dxvk_commands[] = {
     { .name = "install",      .func = dxvk_install,    .description = "download and install a dxvk version" },
@@ -33,49 +60,47 @@ int dxvk_install(int argc, char** argv)
 {
     if (argc == 2)
     {
-        struct json_object* runner = fetchJSON(DXVK_API);
+        struct Catalog* runner = catalogOpen(DXVK_API, releaseKeys, releaseRecord);
 
         if (runner)
         {
 
             int choice = atoi(argv[1]);
 
-            if (choice > json_object_array_length(runner) - 1 || choice < 0)
+            if (choice < 0 || choice >= catalogCount(runner))
             {
                 printf("`%i' is not a valid ID\n\nrun `" NAME " dxvk list' to get a valid ID", choice);
             }
             else
             {
-                struct json_object* version = json_object_array_get_idx(runner, choice);
-                struct json_object* assets;
-
-                json_object_object_get_ex(version, "assets", &assets);
-                version =json_object_array_get_idx(assets, 0);
-
-                json_object_object_get_ex(version, "browser_download_url", &assets);
-
-                char* name = basename((char*)json_object_get_string(assets));
-                struct MemoryStruct* tar;
+                const char* url = catalogURL(runner, choice);
+                const char* name = strrchr(url, '/') ? strrchr(url, '/') + 1 : url;
 
                 char datadir[PATH_MAX];
                 getDataDir(datadir, sizeof(datadir));
                 makeDir(datadir);
                 
-                printf("Downloading %s", json_object_get_string(assets));
-                //downloadFile(json_object_get_string(assets), name);
-                tar = downloadToRam(json_object_get_string(assets));
-
-                printf("Extracting %s\n", name);
-
-                extract(tar, datadir);
-
-                printf("Done\n");
-
-                free(tar->memory);
-                free(tar);
+                printf("Downloading and extracting %s\n", name);
+
+                struct ExtractResult result;
+                struct ExtractOptions options = { .result = &result, .replace = true };
+                char expected[SHA256_HEX_SIZE];
+                const char* source;
+
+                if (checksumLookup(url, expected, &source)) options.sha256 = expected;
+
+                if (extractURL(url, datadir, &options))
+                {
+                    if (!registryInstall("dxvk", url, &result)) puts("Could not record the installation");
+                    printf("Done\n");
+                }
+                else
+                {
+                    puts("Something went wrong. The tar is not valid");
+                }
             }
 
-            json_object_put(runner);
+            catalogClose(runner);
         }
     }
     else
@@ -87,20 +112,18 @@ int dxvk_install(int argc, char** argv)
 
 int dxvk_list(int argc, char** argv)
 {
-    struct json_object* runner = fetchJSON(DXVK_API);
+    struct Catalog* runner = catalogOpen(DXVK_API, releaseKeys, releaseRecord);
 
     if (runner)
     {
         puts("Installable DXVK versions:");
 
-        for (size_t i = 0; i < json_object_array_length(runner); ++i)
+        for (size_t i = 0; i < catalogCount(runner); ++i)
         {
-            struct json_object* version = json_object_array_get_idx(runner, i);
-            struct json_object* name;
-
-            json_object_object_get_ex(version, "name", &name);
-            printf(" [%zu]\t%s\n", i, json_object_get_string(name));
+            printf(" [%zu]\t%s\n", i, catalogName(runner, i));
         }
+
+        catalogClose(runner);
     }
 
     return 0;
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "jsonstream.h"
+
+#define JSON_MAX_DEPTH 64
+#define JSON_MAX_KEY   64
+
+enum jsonState {
+    JSON_VALUE,
+    JSON_STRING,
+    JSON_SCALAR,
+    JSON_AFTER,
+    JSON_KEY_WAIT,
+    JSON_KEY,
+    JSON_COLON,
+    JSON_SKIP_WAIT,
+    JSON_SKIP,
+    JSON_DONE,
+};
+
+struct JsonStream {
+    const char* const* keys;
+    struct json_tokener* tokener;
+    struct json_object* result;
+    bool started;
+    bool failed;
+
+    // projection filter
+    enum jsonState state;
+    bool escape;
+    size_t depth;
+    bool object[JSON_MAX_DEPTH];
+    size_t members[JSON_MAX_DEPTH];
+
+    char key[JSON_MAX_KEY];
+    size_t keylength;
+
+    size_t skipdepth;
+    bool skipstring;
+
+    // filtered bytes of the current chunk
+    char* out;
+    size_t outsize;
+    size_t outcapacity;
+};
+
+struct JsonStream* jsonStreamNew(const char* const* keys)
+{
+    struct JsonStream* stream = calloc(1, sizeof(struct JsonStream));
+
+    if (stream)
+    {
+        stream->keys = keys;
+        stream->tokener = json_tokener_new();
+
+        if (!stream->tokener)
+        {
+            free(stream);
+            return NULL;
+        }
+    }
+
+    return stream;
+}
+
+void jsonStreamFree(struct JsonStream* stream)
+{
+    if (stream)
+    {
+        json_object_put(stream->result);
+        json_tokener_free(stream->tokener);
+        free(stream->out);
+        free(stream);
+    }
+}
+
+// drops what was fed so far, e.g. when a transfer is replaced by a cached copy
+void jsonStreamReset(struct JsonStream* stream)
+{
+    json_object_put(stream->result);
+    json_tokener_reset(stream->tokener);
+
+    stream->result = NULL;
+    stream->started = false;
+    stream->failed = false;
+    stream->state = JSON_VALUE;
+    stream->escape = false;
+    stream->depth = 0;
+}
+
+static void emit(struct JsonStream* stream, const char* data, size_t size)
+{
+    if (stream->outsize + size > stream->outcapacity)
+    {
+        size_t capacity = stream->outcapacity ? stream->outcapacity * 2 : 4096;
+        while (capacity < stream->outsize + size) capacity *= 2;
+
+        char* grown = realloc(stream->out, capacity);
+        if (!grown)
+        {
+            stream->failed = true;
+            return;
+        }
+
+        stream->out = grown;
+        stream->outcapacity = capacity;
+    }
+
+    memcpy(stream->out + stream->outsize, data, size);
+    stream->outsize += size;
+}
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool wantedKey(const struct JsonStream* stream)
+{
+    // longer keys were cut off and can't match
+    if (stream->keylength >= JSON_MAX_KEY) return false;
+
+    for (const char* const* key = stream->keys; *key; ++key)
+    {
+        if (strlen(*key) == stream->keylength && !memcmp(*key, stream->key, stream->keylength)) return true;
+    }
+
+    return false;
+}
+
+static void valueDone(struct JsonStream* stream)
+{
+    stream->state = stream->depth ? JSON_AFTER : JSON_DONE;
+}
+
+static bool push(struct JsonStream* stream, char c)
+{
+    if (stream->depth == JSON_MAX_DEPTH) return false;
+
+    emit(stream, &c, 1);
+    stream->object[stream->depth] = c == '{';
+    stream->members[stream->depth] = 0;
+    stream->depth++;
+    stream->state = c == '{' ? JSON_KEY_WAIT : JSON_VALUE;
+
+    return true;
+}
+
+static bool pop(struct JsonStream* stream, char c)
+{
+    if (!stream->depth || stream->object[stream->depth - 1] != (c == '}')) return false;
+
+    emit(stream, &c, 1);
+    stream->depth--;
+    valueDone(stream);
+
+    return true;
+}
+
+// one byte through the projection, false on malformed input
+static bool filter(struct JsonStream* stream, char c)
+{
+    for (;;)
+    {
+        switch (stream->state)
+        {
+            case JSON_VALUE:
+                if (isSpace(c)) return true;
+                if (c == '{' || c == '[') return push(stream, c);
+                // an empty array
+                if (c == ']') return pop(stream, c);
+
+                emit(stream, &c, 1);
+                stream->state = c == '"' ? JSON_STRING : JSON_SCALAR;
+                stream->escape = false;
+                return true;
+
+            case JSON_STRING:
+                emit(stream, &c, 1);
+                if (stream->escape) stream->escape = false;
+                else if (c == '\\') stream->escape = true;
+                else if (c == '"') valueDone(stream);
+                return true;
+
+            case JSON_SCALAR:
+                if (c != ',' && c != '}' && c != ']' && !isSpace(c))
+                {
+                    emit(stream, &c, 1);
+                    return true;
+                }
+
+                // the byte ends the number or literal and still needs handling
+                valueDone(stream);
+                if (stream->state == JSON_DONE) emit(stream, " ", 1);
+                continue;
+
+            case JSON_AFTER:
+                if (isSpace(c)) return true;
+                if (c == '}' || c == ']') return pop(stream, c);
+                if (c != ',') return false;
+
+                if (stream->object[stream->depth - 1])
+                {
+                    // members are separated on output, dropped ones leave no comma behind
+                    stream->state = JSON_KEY_WAIT;
+                }
+                else
+                {
+                    emit(stream, &c, 1);
+                    stream->state = JSON_VALUE;
+                }
+                return true;
+
+            case JSON_KEY_WAIT:
+                if (isSpace(c)) return true;
+                if (c == '}') return pop(stream, c);
+                if (c != '"') return false;
+
+                stream->keylength = 0;
+                stream->escape = false;
+                stream->state = JSON_KEY;
+                return true;
+
+            case JSON_KEY:
+                if (!stream->escape && c == '"')
+                {
+                    stream->state = JSON_COLON;
+                    return true;
+                }
+
+                stream->escape = !stream->escape && c == '\\';
+                if (stream->keylength < JSON_MAX_KEY) stream->key[stream->keylength] = c;
+                stream->keylength++;
+                return true;
+
+            case JSON_COLON:
+                if (isSpace(c)) return true;
+                if (c != ':') return false;
+
+                if (wantedKey(stream))
+                {
+                    if (stream->members[stream->depth - 1]++) emit(stream, ",", 1);
+                    emit(stream, "\"", 1);
+                    emit(stream, stream->key, stream->keylength);
+                    emit(stream, "\":", 2);
+                    stream->state = JSON_VALUE;
+                }
+                else
+                {
+                    stream->state = JSON_SKIP_WAIT;
+                }
+                return true;
+
+            case JSON_SKIP_WAIT:
+                if (isSpace(c)) return true;
+
+                stream->skipdepth = 0;
+                stream->skipstring = false;
+                stream->escape = false;
+                stream->state = JSON_SKIP;
+                continue;
+
+            case JSON_SKIP:
+                if (stream->skipstring)
+                {
+                    if (stream->escape) stream->escape = false;
+                    else if (c == '\\') stream->escape = true;
+                    else if (c == '"')
+                    {
+                        stream->skipstring = false;
+                        if (!stream->skipdepth) stream->state = JSON_AFTER;
+                    }
+                    return true;
+                }
+
+                if (c == '"')
+                {
+                    stream->skipstring = true;
+                    return true;
+                }
+                if (c == '{' || c == '[')
+                {
+                    stream->skipdepth++;
+                    return true;
+                }
+                if (stream->skipdepth && (c == '}' || c == ']'))
+                {
+                    if (!--stream->skipdepth) stream->state = JSON_AFTER;
+                    return true;
+                }
+
+                // end of a skipped number or literal
+                if (!stream->skipdepth && (c == ',' || c == '}' || c == ']' || isSpace(c)))
+                {
+                    stream->state = JSON_AFTER;
+                    continue;
+                }
+                return true;
+
+            case JSON_DONE:
+                return isSpace(c);
+        }
+    }
+}
+
+static void parse(struct JsonStream* stream, const char* data, size_t size)
+{
+    if (stream->result || !size) return;
+
+    stream->result = json_tokener_parse_ex(stream->tokener, data, size);
+
+    if (!stream->result && json_tokener_get_error(stream->tokener) != json_tokener_continue)
+    {
+        stream->failed = true;
+    }
+}
+
+bool jsonStreamFeed(struct JsonStream* stream, const void* data, size_t size)
+{
+    const char* bytes = data;
+
+    if (size) stream->started = true;
+    if (stream->failed) return false;
+
+    if (!stream->keys)
+    {
+        parse(stream, bytes, size);
+        return !stream->failed;
+    }
+
+    stream->outsize = 0;
+    for (size_t i = 0; i < size && !stream->failed; ++i)
+    {
+        if (!filter(stream, bytes[i])) stream->failed = true;
+    }
+
+    if (!stream->failed) parse(stream, stream->out, stream->outsize);
+
+    return !stream->failed;
+}
+
+bool jsonStreamStarted(const struct JsonStream* stream)
+{
+    return stream->started;
+}
+
+// returns the parsed document, the caller owns it
+struct json_object* jsonStreamFinish(struct JsonStream* stream)
+{
+    struct json_object* result = stream->failed ? NULL : stream->result;
+
+    if (result) stream->result = NULL;
+#ifdef DEBUG
+    else puts("invalid JSON");
+#endif
+
+    return result;
+}
@@ -0,0 +1,24 @@
+#ifndef JSONSTREAM_H
+#define JSONSTREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <json.h>
+
+/*
+ * incremental JSON parser fed with the chunks of a download
+ * with `keys' (NULL terminated) only object members with one of
+ * these names are kept, at any depth, everything else is dropped
+ * before json-c allocates anything for it
+ */
+struct JsonStream;
+
+struct JsonStream* jsonStreamNew(const char* const* keys);
+void jsonStreamFree(struct JsonStream*);
+void jsonStreamReset(struct JsonStream*);
+
+bool jsonStreamFeed(struct JsonStream*, const void* data, size_t size);
+bool jsonStreamStarted(const struct JsonStream*);
+struct json_object* jsonStreamFinish(struct JsonStream*);
+
+#endif
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <linux/limits.h>
+
+#include "launch.h"
+#include "common.h"
+#include "config.h"
+#include "metrics.h"
+
+extern char** environ;
+
+/*
+ * launch profiles live in <config dir>/profiles, `default' applies to
+ * every version and <version> on top of it, one variable per line:
+ *   WINEPREFIX=~/Games/foo
+ *   WINEDLLOVERRIDES=d3d11,dxgi=n
+ *   DXVK_HUD=fps
+ * lines starting with # are comments, a leading ~/ is the home directory
+ */
+
+static bool setEntry(struct LaunchProfile* profile, const char* name, size_t namelen, const char* value)
+{
+    char* home = getenv("HOME");
+    bool tilde = !strncmp(value, "~/", 2) && home;
+    size_t size = namelen + strlen(value) + (tilde ? strlen(home) : 0) + 2;
+    char* entry = malloc(size);
+    size_t i;
+
+    if (!entry) return false;
+
+    if (tilde) snprintf(entry, size, "%.*s=%s%s", (int)namelen, name, home, value + 1);
+    else snprintf(entry, size, "%.*s=%s", (int)namelen, name, value);
+
+    for (i = 0; i < profile->count; ++i)
+    {
+        if (!strncmp(profile->env[i], entry, namelen + 1)) break;
+    }
+
+    if (i == profile->count)
+    {
+        char** grown = realloc(profile->env, (profile->count + 2) * sizeof(char*));
+        if (!grown)
+        {
+            free(entry);
+            return false;
+        }
+
+        profile->env = grown;
+        profile->env[++profile->count] = NULL;
+    }
+    else
+    {
+        free(profile->env[i]);
+    }
+
+    profile->env[i] = entry;
+
+    return true;
+}
+
+bool launchProfileSet(struct LaunchProfile* profile, const char* name, const char* value)
+{
+    return setEntry(profile, name, strlen(name), value);
+}
+
+const char* launchProfileGet(const struct LaunchProfile* profile, const char* name)
+{
+    size_t namelen = strlen(name);
+
+    for (size_t i = 0; i < profile->count; ++i)
+    {
+        if (!strncmp(profile->env[i], name, namelen) && profile->env[i][namelen] == '=') return profile->env[i] + namelen + 1;
+    }
+
+    return NULL;
+}
+
+static bool readProfile(struct LaunchProfile* profile, const char* name)
+{
+    char path[PATH_MAX], line[PATH_MAX + 256];
+    FILE* file;
+    bool success = true;
+
+    getConfigDir(path, sizeof(path));
+    strncat(path, "/profiles/", sizeof(path) - strlen(path) - 1);
+    strncat(path, name, sizeof(path) - strlen(path) - 1);
+
+    if (!(file = fopen(path, "r"))) return true;
+
+    while (success && fgets(line, sizeof(line), file))
+    {
+        char* separator;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || !line[0]) continue;
+
+        if (!(separator = strchr(line, '=')) || separator == line)
+        {
+            printf("%s: ignoring `%s'\n", path, line);
+            continue;
+        }
+
+        success = setEntry(profile, line, separator - line, separator + 1);
+    }
+
+    fclose(file);
+
+    return success;
+}
+
+bool launchProfileLoad(const char* version, struct LaunchProfile* profile)
+{
+    profile->count = 0;
+    profile->env = calloc(1, sizeof(char*));
+    if (!profile->env) return false;
+
+    for (char** var = environ; *var; ++var)
+    {
+        char* separator = strchr(*var, '=');
+        if (separator && !setEntry(profile, *var, separator - *var, separator + 1)) return false;
+    }
+
+    return readProfile(profile, "default") && (!version || readProfile(profile, version));
+}
+
+void launchProfileFree(struct LaunchProfile* profile)
+{
+    for (size_t i = 0; i < profile->count; ++i) free(profile->env[i]);
+    free(profile->env);
+
+    profile->env = NULL;
+    profile->count = 0;
+}
+
+/*
+ * starts `path' without a shell, unsupervised it replaces polecat
+ * (only returns on failure), supervised it is spawned and waited for
+ * returns the exit status like a shell would
+ */
+int launchProgram(const char* path, char* const argv[], const struct LaunchProfile* profile, bool supervise)
+{
+    char** env = profile ? profile->env : environ;
+    pid_t pid;
+    int status, error;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    if (!supervise)
+    {
+        // nothing runs at exit after this
+        metricsFlush();
+        execve(path, argv, env);
+        printf("Cannot run %s: %s\n", path, strerror(errno));
+        return 127;
+    }
+
+    if ((error = posix_spawn(&pid, path, NULL, NULL, argv, env)))
+    {
+        printf("Cannot run %s: %s\n", path, strerror(error));
+        return 127;
+    }
+
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR) return 127;
+    }
+
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+
+    return WEXITSTATUS(status);
+}
+
+// looks `name' up in PATH like a shell would
+bool launchFindProgram(const char* name, char* path, size_t size)
+{
+    const char* dirs = getenv("PATH");
+
+    while (dirs && *dirs)
+    {
+        size_t length = strcspn(dirs, ":");
+
+        snprintf(path, size, "%.*s/%s", (int)length, length ? dirs : ".", name);
+        if (!access(path, X_OK) && isFile(path)) return true;
+
+        dirs += length;
+        if (*dirs) ++dirs;
+    }
+
+    return false;
+}
+
+/*
+ * spawns `path' in its own session with stdio on /dev/null,
+ * for servers that keep running after polecat exits
+ */
+pid_t launchDetached(const char* path, char* const argv[], const struct LaunchProfile* profile)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    pid_t pid = -1;
+    int error;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSID);
+
+    if ((error = posix_spawn(&pid, path, &actions, &attributes, argv, profile ? profile->env : environ)))
+    {
+        printf("Cannot run %s: %s\n", path, strerror(error));
+        pid = -1;
+    }
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    return pid;
+}
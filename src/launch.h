@@ -0,0 +1,23 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// environment a runner is started with, the caller's plus the profile's
+struct LaunchProfile {
+    char** env;
+    size_t count;
+};
+
+bool launchProfileLoad(const char* version, struct LaunchProfile*);
+bool launchProfileSet(struct LaunchProfile*, const char* name, const char* value);
+const char* launchProfileGet(const struct LaunchProfile*, const char* name);
+void launchProfileFree(struct LaunchProfile*);
+
+int launchProgram(const char* path, char* const argv[], const struct LaunchProfile*, bool supervise);
+pid_t launchDetached(const char* path, char* const argv[], const struct LaunchProfile*);
+bool launchFindProgram(const char* name, char* path, size_t size);
+
+#endif
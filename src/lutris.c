@@ -1,11 +1,20 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <linux/limits.h>
 #include <libgen.h>
+#include <unistd.h>
 
 #include "lutris.h"
 #include "net.h"
+#include "staging.h"
 #include "common.h"
+#include "config.h"
+#include "launch.h"
+#include "directive.h"
+#include "arena.h"
+#include "bytecode.h"
+#include "trace.h"
 
 const static struct Command lutris_commands[] = {
 #ifdef DEBUG
@@ -28,6 +37,61 @@ int lutris(int argc, char** argv)
 }
 
 
+// runs the directives in the current directory, the installer files are staged next to the game
+static bool runDirectives(const struct script_t* installer)
+{
+    char gamedir[PATH_MAX], wine[PATH_MAX];
+    struct InstallContext context = {
+        .gamedir = gamedir,
+        .version = installer->wine,
+    };
+    bool success;
+
+    if (!getcwd(gamedir, sizeof(gamedir))) return false;
+
+    if (installer->wine)
+    {
+        getDataDir(wine, sizeof(wine));
+        strncat(wine, "/", sizeof(wine) - strlen(wine) - 1);
+        strncat(wine, installer->wine, sizeof(wine) - strlen(wine) - 1);
+        strncat(wine, "/bin/wine", sizeof(wine) - strlen(wine) - 1);
+    }
+
+    if (installer->wine && isFile(wine)) context.wine = wine;
+    else if (launchFindProgram("wine", wine, sizeof(wine))) context.wine = wine;
+
+    if (!(context.staging = stagingOpen(gamedir)))
+    {
+        puts("Cannot create a directory for the installer files");
+        return false;
+    }
+
+    context.cachedir = stagingDir(context.staging);
+
+    // files fetched by an earlier install come from the download store
+    uint64_t span = traceStart();
+    bool fetched = directivesStage(installer, context.staging) && stagingFetch(context.staging);
+    traceEnd("install", "fetch", span, installer->name);
+
+    if (!fetched)
+    {
+        puts("Download failed, aborting install");
+        stagingClose(context.staging);
+        return false;
+    }
+
+    span = traceStart();
+    success = directivesRun(installer, &context);
+    traceEnd("install", "directives", span, installer->name);
+
+    if (success) printf("Installed %s - %s\n", installer->name, installer->version);
+    else puts("Install failed");
+
+    stagingClose(context.staging);
+
+    return success;
+}
+
 int lutris_install(int argc, char** argv)
 {
     if (argc == 2)
@@ -37,87 +101,11 @@ int lutris_install(int argc, char** argv)
 
         if (installer.error == NONE)
         {
-            struct MemoryStruct** files = NULL;
-
             printf("Install %s - %s to the current directory?\nThis may download files and install wine versions\n(y/n)\n", installer.name, installer.version);
 
             if ((inp=getchar()) == 'y')
             {
-                // fetch all files required by installer
-                // TODO: think about storing files on disk for larger files
-                files = malloc( installer.filecount * sizeof(void*) );
-                for (size_t i = 0; i < installer.filecount; ++i)
-                {
-                    char* filename = basename(installer.files[i]->url);
-                    printf("Dowloading %s...\n", filename);
-                    files[i] = downloadToRam(installer.files[i]->url);
-                }
-
-
-                for (size_t i = 0; i < installer.directivecount; ++i)
-                {
-                    assert(installer.directives[i]->command < UNKNOWN_DIRECTIVE);
-                    switch(installer.directives[i]->command)
-                    {
-
-                        case MOVE:
-                            // TODO
-                            break;
-
-                        case MERGE:
-                            // TODO
-                            break;
-                        case EXTRACT:
-                            // TODO
-                            break;
-                        case COPY:
-                            // TODO
-                            break;
-                        case CHMODX:
-                            // TODO
-                            break;
-                        case EXECUTE:
-                            // TODO
-                            break;
-                        case WRITE_FILE:
-                        case WRITE_JSON:
-                            // TODO
-                            break;
-
-                        case WRITE_CONFIG:
-                            // TODO
-                            break;
-
-                        case INPUT_MENU:
-                            // TODO
-                            break;
-
-                        case INSERT_DISC:
-                            // TODO
-                            break;
-
-                        case TASK:
-                            // TODO
-                            break;
-
-                        case UNKNOWN_DIRECTIVE:
-                            printf("Unknown directive %i\nIf you see this please report it.", installer.directives[i]->command);
-                            break;
-
-                        default:
-                            unreachable;
-                            break;
-                    }
-                }
-
-                // cleanup all files kept in memory
-                for (size_t i = 0; i < installer.filecount; ++i)
-                {
-                    free(files[i]->memory);
-                    free(files[i]);
-                }
-
-                free(files);
+                runDirectives(&installer);
             }
         }
         else
@@ -186,7 +174,7 @@ int lutris_info(int argc, char** argv)
 
                     for (int j = 0; j < installer.directives[i]->size; ++j)
                     {
-                        printf(" %s", installer.directives[i]->arguments[j]);
+                        if (installer.directives[i]->arguments[j][0]) printf(" %s", installer.directives[i]->arguments[j]);
                     }
 
                     puts("");
@@ -212,15 +200,73 @@ int lutris_help(int argc, char** argv)
     return 0;
 }
 
+// POLECAT_INSTALLER_API points at a mirror, or the mock server of `make bench'
 void lutris_getInstallerURL(char* buffer, char* name, size_t size)
 {
-        strncpy(buffer, INSTALLER_API, size);
-        strncat(buffer, name, size - strlen(buffer));
+    const char* api = getenv("POLECAT_INSTALLER_API");
+
+    snprintf(buffer, size, "%s%s", api && api[0] ? api : INSTALLER_API, name);
+}
+
+/*
+ * perfect hashes over keywordstr and taskKeywordstr, found offline:
+ * length, second and last character never collide for the known words
+ */
+static const enum keyword keywordSlots[16] = {
+    UNKNOWN_DIRECTIVE, UNKNOWN_DIRECTIVE, INPUT_MENU, UNKNOWN_DIRECTIVE,
+    MERGE, COPY, WRITE_FILE, EXTRACT,
+    WRITE_JSON, EXECUTE, UNKNOWN_DIRECTIVE, TASK,
+    WRITE_CONFIG, MOVE, CHMODX, INSERT_DISC,
+};
+
+static const enum task taskSlots[8] = {
+    WINEEXEC, UNKNOWN_TASK, WINETRICKS, UNKNOWN_TASK,
+    SET_REGEDIT, WINEKILL, UNKNOWN_TASK, CREATE_PREFIX,
+};
+
+static enum keyword keywordLookup(const char* key)
+{
+    size_t length = strlen(key);
+    if (length < 2) return UNKNOWN_DIRECTIVE;
+
+    enum keyword l = keywordSlots[(length + (unsigned char)key[1] + 2 * (unsigned char)key[length - 1]) & 15];
+
+    return l != UNKNOWN_DIRECTIVE && !strcmp(key, keywordstr[l]) ? l : UNKNOWN_DIRECTIVE;
+}
+
+static enum task taskLookup(const char* name)
+{
+    size_t length = name ? strlen(name) : 0;
+    if (length < 2) return UNKNOWN_TASK;
+
+    enum task k = taskSlots[(length + (unsigned char)name[1] + 5 * (unsigned char)name[length - 1]) & 7];
+
+    return k != UNKNOWN_TASK && !strcmp(name, taskKeywordstr[k]) ? k : UNKNOWN_TASK;
+}
+
+// copies a json string into the installer's arena, NULL if there is none
+static char* copyString(struct Arena* arena, struct json_object* value)
+{
+    const char* str = json_object_get_string(value);
+
+    return str ? arenaString(arena, str, strlen(str)) : NULL;
+}
+
+// updated_at of the only result, changes with every edit of the installer
+static const char* getRevision(struct json_object* installerjson)
+{
+    struct json_object* results, *updated;
+
+    json_object_object_get_ex(installerjson, "results", &results);
+    json_object_object_get_ex(json_object_array_get_idx(results, 0), "updated_at", &updated);
+
+    return json_object_get_string(updated);
 }
 
 struct script_t lutris_getInstaller(char* installername)
 {
     struct script_t installer;
+    installer.arena = NULL;
     installer.name = NULL;
     installer.version = NULL;
     installer.runner = UNKNOWN_RUNNER;
@@ -233,12 +279,24 @@ struct script_t lutris_getInstaller(char* installername)
     installer.filecount = 0;
     installer.error = NONE;
 
-    if (installername)
+    if (installername && (installer.arena = arenaNew()))
     {
+        struct Arena* arena = installer.arena;
         char installerurl[PATH_MAX];
         lutris_getInstallerURL(installerurl, installername, sizeof(installerurl));
 
+        // compiled from the same cached response, nothing to fetch or parse
+        if (bytecodeLoad(installerurl, NULL, &installer)) return installer;
+
         struct json_object* installerjson = fetchJSON(installerurl);
+        const char* revision = getRevision(installerjson);
+
+        // the response was refreshed but the installer is still the same
+        if (installerjson && bytecodeLoad(installerurl, revision, &installer))
+        {
+            json_object_put(installerjson);
+            return installer;
+        }
 
         if (installerjson)
         {
@@ -256,21 +314,17 @@ struct script_t lutris_getInstaller(char* installername)
                 {
                     {
                         struct json_object* name, *version, *runner, *description, *notes, *wine, *winever;
-                        const char* namestr, *versionstr, *runnerstr, *descriptionstr, *notesstr, *winestr;
+                        const char* runnerstr;
 
                         json_object_object_get_ex(slug, "name", &name);
-                        namestr = json_object_get_string(name);
-                        installer.name = malloc( strlen(namestr) * sizeof(char) +1 );
-                        strcpy(installer.name, namestr);
+                        installer.name = copyString(arena, name);
 
                         json_object_object_get_ex(slug, "version", &version);
-                        versionstr = json_object_get_string(version);
-                        installer.version = malloc( strlen(versionstr) * sizeof(char) +1 );
-                        strcpy(installer.version, versionstr);
+                        installer.version = copyString(arena, version);
 
                         json_object_object_get_ex(slug, "runner", &runner);
                         runnerstr = json_object_get_string(runner);
-                        for (int i = 0; i < RUNNERMAX; ++i)
+                        for (int i = 0; runnerstr && i < RUNNERMAX; ++i)
                         {
                             if(!strcmp(runnerstr, runnerStr[i]))
                             {
@@ -280,29 +334,14 @@ struct script_t lutris_getInstaller(char* installername)
                         }
 
                         json_object_object_get_ex(slug, "description", &description);
-                        if (description)
-                        {
-                            descriptionstr = json_object_get_string(description);
-                            installer.description = malloc( strlen(descriptionstr) * sizeof(char) +1 );
-                            strcpy(installer.description, descriptionstr);
-                        }
+                        installer.description = copyString(arena, description);
 
                         json_object_object_get_ex(slug, "notes", &notes);
-                        if (notes)
-                        {
-                            notesstr = json_object_get_string(notes);
-                            installer.notes = malloc( strlen(notesstr) * sizeof(char) +1 );
-                            strcpy(installer.notes, notesstr);
-                        }
+                        installer.notes = copyString(arena, notes);
 
                         json_object_object_get_ex(script, "wine", &wine);
                         json_object_object_get_ex(wine, "version", &winever);
-                        if (winever)
-                        {
-                            winestr = json_object_get_string(winever);
-                            installer.wine = malloc( strlen(winestr) * sizeof(char) +1 );
-                            strcpy(installer.name, winestr);
-                        }
+                        installer.wine = copyString(arena, winever);
 
                     }
 
@@ -310,19 +349,14 @@ struct script_t lutris_getInstaller(char* installername)
                     {
                         installer.filecount = json_object_array_length(files);
 
-                        installer.files = malloc(installer.filecount * sizeof(void*));
+                        installer.files = arenaAlloc(arena, installer.filecount * sizeof(void*));
                         for (int i = 0; i < installer.filecount; ++i)
                         {
                             struct json_object* file = json_object_array_get_idx(files, i);
                             struct lh_entry* entry = json_object_get_object(file)->head;
 
-                            installer.files[i] = malloc(sizeof(struct file_t));
-
-                            {
-                                size_t namelen = strlen((char*)entry->k);
-                                installer.files[i]->filename = malloc(namelen * sizeof(char) +1);
-                                strcpy(installer.files[i]->filename, (char*)entry->k);
-                            }
+                            installer.files[i] = arenaAlloc(arena, sizeof(struct file_t));
+                            installer.files[i]->filename = arenaString(arena, (char*)entry->k, strlen((char*)entry->k));
 
                             const char* urlstr;
 
@@ -338,11 +372,7 @@ struct script_t lutris_getInstaller(char* installername)
                                 urlstr = json_object_get_string((struct json_object*)entry->v);
                             }
 
-                            {
-                                size_t urllen = strlen(urlstr);
-                                installer.files[i]->url = malloc(urllen * sizeof(char) +1);
-                                strcpy(installer.files[i]->url, urlstr);
-                            }
+                            installer.files[i]->url = arenaString(arena, urlstr ? urlstr : "", urlstr ? strlen(urlstr) : 0);
                         }
                     }
 
@@ -350,22 +380,24 @@ struct script_t lutris_getInstaller(char* installername)
                     {
                         installer.directivecount = json_object_array_length(scriptinstall);
 
-                        installer.directives = malloc(installer.directivecount * sizeof(void*));
+                        installer.directives = arenaAlloc(arena, installer.directivecount * sizeof(void*));
                         for (int i = 0; i < installer.directivecount; ++i)
                         {
                             struct json_object* step = json_object_array_get_idx(scriptinstall, i);
-                            struct json_object* directive;
 
-                            installer.directives[i] = malloc(sizeof(struct directive_t));
+                            installer.directives[i] = arenaAlloc(arena, sizeof(struct directive_t));
+                            installer.directives[i]->arguments = NULL;
                             installer.directives[i]->size = 0;
                             installer.directives[i]->command = UNKNOWN_DIRECTIVE;
                             installer.directives[i]->task = NO_TASK;
 
-                            for (int l = 0; l < KEYWORDMAX; ++l)
+                            // the first key that names a directive decides
+                            json_object_object_foreach(step, key, directive)
                             {
-                                if (json_object_object_get_ex(step, keywordstr[l], &directive))
+                                enum keyword l = keywordLookup(key);
+                                if (l != UNKNOWN_DIRECTIVE)
                                 {
-                                    struct json_object* options[5];
+                                    struct json_object* options[6];
                                     switch (l)
                                     {
                                         case MOVE:
@@ -378,16 +410,20 @@ struct script_t lutris_getInstaller(char* installername)
 
                                         case EXTRACT:
                                             json_object_object_get_ex(directive, "file", &options[0]);
-                                            installer.directives[i]->size = 1;
+                                            json_object_object_get_ex(directive, "dst", &options[1]);
+                                            installer.directives[i]->size = 2;
                                             break;
 
                                         case CHMODX:
+                                            options[0] = directive;
                                             installer.directives[i]->size = 1;
                                             break;
 
                                         case EXECUTE:
-                                            if(!json_object_object_get_ex(directive, "command", &options[0])) json_object_object_get_ex(directive, "file", &options[0]);
-                                            installer.directives[i]->size = 1;
+                                            json_object_object_get_ex(directive, "file", &options[0]);
+                                            json_object_object_get_ex(directive, "args", &options[1]);
+                                            json_object_object_get_ex(directive, "command", &options[2]);
+                                            installer.directives[i]->size = 3;
                                             break;
 
                                         case WRITE_FILE:
@@ -425,41 +461,48 @@ struct script_t lutris_getInstaller(char* installername)
                                         case TASK:
                                             json_object_object_get_ex(directive, "name", &options[0]);
                                             const char* name = json_object_get_string(options[0]);
-                                            for (int k = 0; k <= TASKKEYWORDMAX; ++k)
+                                            enum task k = taskLookup(name);
+                                            if (k != UNKNOWN_TASK)
                                             {
-                                                if (!strcmp(name, taskKeywordstr[k]))
+                                                switch(k)
                                                 {
-                                                    switch(k)
-                                                    {
-                                                        case WINEEXEC:
-                                                            json_object_object_get_ex(directive, "executable", &options[1]);
-                                                            installer.directives[i]->size = 1;
-                                                            break;
-
-                                                        case WINETRICKS:
-                                                            json_object_object_get_ex(directive, "app", &options[1]);
-                                                            json_object_object_get_ex(directive, "prefix", &options[2]);
-                                                            installer.directives[i]->size = 2;
-                                                            break;
-
-                                                        case CREATE_PREFIX:
-                                                        case WINEKILL:
-                                                            json_object_object_get_ex(directive, "prefix", &options[1]);
-                                                            installer.directives[i]->size = 1;
-                                                            break;
-
-                                                        case SET_REGEDIT:
-                                                            json_object_object_get_ex(directive, "path", &options[1]);
-                                                            json_object_object_get_ex(directive, "key", &options[2]);
-                                                            json_object_object_get_ex(directive, "value", &options[3]);
-                                                            installer.directives[i]->size = 3;
-                                                            break;
-                                                    }
-                                                    installer.directives[i]->task = k;
-                                                    break;
+                                                    case WINEEXEC:
+                                                        json_object_object_get_ex(directive, "executable", &options[1]);
+                                                        json_object_object_get_ex(directive, "args", &options[2]);
+                                                        json_object_object_get_ex(directive, "prefix", &options[3]);
+                                                        installer.directives[i]->size = 3;
+                                                        break;
+
+                                                    case WINETRICKS:
+                                                        json_object_object_get_ex(directive, "app", &options[1]);
+                                                        json_object_object_get_ex(directive, "prefix", &options[2]);
+                                                        installer.directives[i]->size = 2;
+                                                        break;
+
+                                                    case CREATE_PREFIX:
+                                                    case WINEKILL:
+                                                        json_object_object_get_ex(directive, "prefix", &options[1]);
+                                                        installer.directives[i]->size = 1;
+                                                        break;
+
+                                                    case SET_REGEDIT:
+                                                        json_object_object_get_ex(directive, "path", &options[1]);
+                                                        json_object_object_get_ex(directive, "key", &options[2]);
+                                                        json_object_object_get_ex(directive, "value", &options[3]);
+                                                        json_object_object_get_ex(directive, "type", &options[4]);
+                                                        json_object_object_get_ex(directive, "prefix", &options[5]);
+                                                        installer.directives[i]->size = 5;
+                                                        break;
+
+                                                    default:
+                                                        break;
                                                 }
+                                                installer.directives[i]->task = k;
                                             }
                                             break;
+
+                                        default:
+                                            break;
                                     }
                                     installer.directives[i]->command = l;
 
@@ -470,12 +513,13 @@ struct script_t lutris_getInstaller(char* installername)
                                         offset = 1;
                                     }
 
-                                    installer.directives[i]->arguments = malloc(installer.directives[i]->size * sizeof(char*));
+                                    installer.directives[i]->arguments = arenaAlloc(arena, installer.directives[i]->size * sizeof(char*));
                                     for (int j = 0; j < installer.directives[i]->size; ++j)
                                     {
+                                        // missing optional keys become empty strings
                                         str = json_object_get_string(options[j+offset]);
-                                        installer.directives[i]->arguments[j] = malloc(strlen(str) * sizeof(char) +1);
-                                        strcpy(installer.directives[i]->arguments[j], str);
+                                        if (!str) str = "";
+                                        installer.directives[i]->arguments[j] = arenaString(arena, str, strlen(str));
                                     }
                                     break;
                                 }
@@ -488,6 +532,8 @@ struct script_t lutris_getInstaller(char* installername)
             }
             else installer.error = NO_SLUG;
 
+            if (installer.error == NONE) bytecodeStore(installerurl, revision, &installer);
+
             json_object_put(installerjson);
         }
         else installer.error = NO_JSON;
@@ -500,36 +546,8 @@ void lutris_freeInstaller(struct script_t* installer)
 {
     if (installer)
     {
-        free(installer->name);
-        free(installer->version);
-        free(installer->description);
-        free(installer->notes);
-        free(installer->wine);
-
-        if (installer->directives)
-        {
-            for (int i = 0; i < installer->directivecount; ++i)
-            {
-                for (int j = 0; j < installer->directives[i]->size; ++j)
-                {
-                    free(installer->directives[i]->arguments[j]);
-                }
-
-                free(installer->directives[i]->arguments);
-                free(installer->directives[i]);
-            }
-            free(installer->directives);
-        }
-
-        if (installer->files)
-        {
-            for (int i = 0; i < installer->filecount; ++i)
-            {
-                free(installer->files[i]->filename);
-                free(installer->files[i]->url);
-                free(installer->files[i]);
-            }
-            free(installer->files);
-        }
+        // every string and array of the installer is in its arena
+        arenaFree(installer->arena);
+        installer->arena = NULL;
     }
 }
@@ -93,7 +93,10 @@ struct file_t {
     char* url;
 };
 
+struct Arena;
+
 struct script_t {
+    struct Arena* arena;                // holds everything below
     char* name;
     char* version;
     enum runner_t runner;
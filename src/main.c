@@ -3,11 +3,15 @@
 #include <linux/limits.h>
 
 #include "main.h"
+#include "net.h"
 #include "wine.h"
 #include "dxvk.h"
 #include "lutris.h"
+#include "cache.h"
 #include "common.h"
 #include "config.h"
+#include "trace.h"
+#include "metrics.h"
 
 const static struct Command main_commands[] = {
     { .name = "wine",   .func = wine,      .description = "manage wine versions" },
@@ -15,12 +19,45 @@ const static struct Command main_commands[] = {
     { .name = "dxvk",   .func = dxvk,      .description = "manage dxvk versions" },
 #endif
     { .name = "lutris", .func = lutris,    .description = "run lutris instraller"},
+    { .name = "cache",  .func = cache,     .description = "manage the download cache" },
+    { .name = "stats",  .func = stats,     .description = "show what downloads, the cache and installs added up to" },
     { .name = "info",   .func = main_info, .description = "show some information about polecat" },
 };
 
 
 int main(int argc, char** argv)
 {
+    netSetOffline(getConfigNumber("POLECAT_OFFLINE", 0));
+    metricsOpen();
+
+    // global options go before the command
+    while (argc > 1 && !strncmp(argv[1], "--", 2))
+    {
+        if (!strcmp(argv[1], "--offline"))
+        {
+            netSetOffline(true);
+        }
+        else if (!strcmp(argv[1], "--trace") && argc > 2)
+        {
+            if (!traceOpen(argv[2]))
+            {
+                printf("Cannot trace to %s\n", argv[2]);
+                return 1;
+            }
+
+            --argc;
+            ++argv;
+        }
+        else
+        {
+            printf("unknown option `%s'\n", argv[1]);
+            return main_help(argc, argv);
+        }
+
+        --argc;
+        ++argv;
+    }
+
     if (argc > 1)
     {
         for (int i = 0; i < ARRAY_LEN(main_commands); ++i)
@@ -54,7 +91,11 @@ int main_info(int argc, char** argv)
 
 int main_help(int argc, char** argv)
 {
-    puts(USAGE_STR " <command>\n\nList of commands:");
+    puts(USAGE_STR " [options] <command>\n\n"
+         "Options:\n"
+         "\t--offline\t only use cached catalogs and installers\n"
+         "\t--trace <file>\t write a chrome trace of downloads, extraction and install steps\n\n"
+         "List of commands:");
 
     print_help(main_commands, ARRAY_LEN(main_commands));
 
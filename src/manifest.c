@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "manifest.h"
+#include "common.h"
+#include "config.h"
+
+/*
+ * <data dir>/.manifests/<runner> lists every regular file an install wrote
+ *   sha256  size  mtime  path
+ * tab separated and sorted by path, which is relative to the data dir as
+ * the archive named it, so damaged files can be extracted again one by one
+ * the hashes come from the extraction, mtime and size from a stat after it
+ */
+
+#define MANIFEST_HEADER       "polecat-manifest 1"
+#define VERIFY_MAX_THREADS    16
+
+struct Manifest* manifestNew(void)
+{
+    struct Manifest* manifest = calloc(1, sizeof(struct Manifest));
+
+    if (manifest) pthread_mutex_init(&manifest->lock, NULL);
+
+    return manifest;
+}
+
+void manifestFree(struct Manifest* manifest)
+{
+    if (!manifest) return;
+
+    for (size_t i = 0; i < manifest->count; ++i) free(manifest->entries[i].path);
+    free(manifest->entries);
+    pthread_mutex_destroy(&manifest->lock);
+    free(manifest);
+}
+
+static struct ManifestEntry* addEntry(struct Manifest* manifest, const char* path)
+{
+    char* copy = strdup(path);
+
+    if (!copy) return NULL;
+
+    if (manifest->count == manifest->capacity)
+    {
+        size_t capacity = manifest->capacity ? manifest->capacity * 2 : 1024;
+        struct ManifestEntry* grown = realloc(manifest->entries, capacity * sizeof(struct ManifestEntry));
+
+        if (!grown)
+        {
+            free(copy);
+            return NULL;
+        }
+
+        manifest->entries = grown;
+        manifest->capacity = capacity;
+    }
+
+    struct ManifestEntry* entry = &manifest->entries[manifest->count++];
+
+    memset(entry, 0, sizeof(struct ManifestEntry));
+    entry->path = copy;
+
+    return entry;
+}
+
+// an extractHashed callback, see tar.h
+void manifestAdd(const char* path, const char sha256[SHA256_HEX_SIZE], uint64_t size, void* data)
+{
+    struct Manifest* manifest = data;
+
+    pthread_mutex_lock(&manifest->lock);
+
+    struct ManifestEntry* entry = addEntry(manifest, path);
+    if (entry)
+    {
+        entry->size = size;
+        memcpy(entry->sha256, sha256, SHA256_HEX_SIZE);
+    }
+
+    pthread_mutex_unlock(&manifest->lock);
+}
+
+// an extractRestart callback, empties the manifest
+void manifestClear(void* data)
+{
+    struct Manifest* manifest = data;
+
+    pthread_mutex_lock(&manifest->lock);
+
+    for (size_t i = 0; i < manifest->count; ++i) free(manifest->entries[i].path);
+    manifest->count = 0;
+
+    pthread_mutex_unlock(&manifest->lock);
+}
+
+static int compareEntries(const void* a, const void* b)
+{
+    return strcmp(((const struct ManifestEntry*)a)->path, ((const struct ManifestEntry*)b)->path);
+}
+
+// entries are sorted once the manifest was saved or loaded
+struct ManifestEntry* manifestFind(struct Manifest* manifest, const char* path)
+{
+    struct ManifestEntry key = { .path = (char*)path };
+
+    return bsearch(&key, manifest->entries, manifest->count, sizeof(struct ManifestEntry), compareEntries);
+}
+
+static void getManifestPath(char* buffer, size_t size, const char* name)
+{
+    getDataDir(buffer, size);
+    strncat(buffer, "/.manifests", size - strlen(buffer) - 1);
+    makePath(buffer);
+    strncat(buffer, "/", size - strlen(buffer) - 1);
+    strncat(buffer, name, size - strlen(buffer) - 1);
+}
+
+// takes mtime and size of every file in `datadir' that is not damaged as they are now
+bool manifestSave(struct Manifest* manifest, const char* datadir, const char* name)
+{
+    char path[PATH_MAX], temp[PATH_MAX + 16];
+    FILE* file;
+
+    // an archive without a single top level directory has no name to go by
+    if (!name[0]) return false;
+
+    int dirfd = open(datadir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) return false;
+
+    qsort(manifest->entries, manifest->count, sizeof(struct ManifestEntry), compareEntries);
+
+    getManifestPath(path, sizeof(path), name);
+    snprintf(temp, sizeof(temp), "%s.%i", path, getpid());
+
+    if (!(file = fopen(temp, "w")))
+    {
+        close(dirfd);
+        return false;
+    }
+
+    fprintf(file, MANIFEST_HEADER "\n");
+
+    for (size_t i = 0; i < manifest->count; ++i)
+    {
+        struct ManifestEntry* entry = &manifest->entries[i];
+        struct stat sb;
+
+        if (entry->state == MANIFEST_OK && !fstatat(dirfd, entry->path, &sb, AT_SYMLINK_NOFOLLOW))
+        {
+            entry->size = sb.st_size;
+            entry->mtime = sb.st_mtim;
+        }
+
+        fprintf(file, "%s\t%" PRIu64 "\t%lld.%09ld\t%s\n", entry->sha256, entry->size,
+                (long long)entry->mtime.tv_sec, entry->mtime.tv_nsec, entry->path);
+    }
+
+    close(dirfd);
+
+    if (fflush(file) || fsync(fileno(file)) || fclose(file) || rename(temp, path))
+    {
+        unlink(temp);
+        return false;
+    }
+
+    return true;
+}
+
+static bool parseEntry(char* line, struct Manifest* manifest)
+{
+    char* fields[4];
+    size_t count = 0;
+
+    line[strcspn(line, "\n")] = '\0';
+
+    // the path comes last and is taken as is
+    for (char* field; count < ARRAY_LEN(fields) - 1 && (field = strsep(&line, "\t")); ) fields[count++] = field;
+    if (count != ARRAY_LEN(fields) - 1 || !line || !*line || strlen(fields[0]) != SHA256_HEX_SIZE - 1) return false;
+    fields[count] = line;
+
+    struct ManifestEntry* entry = addEntry(manifest, fields[3]);
+    if (!entry) return false;
+
+    char* fraction;
+
+    memcpy(entry->sha256, fields[0], SHA256_HEX_SIZE);
+    entry->size = strtoull(fields[1], NULL, 10);
+    entry->mtime.tv_sec = strtoll(fields[2], &fraction, 10);
+    entry->mtime.tv_nsec = *fraction == '.' ? strtol(fraction + 1, NULL, 10) : 0;
+
+    return true;
+}
+
+// NULL when `name' was installed without a manifest
+struct Manifest* manifestLoad(const char* name)
+{
+    char path[PATH_MAX], line[PATH_MAX + 128];
+    struct Manifest* manifest;
+    FILE* file;
+
+    getManifestPath(path, sizeof(path), name);
+    if (!(file = fopen(path, "r"))) return NULL;
+
+    if (!fgets(line, sizeof(line), file) || strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) || !(manifest = manifestNew()))
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), file)) parseEntry(line, manifest);
+
+    fclose(file);
+
+    qsort(manifest->entries, manifest->count, sizeof(struct ManifestEntry), compareEntries);
+
+    return manifest;
+}
+
+/*
+ * every worker takes the next file off a shared counter, the biggest ones
+ * go first so no thread is left hashing a large file at the end alone
+ */
+struct verifyJob {
+    struct Manifest* manifest;
+    size_t* order;
+    atomic_size_t next;
+    int dirfd;
+    bool deep;
+};
+
+static bool hashMapped(int fd, uint64_t size, char hex[SHA256_HEX_SIZE])
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    struct sha256 hash;
+
+    sha256Init(&hash);
+
+    if (size)
+    {
+        void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) return false;
+
+        madvise(data, size, MADV_SEQUENTIAL);
+        sha256Update(&hash, data, size);
+        munmap(data, size);
+    }
+
+    sha256Final(&hash, digest);
+    sha256Hex(digest, hex);
+
+    return true;
+}
+
+static enum ManifestState checkEntry(const struct verifyJob* job, const struct ManifestEntry* entry)
+{
+    char hex[SHA256_HEX_SIZE];
+    struct stat sb;
+
+    if (fstatat(job->dirfd, entry->path, &sb, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(sb.st_mode)) return MANIFEST_MISSING;
+    if ((uint64_t)sb.st_size != entry->size) return MANIFEST_CHANGED;
+
+    // a new mtime alone may be `wine dedupe' or a touch, the contents decide
+    if (!job->deep && sb.st_mtim.tv_sec == entry->mtime.tv_sec && sb.st_mtim.tv_nsec == entry->mtime.tv_nsec) return MANIFEST_OK;
+
+    int fd = openat(job->dirfd, entry->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return MANIFEST_MISSING;
+
+    bool hashed = hashMapped(fd, sb.st_size, hex);
+    close(fd);
+
+    return hashed && !strcmp(hex, entry->sha256) ? MANIFEST_OK : MANIFEST_CORRUPT;
+}
+
+static void* verifyWorker(void* data)
+{
+    struct verifyJob* job = data;
+    size_t i;
+
+    while ((i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed)) < job->manifest->count)
+    {
+        struct ManifestEntry* entry = &job->manifest->entries[job->order[i]];
+        entry->state = checkEntry(job, entry);
+    }
+
+    return NULL;
+}
+
+static int compareSize(const void* a, const void* b, void* data)
+{
+    const struct Manifest* manifest = data;
+    uint64_t first = manifest->entries[*(const size_t*)a].size;
+    uint64_t second = manifest->entries[*(const size_t*)b].size;
+
+    return (first < second) - (first > second);
+}
+
+/*
+ * sets the state of every entry, returns how many are damaged
+ * files are hashed on all cores, with `deep' all of them, otherwise
+ * only the ones whose mtime is not the one recorded
+ */
+size_t manifestCheck(struct Manifest* manifest, const char* datadir, bool deep)
+{
+    struct verifyJob job = { .manifest = manifest, .deep = deep };
+    pthread_t threads[VERIFY_MAX_THREADS];
+    size_t threadcount = 0, damaged = 0;
+
+    job.dirfd = open(datadir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    job.order = malloc((manifest->count + 1) * sizeof(size_t));
+    atomic_init(&job.next, 0);
+
+    if (job.dirfd < 0 || !job.order)
+    {
+        for (size_t i = 0; i < manifest->count; ++i) manifest->entries[i].state = MANIFEST_MISSING;
+        if (job.dirfd >= 0) close(job.dirfd);
+        free(job.order);
+        return manifest->count;
+    }
+
+    for (size_t i = 0; i < manifest->count; ++i) job.order[i] = i;
+
+    if (deep) qsort_r(job.order, manifest->count, sizeof(size_t), compareSize, manifest);
+
+    long wanted = getConfigNumber("POLECAT_VERIFY_THREADS", sysconf(_SC_NPROCESSORS_ONLN));
+    if (wanted > VERIFY_MAX_THREADS) wanted = VERIFY_MAX_THREADS;
+
+    for (long i = 0; i < wanted; ++i)
+    {
+        if (pthread_create(&threads[threadcount], NULL, verifyWorker, &job)) break;
+        ++threadcount;
+    }
+
+    if (!threadcount) verifyWorker(&job);
+    for (size_t i = 0; i < threadcount; ++i) pthread_join(threads[i], NULL);
+
+    for (size_t i = 0; i < manifest->count; ++i)
+    {
+        if (manifest->entries[i].state != MANIFEST_OK) damaged++;
+    }
+
+    close(job.dirfd);
+    free(job.order);
+
+    return damaged;
+}
@@ -0,0 +1,46 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sha256.h"
+
+enum ManifestState {
+    MANIFEST_OK,
+    MANIFEST_MISSING,
+    MANIFEST_CHANGED,                   // size differs
+    MANIFEST_CORRUPT,                   // contents differ
+};
+
+// a regular file of an installed runner, `path' as it was in the archive
+struct ManifestEntry {
+    char* path;
+    uint64_t size;
+    struct timespec mtime;
+    char sha256[SHA256_HEX_SIZE];
+    enum ManifestState state;           // after manifestCheck
+};
+
+struct Manifest {
+    struct ManifestEntry* entries;
+    size_t count;
+    size_t capacity;
+    pthread_mutex_t lock;
+};
+
+struct Manifest* manifestNew(void);
+void manifestFree(struct Manifest*);
+
+void manifestAdd(const char* path, const char sha256[SHA256_HEX_SIZE], uint64_t size, void* manifest);
+void manifestClear(void* manifest);
+struct ManifestEntry* manifestFind(struct Manifest*, const char* path);
+
+bool manifestSave(struct Manifest*, const char* datadir, const char* name);
+struct Manifest* manifestLoad(const char* name);
+size_t manifestCheck(struct Manifest*, const char* datadir, bool deep);
+
+#endif
@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "common.h"
+
+struct MemoryStruct* memoryNew(void)
+{
+    return calloc(1, sizeof(struct MemoryStruct));
+}
+
+void memoryFree(struct MemoryStruct* mem)
+{
+    if (mem)
+    {
+        struct MemoryChunk* chunk = mem->head;
+
+        while (chunk)
+        {
+            struct MemoryChunk* next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+
+        free(mem);
+    }
+}
+
+/*
+ * makes sure the next `size' bytes fit into the tail chunk,
+ * a known Content-Length therefore ends up in a single chunk
+ */
+bool memoryReserve(struct MemoryStruct* mem, size_t size)
+{
+    struct MemoryChunk* tail = mem->tail;
+
+    if (tail && tail->capacity - tail->size >= size) return true;
+
+    size_t capacity = size > MEMORY_CHUNK_SIZE ? size : MEMORY_CHUNK_SIZE;
+    struct MemoryChunk* chunk = malloc(sizeof(struct MemoryChunk) + capacity);
+
+    if (!chunk) return false;
+
+    chunk->next = NULL;
+    chunk->size = 0;
+    chunk->capacity = capacity;
+
+    if (tail) tail->next = chunk;
+    else mem->head = chunk;
+    mem->tail = chunk;
+
+    return true;
+}
+
+size_t memoryAppend(struct MemoryStruct* mem, const void* data, size_t size)
+{
+    const uint8_t* source = data;
+    size_t written = 0;
+
+    while (written < size)
+    {
+        struct MemoryChunk* tail = mem->tail;
+
+        if (!tail || tail->size == tail->capacity)
+        {
+            if (!memoryReserve(mem, 1)) break;
+            tail = mem->tail;
+        }
+
+        size_t amount = tail->capacity - tail->size;
+        if (amount > size - written) amount = size - written;
+
+        memcpy(tail->data + tail->size, source + written, amount);
+        tail->size += amount;
+        written += amount;
+    }
+
+    mem->size += written;
+
+    return written;
+}
@@ -0,0 +1,18 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MEMORY_CHUNK_SIZE (256 * 1024)
+
+struct MemoryStruct;
+
+struct MemoryStruct* memoryNew(void);
+void memoryFree(struct MemoryStruct*);
+
+bool memoryReserve(struct MemoryStruct*, size_t);
+size_t memoryAppend(struct MemoryStruct*, const void*, size_t);
+
+#endif
@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <linux/limits.h>
+
+#include "metrics.h"
+#include "common.h"
+#include "config.h"
+
+/*
+ * counters are bumped with relaxed atomics wherever the work happens and
+ * appended to <cache dir>/metrics when polecat exits, one line per counter
+ * that moved and per event
+ *   <unix time> <name> <label or -> <value>
+ * a single write with O_APPEND keeps lines of parallel runs apart,
+ * `polecat stats' adds everything up
+ */
+
+#define EVENT_SLOTS 64
+#define LABEL_SIZE 128
+
+struct metricInfo {
+    const char* key;                    // name in the metrics file
+    const char* prometheus;
+    const char* help;
+    double scale;                       // to the unit of the prometheus name
+};
+
+const static struct metricInfo counterInfo[METRIC_MAX] = {
+    [METRIC_REQUESTS]       = { "requests",         "polecat_requests_total",             "HTTP transfers made.", 1 },
+    [METRIC_DOWNLOADED]     = { "downloaded",       "polecat_downloaded_bytes_total",     "Bytes received from servers.", 1 },
+    [METRIC_CACHE_HITS]     = { "cache_hits",       "polecat_cache_hits_total",           "Catalogs, installers and archives served from the cache.", 1 },
+    [METRIC_CACHE_MISSES]   = { "cache_misses",     "polecat_cache_misses_total",         "Cache lookups that needed a download.", 1 },
+    [METRIC_CACHED]         = { "cached",           "polecat_cache_served_bytes_total",   "Bytes served from the cache instead of the network.", 1 },
+    [METRIC_EXTRACTED]      = { "extracted",        "polecat_extracted_bytes_total",      "Bytes of extracted files.", 1 },
+    [METRIC_EXTRACTED_FILES]= { "extracted_files",  "polecat_extracted_files_total",      "Archive entries extracted.", 1 },
+    [METRIC_EXTRACT_TIME]   = { "extract_us",       "polecat_extract_seconds_total",      "Time spent extracting archives.", 1e-6 },
+};
+
+const static struct {
+    struct metricInfo info;
+    const char* label;                  // prometheus label name
+    const char* title;                  // of the list in `polecat stats'
+    bool summary;                       // _sum and _count instead of a counter
+} eventInfo[EVENT_MAX] = {
+    [EVENT_INSTALL] = { { "install_us", "polecat_install_duration_seconds", "Time to download and extract a runner.", 1e-6 }, "runner", "installs", true },
+    [EVENT_LAUNCH]  = { { "launch",     "polecat_launches_total",           "Wine launches.", 1 },                            "version", "launches", false },
+};
+
+struct eventSlot {
+    atomic_bool ready;
+    enum MetricEvent event;
+    char label[LABEL_SIZE];
+    uint64_t value;
+};
+
+static _Atomic uint64_t counters[METRIC_MAX];
+static struct eventSlot events[EVENT_SLOTS];
+static atomic_size_t eventCount;
+static bool enabled;
+
+void metricsAdd(enum Metric metric, uint64_t value)
+{
+    atomic_fetch_add_explicit(&counters[metric], value, memory_order_relaxed);
+}
+
+// events past EVENT_SLOTS in one run are dropped
+void metricsEvent(enum MetricEvent event, const char* label, uint64_t value)
+{
+    size_t index = atomic_fetch_add_explicit(&eventCount, 1, memory_order_relaxed);
+    if (index >= EVENT_SLOTS) return;
+
+    struct eventSlot* slot = &events[index];
+
+    slot->event = event;
+    slot->value = value;
+    snprintf(slot->label, sizeof(slot->label), "%s", label && *label ? label : "-");
+
+    // the file is split on whitespace
+    for (char* c = slot->label; *c; ++c)
+    {
+        if (*c == ' ' || *c == '\t' || *c == '\n') *c = '_';
+    }
+
+    atomic_store_explicit(&slot->ready, true, memory_order_release);
+}
+
+// microseconds on the monotonic clock, for durations
+uint64_t metricsClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void getMetricsPath(char* buffer, size_t size)
+{
+    char cachedir[PATH_MAX];
+
+    getCacheDir(cachedir, sizeof(cachedir));
+    makePath(cachedir);
+    snprintf(buffer, size, "%s/metrics", cachedir);
+}
+
+// appends what was counted since the last flush, call it before exec
+bool metricsFlush(void)
+{
+    char buffer[EVENT_SLOTS * (LABEL_SIZE + 64) + METRIC_MAX * 64], path[PATH_MAX + 8];
+    long long now = time(NULL);
+    size_t used = 0;
+
+    if (!enabled) return true;
+
+    for (size_t i = 0; i < METRIC_MAX; ++i)
+    {
+        uint64_t value = atomic_exchange_explicit(&counters[i], 0, memory_order_relaxed);
+
+        if (value) used += snprintf(buffer + used, sizeof(buffer) - used, "%lld %s - %" PRIu64 "\n", now, counterInfo[i].key, value);
+    }
+
+    size_t count = atomic_exchange_explicit(&eventCount, 0, memory_order_acquire);
+
+    for (size_t i = 0; i < count && i < EVENT_SLOTS; ++i)
+    {
+        struct eventSlot* slot = &events[i];
+
+        if (!atomic_exchange_explicit(&slot->ready, false, memory_order_acquire)) continue;
+
+        used += snprintf(buffer + used, sizeof(buffer) - used, "%lld %s %s %" PRIu64 "\n", now,
+                         eventInfo[slot->event].info.key, slot->label, slot->value);
+    }
+
+    if (!used) return true;
+
+    getMetricsPath(path, sizeof(path));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    bool success = write(fd, buffer, used) == (ssize_t)used;
+
+    return !close(fd) && success;
+}
+
+static void flushAtExit(void)
+{
+    metricsFlush();
+}
+
+// counts of this run end up in the metrics file, unless POLECAT_METRICS is 0
+bool metricsOpen(void)
+{
+    if (enabled || !getConfigNumber("POLECAT_METRICS", 1)) return false;
+
+    enabled = true;
+
+    return !atexit(flushAtExit);
+}
+
+struct aggregate {
+    char name[32];
+    char label[LABEL_SIZE];
+    uint64_t count;
+    uint64_t sum;
+};
+
+struct aggregates {
+    struct aggregate* items;
+    size_t count;
+    size_t capacity;
+    long long since;
+};
+
+static struct aggregate* findAggregate(struct aggregates* all, const char* name, const char* label)
+{
+    for (size_t i = 0; i < all->count; ++i)
+    {
+        if (!strcmp(all->items[i].name, name) && !strcmp(all->items[i].label, label)) return &all->items[i];
+    }
+
+    if (all->count == all->capacity)
+    {
+        size_t capacity = all->capacity ? all->capacity * 2 : 32;
+        struct aggregate* grown = realloc(all->items, capacity * sizeof(struct aggregate));
+
+        if (!grown) return NULL;
+
+        all->items = grown;
+        all->capacity = capacity;
+    }
+
+    struct aggregate* item = &all->items[all->count++];
+
+    memset(item, 0, sizeof(struct aggregate));
+    snprintf(item->name, sizeof(item->name), "%s", name);
+    snprintf(item->label, sizeof(item->label), "%s", label);
+
+    return item;
+}
+
+static bool loadAggregates(struct aggregates* all)
+{
+    char path[PATH_MAX + 8], line[LABEL_SIZE + 128], name[32], label[LABEL_SIZE];
+    long long when;
+    uint64_t value;
+
+    memset(all, 0, sizeof(struct aggregates));
+    getMetricsPath(path, sizeof(path));
+
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        if (sscanf(line, "%lld %31s %127s %" SCNu64, &when, name, label, &value) != 4) continue;
+
+        struct aggregate* item = findAggregate(all, name, label);
+        if (!item) break;
+
+        item->count++;
+        item->sum += value;
+
+        if (!all->since || when < all->since) all->since = when;
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+static uint64_t counterSum(const struct aggregates* all, enum Metric metric)
+{
+    for (size_t i = 0; i < all->count; ++i)
+    {
+        if (!strcmp(all->items[i].name, counterInfo[metric].key)) return all->items[i].sum;
+    }
+
+    return 0;
+}
+
+static void printSummary(const struct aggregates* all)
+{
+    char since[64];
+    time_t when = all->since;
+    uint64_t hits = counterSum(all, METRIC_CACHE_HITS), misses = counterSum(all, METRIC_CACHE_MISSES);
+    double extractSeconds = counterSum(all, METRIC_EXTRACT_TIME) / 1e6;
+
+    strftime(since, sizeof(since), "%Y-%m-%d %H:%M", localtime(&when));
+
+    printf("since:\t\t\t%s\n"
+           "downloaded:\t\t%.1f MiB in %" PRIu64 " requests\n"
+           "from cache:\t\t%.1f MiB, %" PRIu64 " of %" PRIu64 " lookups (%.0f%%)\n"
+           "extracted:\t\t%.1f MiB, %" PRIu64 " files, %.1f MiB/s\n",
+           since,
+           counterSum(all, METRIC_DOWNLOADED) / 1048576.0, counterSum(all, METRIC_REQUESTS),
+           counterSum(all, METRIC_CACHED) / 1048576.0, hits, hits + misses, hits + misses ? 100.0 * hits / (hits + misses) : 0,
+           counterSum(all, METRIC_EXTRACTED) / 1048576.0, counterSum(all, METRIC_EXTRACTED_FILES),
+           extractSeconds > 0 ? counterSum(all, METRIC_EXTRACTED) / 1048576.0 / extractSeconds : 0);
+
+    for (size_t e = 0; e < EVENT_MAX; ++e)
+    {
+        bool first = true;
+
+        for (size_t i = 0; i < all->count; ++i)
+        {
+            const struct aggregate* item = &all->items[i];
+
+            if (strcmp(item->name, eventInfo[e].info.key)) continue;
+
+            if (first) printf("\n%s:\n", eventInfo[e].title);
+            first = false;
+
+            if (eventInfo[e].summary)
+                printf(" %-40s %4" PRIu64 "x, %.1fs on average\n", item->label, item->count, item->sum * eventInfo[e].info.scale / item->count);
+            else
+                printf(" %-40s %4" PRIu64 "\n", item->label, item->sum);
+        }
+    }
+}
+
+static void writeLabel(FILE* file, const char* str)
+{
+    for (; *str; ++str)
+    {
+        if (*str == '"' || *str == '\\') fprintf(file, "\\%c", *str);
+        else fputc(*str, file);
+    }
+}
+
+// the text exposition format, for node-exporter's textfile collector
+static void writePrometheus(FILE* file, const struct aggregates* all)
+{
+    for (size_t m = 0; m < METRIC_MAX; ++m)
+    {
+        const struct metricInfo* info = &counterInfo[m];
+
+        fprintf(file, "# HELP %s %s\n# TYPE %s counter\n%s %.15g\n", info->prometheus, info->help, info->prometheus,
+                info->prometheus, counterSum(all, m) * info->scale);
+    }
+
+    for (size_t e = 0; e < EVENT_MAX; ++e)
+    {
+        const struct metricInfo* info = &eventInfo[e].info;
+
+        fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", info->prometheus, info->help, info->prometheus,
+                eventInfo[e].summary ? "summary" : "counter");
+
+        for (size_t i = 0; i < all->count; ++i)
+        {
+            const struct aggregate* item = &all->items[i];
+
+            if (strcmp(item->name, info->key)) continue;
+
+            for (int part = 0; part < (eventInfo[e].summary ? 2 : 1); ++part)
+            {
+                fprintf(file, "%s%s{%s=\"", info->prometheus, eventInfo[e].summary ? (part ? "_count" : "_sum") : "", eventInfo[e].label);
+                writeLabel(file, item->label);
+                fprintf(file, "\"} %.15g\n", part ? (double)item->count : item->sum * info->scale);
+            }
+        }
+    }
+}
+
+// the file is replaced in one rename, the collector never sees half of it
+static bool exportPrometheus(const char* path, const struct aggregates* all)
+{
+    char temp[PATH_MAX + 8];
+    FILE* file;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    if (!(file = fopen(temp, "w"))) return false;
+
+    writePrometheus(file, all);
+
+    if (fclose(file) || rename(temp, path))
+    {
+        unlink(temp);
+        return false;
+    }
+
+    return true;
+}
+
+int stats(int argc, char** argv)
+{
+    struct aggregates all;
+    int status = 0;
+
+    if (argc > 3 || (argc > 1 && strcmp(argv[1], "--prometheus"))) return stats_help(argc, argv);
+
+    if (!loadAggregates(&all) && argc == 1)
+    {
+        puts("Nothing recorded yet");
+        return 0;
+    }
+
+    if (argc == 1)
+    {
+        printSummary(&all);
+    }
+    else if (argc == 2)
+    {
+        writePrometheus(stdout, &all);
+    }
+    else if (!exportPrometheus(argv[2], &all))
+    {
+        printf("Cannot write %s\n", argv[2]);
+        status = 1;
+    }
+
+    free(all.items);
+
+    return status;
+}
+
+int stats_help(int argc, char** argv)
+{
+    puts(USAGE_STR " stats [--prometheus [file]]\n\n"
+         "Adds up downloads, cache use, extraction, installs and launches of all runs.\n"
+         "--prometheus prints them in the Prometheus text format, or writes them to `file'\n"
+         "for node-exporter's textfile collector.");
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum Metric {
+    METRIC_REQUESTS,
+    METRIC_DOWNLOADED,          // bytes received from servers
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_CACHED,              // bytes served from the cache instead
+    METRIC_EXTRACTED,           // bytes of extracted files
+    METRIC_EXTRACTED_FILES,
+    METRIC_EXTRACT_TIME,        // microseconds
+    METRIC_MAX
+};
+
+enum MetricEvent {
+    EVENT_INSTALL,              // microseconds per runner
+    EVENT_LAUNCH,               // per wine version
+    EVENT_MAX
+};
+
+void metricsAdd(enum Metric, uint64_t value);
+void metricsEvent(enum MetricEvent, const char* label, uint64_t value);
+uint64_t metricsClock(void);
+
+bool metricsOpen(void);
+bool metricsFlush(void);
+
+int stats(int, char**);
+int stats_help(int, char**);
+
+#endif
@@ -2,110 +2,1061 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <inttypes.h>
+#include <linux/limits.h>
 #include <curl/curl.h>
 #include <json.h>
 
 #include "net.h"
+#include "jsonstream.h"
+#include "stream.h"
+#include "memory.h"
+#include "cache.h"
+#include "store.h"
+#include "sha256.h"
 #include "common.h"
- 
-size_t memoryCallback(void* contents, size_t size, size_t nmemb, void* userp)
-{
-  size_t realsize = size * nmemb;
-  struct MemoryStruct* mem = (struct MemoryStruct*)userp;
- 
-  uint8_t* ptr = realloc(mem->memory, mem->size + realsize + 1);
-  if(ptr == NULL) {
-    /* out of memory! */ 
-    puts("out of memory");
-    return 0;
-  }
- 
-  mem->memory = ptr;
-  memcpy(&(mem->memory[mem->size]), contents, realsize);
-  mem->size += realsize;
-  mem->memory[mem->size] = 0;
- 
-  return realsize;
+#include "config.h"
+#include "trace.h"
+#include "metrics.h"
+#include "checksum.h"
+
+#define HANDLE_POOL_SIZE 4
+
+static pthread_once_t netOnce = PTHREAD_ONCE_INIT;
+static CURLSH* share;
+static pthread_mutex_t shareLocks[CURL_LOCK_DATA_LAST];
+
+static bool offline;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static CURL* pool[HANDLE_POOL_SIZE];
+static size_t poolCount;
+
+static void shareLock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr)
+{
+    pthread_mutex_lock(&shareLocks[data]);
 }
 
-struct MemoryStruct* downloadToRam(const char* URL)
+static void shareUnlock(CURL* handle, curl_lock_data data, void* userptr)
+{
+    pthread_mutex_unlock(&shareLocks[data]);
+}
+
+static void netCleanup(void)
+{
+    // easy handles have to go before the share they are attached to
+    for (size_t i = 0; i < poolCount; ++i) curl_easy_cleanup(pool[i]);
+    poolCount = 0;
+
+    curl_share_cleanup(share);
+    curl_global_cleanup();
+}
+
+static void netInit(void)
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    for (size_t i = 0; i < CURL_LOCK_DATA_LAST; ++i) pthread_mutex_init(&shareLocks[i], NULL);
+
+    share = curl_share_init();
+    if (share)
+    {
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, shareLock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, shareUnlock);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
+
+    atexit(netCleanup);
+}
+
+/*
+ * hands out an easy handle with our defaults applied
+ * pooled handles keep their connections alive and all of them
+ * share DNS, TLS sessions and connections through `share'
+ */
+static CURL* acquireHandle(void)
+{
+    CURL* handle = NULL;
+
+    if (offline)
+    {
+        puts("network access is disabled (--offline)");
+        return NULL;
+    }
+
+    pthread_once(&netOnce, netInit);
+
+    pthread_mutex_lock(&poolLock);
+    if (poolCount) handle = pool[--poolCount];
+    pthread_mutex_unlock(&poolLock);
+
+    if (handle) curl_easy_reset(handle);
+    else handle = curl_easy_init();
+
+    if (handle)
+    {
+        curl_easy_setopt(handle, CURLOPT_USERAGENT, USER_AGENT);
+        curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+        if (share) curl_easy_setopt(handle, CURLOPT_SHARE, share);
+    }
+
+    return handle;
+}
+
+/*
+ * counts the last transfer of the handle, curl keeps its phase times on the
+ * handle, each one counted from the start of it, they are turned into spans
+ * before the handle is reused
+ */
+static void finishTransfer(CURL* handle)
+{
+    curl_off_t received = 0;
+
+    curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &received);
+    metricsAdd(METRIC_REQUESTS, 1);
+    metricsAdd(METRIC_DOWNLOADED, received);
+
+    if (!traceEnabled) return;
+
+    const static struct {
+        const char* name;
+        CURLINFO info;
+    } phases[] = {
+        { "dns",        CURLINFO_NAMELOOKUP_TIME_T },
+        { "connect",    CURLINFO_CONNECT_TIME_T },
+        { "tls",        CURLINFO_APPCONNECT_TIME_T },
+        { "wait",       CURLINFO_STARTTRANSFER_TIME_T },
+        { "transfer",   CURLINFO_TOTAL_TIME_T }
+    };
+
+    curl_off_t total = 0, previous = 0;
+    char* URL = NULL;
+
+    curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &URL);
+    if (total <= 0) return;
+
+    uint64_t start = traceNow() - total;
+    traceSpan("net", "request", start, start + total, URL);
+
+    for (size_t i = 0; i < ARRAY_LEN(phases); ++i)
+    {
+        curl_off_t time = 0;
+        curl_easy_getinfo(handle, phases[i].info, &time);
+
+        // 0 for phases that did not happen, a reused connection or plain http
+        if (time <= previous) continue;
+
+        traceSpan("net", phases[i].name, start + previous, start + time, URL);
+        previous = time;
+    }
+}
+
+static void releaseHandle(CURL* handle)
+{
+    pthread_mutex_lock(&poolLock);
+    if (poolCount < HANDLE_POOL_SIZE)
+    {
+        pool[poolCount++] = handle;
+        handle = NULL;
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    if (handle) curl_easy_cleanup(handle);
+}
+
+struct memoryDownload {
+    CURL* handle;
+    struct MemoryStruct* memory;
+    struct JsonStream* json;
+};
+
+static size_t memoryCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    size_t realsize = size * nmemb;
+    struct memoryDownload* download = (struct memoryDownload*)userp;
+    struct MemoryStruct* mem = download->memory;
+
+    if (!mem->head)
+    {
+        curl_off_t length = -1;
+        curl_easy_getinfo(download->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+
+        // a single allocation for the whole body when the server tells us its size
+        if (length > 0 && !memoryReserve(mem, (size_t)length))
+        {
+            puts("out of memory");
+            return 0;
+        }
+    }
+
+    if (memoryAppend(mem, contents, realsize) != realsize)
+    {
+        puts("out of memory");
+        return 0;
+    }
+
+    // parse while the rest is still on the wire, errors show up when it is finished
+    if (download->json) jsonStreamFeed(download->json, contents, realsize);
+
+    return realsize;
+}
+
+static void copyHeader(const char* line, size_t length, const char* name, char* value, size_t size)
+{
+    size_t namelen = strlen(name);
+
+    if (length > namelen && !strncasecmp(line, name, namelen))
+    {
+        line += namelen;
+        length -= namelen;
+
+        while (length && (*line == ' ' || *line == '\t'))
+        {
+            ++line;
+            --length;
+        }
+        while (length && (line[length-1] == '\r' || line[length-1] == '\n' || line[length-1] == ' ')) --length;
+
+        if (length >= size) length = size - 1;
+        memcpy(value, line, length);
+        value[length] = '\0';
+    }
+}
+
+static size_t validatorCallback(char* buffer, size_t size, size_t nitems, void* userp)
+{
+    struct CacheEntry* entry = userp;
+    size_t length = size * nitems;
+
+    // a new response (redirect or 1xx) starts with a status line
+    if (length > 5 && !strncmp(buffer, "HTTP/", 5))
+    {
+        entry->etag[0] = '\0';
+        entry->modified[0] = '\0';
+    }
+
+    copyHeader(buffer, length, "ETag:", entry->etag, sizeof(entry->etag));
+    copyHeader(buffer, length, "Last-Modified:", entry->modified, sizeof(entry->modified));
+
+    return length;
+}
+
+/*
+ * performs a GET into memory, when `validators' is given the request
+ * is conditional and a 304 returns an empty body with `http_code' set,
+ * `response' receives the validators of the new response,
+ * `json' is fed the body as it arrives
+ */
+static struct MemoryStruct* requestToRam(const char* URL, const struct CacheEntry* validators, struct CacheEntry* response, long* http_code, bool detached, struct JsonStream* json)
 {
     CURL* curl_handle;
     CURLcode res;
+    struct curl_slist* headers = NULL;
 
-    struct MemoryStruct* chunk = malloc(sizeof(struct MemoryStruct));
+    struct MemoryStruct* chunk = memoryNew();
 
     if (chunk)
     {
-        chunk->memory = malloc(1);
-        chunk->size = 0;
+        struct memoryDownload download;
 
-        curl_global_init(CURL_GLOBAL_ALL);
+        // a forked child must not touch connections its parent still owns
+        curl_handle = detached ? curl_easy_init() : acquireHandle();
+        if (!curl_handle)
+        {
+            memoryFree(chunk);
+            return NULL;
+        }
 
-        curl_handle = curl_easy_init();
+        download.handle = curl_handle;
+        download.memory = chunk;
+        download.json = json;
 
         curl_easy_setopt(curl_handle, CURLOPT_URL, URL);
         curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, memoryCallback);
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void*)chunk);
-        curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, USER_AGENT);
-        curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void*)&download);
+
+        if (detached)
+        {
+            curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, USER_AGENT);
+            curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+        }
+
+        if (validators)
+        {
+            char header[sizeof(validators->etag) + 32];
+
+            if (validators->etag[0])
+            {
+                snprintf(header, sizeof(header), "If-None-Match: %s", validators->etag);
+                headers = curl_slist_append(headers, header);
+            }
+            if (validators->modified[0])
+            {
+                snprintf(header, sizeof(header), "If-Modified-Since: %s", validators->modified);
+                headers = curl_slist_append(headers, header);
+            }
+            curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+        }
+
+        if (response)
+        {
+            memset(response, 0, sizeof(struct CacheEntry));
+            curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, validatorCallback);
+            curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void*)response);
+        }
 
         res = curl_easy_perform(curl_handle);
+        finishTransfer(curl_handle);
 
-        long http_code = 0;
-        curl_easy_getinfo (curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
+        *http_code = 0;
+        curl_easy_getinfo (curl_handle, CURLINFO_RESPONSE_CODE, http_code);
+
+        if (detached) curl_easy_cleanup(curl_handle);
+        else releaseHandle(curl_handle);
+        curl_slist_free_all(headers);
 
         if(res != CURLE_OK) {
             puts(curl_easy_strerror(res));
+            memoryFree(chunk);
             return NULL;
         }
-        else if (http_code != 200)
+        else if (*http_code != 200 && !(validators && *http_code == 304))
         {
 #ifdef DEBUG
-            printf("HTTP Error %li\n", http_code);
+            printf("HTTP Error %li\n", *http_code);
 #endif
+            memoryFree(chunk);
             return NULL;
         }
-
-        curl_easy_cleanup(curl_handle);
-        curl_global_cleanup();
     }
 
     return chunk;
 }
 
+struct MemoryStruct* downloadToRam(const char* URL)
+{
+    long http_code;
+
+    return requestToRam(URL, NULL, NULL, &http_code, false, NULL);
+}
+
+static void countCacheHit(const struct MemoryStruct* cached)
+{
+    metricsAdd(METRIC_CACHE_HITS, 1);
+    metricsAdd(METRIC_CACHED, cached->size);
+}
+
+/*
+ * conditional revalidation of a cached response
+ * returns the body that is current now and updates the cache
+ */
+static struct MemoryStruct* revalidate(const char* URL, struct CacheEntry* entry, struct MemoryStruct* cached, bool detached, struct JsonStream* json)
+{
+    struct CacheEntry response;
+    long http_code;
+    struct MemoryStruct* mem = requestToRam(URL, cached ? entry : NULL, &response, &http_code, detached, json);
+
+    // whatever the parser saw is not the body that is returned
+    if (json && (!mem || http_code == 304)) jsonStreamReset(json);
+
+    if (!mem)
+    {
+        // better stale than nothing
+        if (cached) puts("Could not revalidate, using cached response");
+        return cached;
+    }
+
+    response.fetched = time(NULL);
+
+    if (http_code == 304)
+    {
+        countCacheHit(cached);
+        memoryFree(mem);
+
+        // a 304 may omit validators that did not change
+        if (!response.etag[0]) strcpy(response.etag, entry->etag);
+        if (!response.modified[0]) strcpy(response.modified, entry->modified);
+        cacheTouch(URL, &response);
+
+        return cached;
+    }
+
+    metricsAdd(METRIC_CACHE_MISSES, 1);
+    cacheStore(URL, &response, mem);
+    memoryFree(cached);
+
+    return mem;
+}
+
+/*
+ * GET through the response cache in the cache dir
+ * fresh entries (POLECAT_CACHE_TTL seconds) are served without a request,
+ * stale ones for another POLECAT_CACHE_STALE seconds are served as well
+ * while a detached child revalidates them for the next invocation,
+ * the child only has the forking thread, so this must only be reached
+ * before worker threads exist, catalogs, installers and checksums are
+ * all fetched on the main thread before anything is installed
+ * `json', if given, has parsed the body when it came from the network
+ */
+static struct MemoryStruct* fetchCachedStream(const char* URL, struct JsonStream* json)
+{
+    struct CacheEntry entry;
+    struct MemoryStruct* cached;
+
+    if (cacheLoad(URL, &entry, &cached))
+    {
+        long ttl = getConfigNumber("POLECAT_CACHE_TTL", 300);
+        long stale = getConfigNumber("POLECAT_CACHE_STALE", 86400);
+        time_t age = time(NULL) - entry.fetched;
+
+        if (offline || cacheIsFresh(&entry))
+        {
+            countCacheHit(cached);
+            return cached;
+        }
+
+        if (age < ttl + stale)
+        {
+            countCacheHit(cached);
+            fflush(stdout);
+
+            // forked twice so init reaps the one that revalidates, not us
+            pid_t child = fork();
+            if (child == 0)
+            {
+                if (fork() == 0)
+                {
+                    int null = open("/dev/null", O_WRONLY);
+                    dup2(null, STDOUT_FILENO);
+                    dup2(null, STDERR_FILENO);
+
+                    memoryFree(revalidate(URL, &entry, cached, true, NULL));
+                }
+                _exit(0);
+            }
+            if (child > 0) waitpid(child, NULL, 0);
+
+            return cached;
+        }
+    }
+    else if (offline)
+    {
+        printf("%s is not cached and " NAME " is offline\n", URL);
+        return NULL;
+    }
+
+    return revalidate(URL, &entry, cached, false, json);
+}
+
+struct MemoryStruct* fetchCached(const char* URL)
+{
+    return fetchCachedStream(URL, NULL);
+}
+
+void netSetOffline(bool value)
+{
+    offline = value;
+}
+
+bool netIsOffline(void)
+{
+    return offline;
+}
+
+struct multiTransfer {
+    CURL* handle;
+    size_t index;
+    transferWrite write;
+    void* data;
+};
+
+static size_t multiCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    size_t realsize = size * nmemb;
+    struct multiTransfer* transfer = userp;
+    curl_off_t length = -1;
+
+    curl_easy_getinfo(transfer->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+
+    return transfer->write(transfer->index, contents, realsize, length, transfer->data) ? realsize : 0;
+}
+
+/*
+ * downloads all `urls' with at most POLECAT_PARALLEL_DOWNLOADS
+ * transfers in flight, bodies are handed to `write' as they arrive
+ * and `done' is called as each one finishes, the first failure
+ * aborts everything else
+ */
+bool downloadMany(char** urls, size_t count, transferWrite write, transferCallback done, void* data)
+{
+    CURLM* multi;
+    struct multiTransfer* transfers;
+    size_t next = 0, finished = 0, running = 0;
+    bool success = true;
+
+    long parallel = getConfigNumber("POLECAT_PARALLEL_DOWNLOADS", 4);
+    if (parallel < 1) parallel = 1;
+
+    if (!count) return true;
+
+    pthread_once(&netOnce, netInit);
+
+    transfers = calloc(count, sizeof(struct multiTransfer));
+    multi = curl_multi_init();
+    if (!transfers || !multi)
+    {
+        free(transfers);
+        if (multi) curl_multi_cleanup(multi);
+        return false;
+    }
+
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, parallel);
+
+    while (success && finished < count)
+    {
+        while (success && next < count && running < (size_t)parallel)
+        {
+            struct multiTransfer* transfer = &transfers[next];
+
+            transfer->handle = acquireHandle();
+            if (!transfer->handle)
+            {
+                success = false;
+                break;
+            }
+
+            transfer->index = next;
+            transfer->write = write;
+            transfer->data = data;
+
+            curl_easy_setopt(transfer->handle, CURLOPT_URL, urls[next]);
+            curl_easy_setopt(transfer->handle, CURLOPT_WRITEFUNCTION, multiCallback);
+            curl_easy_setopt(transfer->handle, CURLOPT_WRITEDATA, (void*)transfer);
+            curl_easy_setopt(transfer->handle, CURLOPT_PRIVATE, (void*)transfer);
+            curl_easy_setopt(transfer->handle, CURLOPT_FAILONERROR, 1L);
+
+            curl_multi_add_handle(multi, transfer->handle);
+            ++next;
+            ++running;
+        }
+
+        int still_running, queued;
+        CURLMsg* msg;
+
+        if (curl_multi_perform(multi, &still_running) != CURLM_OK) success = false;
+
+        while (success && (msg = curl_multi_info_read(multi, &queued)))
+        {
+            if (msg->msg != CURLMSG_DONE) continue;
+
+            struct multiTransfer* transfer;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&transfer);
+            size_t index = transfer - transfers;
+            bool ok = msg->data.result == CURLE_OK;
+
+            if (!ok) printf("%s: %s\n", urls[index], curl_easy_strerror(msg->data.result));
+
+            finishTransfer(transfer->handle);
+            curl_multi_remove_handle(multi, transfer->handle);
+            releaseHandle(transfer->handle);
+            transfer->handle = NULL;
+            --running;
+            ++finished;
+
+            if (done) done(index, ok, data);
+            if (!ok) success = false;
+        }
+
+        if (success && running) curl_multi_poll(multi, NULL, 0, 1000, NULL);
+    }
+
+    // fail fast, drop whatever is still in flight
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (transfers[i].handle)
+        {
+            curl_multi_remove_handle(multi, transfers[i].handle);
+            releaseHandle(transfers[i].handle);
+        }
+    }
+
+    curl_multi_cleanup(multi);
+    free(transfers);
+
+    return success;
+}
+
+struct resumeDownload {
+    CURL* handle;
+    FILE* file;
+    curl_off_t offset;
+    curl_off_t start;
+    struct CacheEntry validators;
+    const char* etagpath;
+    curl_off_t total;                   // from Content-Range, -1 if not given
+    bool started;
+
+    struct sha256 hash;
+
+    struct Stream* stream;
+    bool restarted;
+};
+
+static void feedStream(struct resumeDownload* download, const void* data, size_t size)
+{
+    if (download->stream && streamWrite(download->stream, data, size) != size)
+    {
+        // the consumer is done, keep downloading for the cache only
+        download->stream = NULL;
+    }
+}
+
+static void restartPart(struct resumeDownload* download)
+{
+    // data the consumer already has is thrown away, it has to give up on the stream
+    if (download->stream && download->offset)
+    {
+        streamClose(download->stream, true);
+        download->stream = NULL;
+        download->restarted = true;
+    }
+
+    fflush(download->file);
+    ftruncate(fileno(download->file), 0);
+    fseeko(download->file, 0, SEEK_SET);
+    download->offset = 0;
+    sha256Init(&download->hash);
+}
+
+static void beginResponse(struct resumeDownload* download)
+{
+    long http_code = 0;
+    curl_easy_getinfo(download->handle, CURLINFO_RESPONSE_CODE, &http_code);
+
+    download->started = true;
+
+    // the file changed since the part was written
+    if (download->offset && http_code != 206) restartPart(download);
+    download->start = download->offset;
+
+    if (download->validators.etag[0])
+    {
+        FILE* file = fopen(download->etagpath, "w");
+        if (file)
+        {
+            fputs(download->validators.etag, file);
+            fclose(file);
+        }
+    }
+}
+
+static size_t resumeCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    size_t realsize = size * nmemb;
+    struct resumeDownload* download = userp;
+
+    if (!download->started) beginResponse(download);
+
+    if (fwrite(contents, 1, realsize, download->file) != realsize) return 0;
+    download->offset += realsize;
+    sha256Update(&download->hash, contents, realsize);
+
+    feedStream(download, contents, realsize);
+
+    return realsize;
+}
+
+static size_t resumeHeaderCallback(char* buffer, size_t size, size_t nitems, void* userp)
+{
+    struct resumeDownload* download = userp;
+    size_t length = size * nitems;
+    char range[128] = {0};
+
+    if (length > 5 && !strncmp(buffer, "HTTP/", 5)) download->total = -1;
+
+    // "bytes 0-99/100", a 416 sends "bytes */100"
+    copyHeader(buffer, length, "Content-Range:", range, sizeof(range));
+    if (strchr(range, '/') && strchr(range, '/')[1] != '*') download->total = strtoll(strchr(range, '/') + 1, NULL, 10);
+
+    return validatorCallback(buffer, size, nitems, &download->validators);
+}
+
+static bool requestHead(const char* URL, struct CacheEntry* response, curl_off_t* length)
+{
+    CURLcode res = CURLE_FAILED_INIT;
+    long http_code = 0;
+    CURL* handle = acquireHandle();
+
+    memset(response, 0, sizeof(struct CacheEntry));
+    *length = -1;
+
+    if (handle)
+    {
+        curl_easy_setopt(handle, CURLOPT_URL, URL);
+        curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, validatorCallback);
+        curl_easy_setopt(handle, CURLOPT_HEADERDATA, (void*)response);
+
+        res = curl_easy_perform(handle);
+        finishTransfer(handle);
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_code);
+        curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, length);
+
+        releaseHandle(handle);
+    }
+
+    return res == CURLE_OK && http_code == 200;
+}
+
+// a 416 for a part that already has every byte of the file `etag' names
+static bool partComplete(const char* URL, const struct resumeDownload* download, const char* etag)
+{
+    struct CacheEntry response;
+    curl_off_t length = download->total;
+
+    // servers may leave the total out, the Content-Length of a HEAD has it
+    if (length < 0 && (!requestHead(URL, &response, &length) || (etag[0] && strcmp(response.etag, etag)))) return false;
+
+    return length == download->offset;
+}
+
+static void getDownloadPath(char* buffer, size_t size, const char* URL)
+{
+    char cachedir[PATH_MAX];
+    const char* name = strrchr(URL, '/');
+
+    getCacheDir(cachedir, sizeof(cachedir));
+    strncat(cachedir, "/downloads", sizeof(cachedir) - strlen(cachedir) - 1);
+    makePath(cachedir);
+
+    name = name && name[1] ? name + 1 : "download";
+    snprintf(buffer, size, "%s/%016" PRIx64 "-%s", cachedir, hashString(URL), name);
+}
+
+// replays what an earlier run left in the .part file into hash and stream
+static bool replayPart(struct resumeDownload* download)
+{
+    uint8_t buffer[STREAM_BLOCK_SIZE];
+    size_t length;
+
+    rewind(download->file);
+    while ((length = fread(buffer, 1, sizeof(buffer), download->file)))
+    {
+        sha256Update(&download->hash, buffer, length);
+        feedStream(download, buffer, length);
+    }
+
+    return !ferror(download->file) && !fseeko(download->file, 0, SEEK_END);
+}
+
+// the object is hashed on the way, a damaged copy fails the stream
+static bool replayStored(const char* path, const char sha[SHA256_HEX_SIZE], struct Stream* stream)
+{
+    struct resumeDownload download;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+    bool success = false;
+
+    memset(&download, 0, sizeof(download));
+    download.stream = stream;
+    sha256Init(&download.hash);
+
+    if ((download.file = fopen(path, "rb")))
+    {
+        success = replayPart(&download);
+        fclose(download.file);
+    }
+
+    sha256Final(&download.hash, digest);
+    sha256Hex(digest, hex);
+
+    if (success && strcmp(hex, sha))
+    {
+        printf("%s is damaged, its SHA-256 is %s instead of %s\n", path, hex, sha);
+        unlink(path);
+        success = false;
+    }
+
+    return success;
+}
+
+/*
+ * makes `URL' available in the download store and describes it in `result'.
+ * Data goes to a .part file in the downloads dir of the cache first, so a
+ * broken transfer resumes where it stopped, both on retry (POLECAT_RETRIES,
+ * exponential backoff) and in a later run.
+ * If `stream' is set it receives the whole file as it arrives, should
+ * the server refuse to resume, the stream fails and `restarted' is set.
+ * A file that does not hash to `expected' fails the stream and is dropped
+ */
+bool downloadToCache(const char* URL, struct CachedFile* result, struct Stream* stream)
+{
+    char path[PATH_MAX], partpath[PATH_MAX + 8], etagpath[PATH_MAX + 16];
+    struct resumeDownload download;
+    bool success = false;
+
+    result->restarted = false;
+
+    if (storeLookup(URL, result->path, sizeof(result->path), result->sha256))
+    {
+        if (checksumMatches(result->expected, result->sha256))
+        {
+            // fetched before, only the consumer is missing its data
+            success = !stream || replayStored(result->path, result->sha256, stream);
+            if (stream) streamClose(stream, !success);
+            return success;
+        }
+
+        puts("The cached copy has a different SHA-256, downloading it again");
+    }
+
+    memset(&download, 0, sizeof(download));
+    download.stream = stream;
+    sha256Init(&download.hash);
+
+    getDownloadPath(path, sizeof(path), URL);
+    snprintf(partpath, sizeof(partpath), "%s.part", path);
+    snprintf(etagpath, sizeof(etagpath), "%s.etag", partpath);
+    download.etagpath = etagpath;
+
+    if (!(download.file = fopen(partpath, "a+b")))
+    {
+        printf("Cannot open %s\n", partpath);
+        if (stream) streamClose(stream, true);
+        return false;
+    }
+
+    if (replayPart(&download))
+    {
+        download.offset = ftello(download.file);
+    }
+    else
+    {
+        restartPart(&download);
+    }
+
+    {
+        FILE* file = fopen(etagpath, "r");
+        if (file)
+        {
+            if (!fgets(download.validators.etag, sizeof(download.validators.etag), file)) download.validators.etag[0] = '\0';
+            fclose(file);
+        }
+    }
+
+    long retries = getConfigNumber("POLECAT_RETRIES", 5);
+    unsigned int delay = 1;
+
+    for (long attempt = 0; attempt <= retries && !success; ++attempt)
+    {
+        CURLcode res;
+        long http_code = 0;
+        struct CacheEntry previous = download.validators;
+
+        if (attempt)
+        {
+            printf("Retrying in %us (%li/%li)\n", delay, attempt, retries);
+            sleep(delay);
+            if (delay < 32) delay *= 2;
+        }
+
+        if (!(download.handle = acquireHandle())) break;
+
+        struct curl_slist* headers = NULL;
+        if (download.offset && previous.etag[0])
+        {
+            // only resume if it is still the same file
+            char header[sizeof(previous.etag) + 16];
+            snprintf(header, sizeof(header), "If-Range: %s", previous.etag);
+            headers = curl_slist_append(headers, header);
+        }
+
+        download.started = false;
+        download.total = -1;
+
+        curl_easy_setopt(download.handle, CURLOPT_URL, URL);
+        curl_easy_setopt(download.handle, CURLOPT_WRITEFUNCTION, resumeCallback);
+        curl_easy_setopt(download.handle, CURLOPT_WRITEDATA, (void*)&download);
+        curl_easy_setopt(download.handle, CURLOPT_HEADERFUNCTION, resumeHeaderCallback);
+        curl_easy_setopt(download.handle, CURLOPT_HEADERDATA, (void*)&download);
+        curl_easy_setopt(download.handle, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(download.handle, CURLOPT_RESUME_FROM_LARGE, download.offset);
+        curl_easy_setopt(download.handle, CURLOPT_FAILONERROR, 1L);
+
+        res = curl_easy_perform(download.handle);
+        finishTransfer(download.handle);
+
+        curl_off_t length = -1;
+        curl_easy_getinfo(download.handle, CURLINFO_RESPONSE_CODE, &http_code);
+        curl_easy_getinfo(download.handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+
+        releaseHandle(download.handle);
+        curl_slist_free_all(headers);
+        fflush(download.file);
+
+        // curl passes a 416 on a resumed request as success, newer versions fail it
+        if (http_code == 416 && download.offset && partComplete(URL, &download, previous.etag))
+        {
+            // nothing left to transfer, only the store is missing the file
+            download.validators = previous;
+            download.start = download.offset;
+            success = true;
+        }
+        else if (res == CURLE_OK && http_code != 416)
+        {
+            if (length >= 0 && download.start + length != download.offset)
+            {
+                printf("Size mismatch, expected %lld bytes but got %lld\n",
+                       (long long)(download.start + length), (long long)download.offset);
+            }
+            else
+            {
+                success = true;
+            }
+        }
+        else
+        {
+            puts(res == CURLE_OK ? "The server cannot resume the partial download" : curl_easy_strerror(res));
+
+            // the server can't resume or our part is bogus, anything else below 500 won't change by retrying
+            if (res == CURLE_RANGE_ERROR || http_code == 416)
+            {
+                restartPart(&download);
+            }
+            else if (http_code >= 400 && http_code < 500)
+            {
+                break;
+            }
+        }
+    }
+
+    fclose(download.file);
+
+    if (success)
+    {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+
+        sha256Final(&download.hash, digest);
+        sha256Hex(digest, result->sha256);
+
+        if (!checksumMatches(result->expected, result->sha256))
+        {
+            // resuming a wrong file only makes another wrong file
+            printf("SHA-256 mismatch for %s\nexpected %s\n     got %s\n", URL, result->expected, result->sha256);
+            unlink(partpath);
+            success = false;
+        }
+        else
+        {
+            success = storeInsertFile(URL, download.validators.etag, result->sha256, partpath, result->path, sizeof(result->path));
+        }
+
+        unlink(etagpath);
+    }
+
+    if (download.stream) streamClose(download.stream, !success);
+    result->restarted = download.restarted;
+
+    return success;
+}
+
+// ETag the server currently reports for `URL', via HEAD
+bool requestETag(const char* URL, char* etag, size_t size)
+{
+    struct CacheEntry response;
+    curl_off_t length;
+
+    if (!requestHead(URL, &response, &length)) return false;
+
+    strncpy(etag, response.etag, size - 1);
+    etag[size - 1] = '\0';
+
+    return true;
+}
+
 void downloadFile(const char* URL, const char* path)
 {
-    struct MemoryStruct* chunk = downloadToRam(URL);
+    struct MemoryStruct* mem = downloadToRam(URL);
 
-    if (chunk)
+    if (mem)
     {
         FILE* file = fopen(path, "wb");
         if (file)
         {
-            fwrite(chunk->memory, chunk->size, 1, file);
+            for (struct MemoryChunk* chunk = mem->head; chunk; chunk = chunk->next)
+            {
+                fwrite(chunk->data, chunk->size, 1, file);
+            }
             fclose(file);
         }
 
-        free(chunk->memory);
-        free(chunk);
+        memoryFree(mem);
     }
 }
 
-struct json_object* fetchJSON(const char* URL)
+/*
+ * `keys' projects the document down to object members with these names,
+ * NULL keeps all of it
+ */
+struct json_object* fetchJSONKeys(const char* URL, const char* const* keys)
 {
-    struct MemoryStruct* chunk = downloadToRam(URL);
+    return fetchJSONIfChanged(URL, keys, 0, NULL);
+}
 
-    struct json_object* json = NULL;
+/*
+ * fetchJSONKeys for callers that keep something built from an earlier
+ * response, when the response cacheStamp gave `stamp' for is still the one
+ * served (fresh, stale or revalidated) `unchanged' is set and nothing parsed
+ */
+struct json_object* fetchJSONIfChanged(const char* URL, const char* const* keys, uint64_t stamp, bool* unchanged)
+{
+    struct JsonStream* json = jsonStreamNew(keys);
+    struct json_object* result = NULL;
+    struct CacheEntry entry;
 
-    if (chunk)
-    {
-        json = json_tokener_parse((char*)chunk->memory);
+    if (unchanged) *unchanged = false;
+    if (!json) return NULL;
+
+    struct MemoryStruct* mem = fetchCachedStream(URL, json);
 
-        free(chunk->memory);
-        free(chunk);
+    if (mem)
+    {
+        // served from the cache, nothing was parsed yet
+        if (unchanged && !jsonStreamStarted(json) && cacheLoadEntry(URL, &entry) && cacheStamp(&entry) == stamp)
+        {
+            *unchanged = true;
+        }
+        else if (!jsonStreamStarted(json))
+        {
+            for (struct MemoryChunk* chunk = mem->head; chunk; chunk = chunk->next)
+            {
+                if (!jsonStreamFeed(json, chunk->data, chunk->size)) break;
+            }
+        }
 
+        memoryFree(mem);
+        if (!unchanged || !*unchanged) result = jsonStreamFinish(json);
     }
 
-    return json;
-}
\ No newline at end of file
+    jsonStreamFree(json);
+
+    return result;
+}
+
+struct json_object* fetchJSON(const char* URL)
+{
+    return fetchJSONKeys(URL, NULL);
+}
@@ -1,11 +1,38 @@
 #ifndef NET_H
 #define NET_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/limits.h>
 #include <json.h>
 
+#include "sha256.h"
+
+struct Stream;
+
+struct CachedFile {
+    const char* expected;               // SHA-256 the file must have, NULL takes any
+    char path[PATH_MAX];
+    char sha256[SHA256_HEX_SIZE];
+    bool restarted;
+};
+
+typedef void (*transferCallback)(size_t index, bool success, void* data);
+// `length' is the Content-Length or -1, false aborts the transfer
+typedef bool (*transferWrite)(size_t index, const void* contents, size_t size, int64_t length, void* data);
+
 size_t WriteMemoryCallback(void*, size_t, size_t, void*);
 struct MemoryStruct* downloadToRam(const char* URL);
+struct MemoryStruct* fetchCached(const char* URL);
+bool downloadMany(char**, size_t, transferWrite, transferCallback, void*);
+bool downloadToCache(const char* URL, struct CachedFile*, struct Stream*);
+bool requestETag(const char* URL, char* etag, size_t size);
 void downloadFile(const char*, const char*);
 struct json_object* fetchJSON(const char*);
+struct json_object* fetchJSONKeys(const char*, const char* const* keys);
+struct json_object* fetchJSONIfChanged(const char*, const char* const* keys, uint64_t stamp, bool* unchanged);
+
+void netSetOffline(bool);
+bool netIsOffline(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "prewarm.h"
+#include "launch.h"
+#include "common.h"
+#include "config.h"
+
+/*
+ * `wineserver -p' outlives its last client for a while, so the next
+ * launch in the same prefix skips server startup and registry loading
+ * a record per prefix in <cache dir>/prewarm/<hash> remembers which
+ * runner's server it is, wine of another version can't talk to it
+ */
+
+// the cache dir, "/prewarm/" and the hash
+#define RECORD_PATH_MAX (PATH_MAX + 32)
+
+static void getRecordPath(char* buffer, size_t size, const char* prefix)
+{
+    char cachedir[PATH_MAX];
+    getCacheDir(cachedir, sizeof(cachedir));
+
+    snprintf(buffer, size, "%s/prewarm/%016" PRIx64, cachedir, hashString(prefix));
+}
+
+// WINEPREFIX of the profile or wine's default, resolved so every spelling finds the same record
+void prewarmGetPrefix(const char* configured, char* prefix, size_t size)
+{
+    char path[PATH_MAX];
+
+    if (configured && configured[0]) snprintf(path, sizeof(path), "%s", configured);
+    else snprintf(path, sizeof(path), "%s/.wine", getenv("HOME") ? getenv("HOME") : "");
+
+    if (!realpath(path, prefix)) snprintf(prefix, size, "%s", path);
+}
+
+static bool readRecord(const char* path, struct WarmServer* warm)
+{
+    char line[PATH_MAX + 16], value[PATH_MAX];
+    FILE* file = fopen(path, "r");
+
+    if (!file) return false;
+
+    memset(warm, 0, sizeof(struct WarmServer));
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        readKeyValue(line, "version", warm->version, sizeof(warm->version));
+        readKeyValue(line, "prefix", warm->prefix, sizeof(warm->prefix));
+        readKeyValue(line, "server", warm->server, sizeof(warm->server));
+        if (readKeyValue(line, "pid", value, sizeof(value))) warm->pid = atoi(value);
+        if (readKeyValue(line, "timeout", value, sizeof(value))) warm->timeout = atol(value);
+    }
+    fclose(file);
+
+    return warm->pid > 0;
+}
+
+// the pid may have been reused since, so it has to still be that wineserver
+static bool isRunning(const struct WarmServer* warm)
+{
+    char proc[64], exe[PATH_MAX], server[PATH_MAX];
+    ssize_t length;
+
+    snprintf(proc, sizeof(proc), "/proc/%i/exe", (int)warm->pid);
+    if ((length = readlink(proc, exe, sizeof(exe) - 1)) < 0) return false;
+    exe[length] = '\0';
+
+    return realpath(warm->server, server) && !strcmp(exe, server);
+}
+
+// true if a warm server for `prefix' is running, stale records are removed
+bool prewarmFind(const char* prefix, struct WarmServer* warm)
+{
+    char path[RECORD_PATH_MAX];
+    getRecordPath(path, sizeof(path), prefix);
+
+    if (!readRecord(path, warm) || strcmp(warm->prefix, prefix)) return false;
+
+    if (!isRunning(warm))
+    {
+        unlink(path);
+        return false;
+    }
+
+    return true;
+}
+
+bool prewarmStart(const char* version, const char* prefix, long timeout, struct WarmServer* warm)
+{
+    char path[RECORD_PATH_MAX], temp[RECORD_PATH_MAX + 16], option[32];
+    struct LaunchProfile profile;
+
+    memset(warm, 0, sizeof(struct WarmServer));
+    snprintf(warm->version, sizeof(warm->version), "%s", version);
+    snprintf(warm->prefix, sizeof(warm->prefix), "%s", prefix);
+    warm->timeout = timeout;
+
+    getDataDir(warm->server, sizeof(warm->server));
+    strncat(warm->server, "/", sizeof(warm->server) - strlen(warm->server) - 1);
+    strncat(warm->server, version, sizeof(warm->server) - strlen(warm->server) - 1);
+    strncat(warm->server, "/bin/wineserver", sizeof(warm->server) - strlen(warm->server) - 1);
+
+    if (!isFile(warm->server))
+    {
+        printf("`%s' is not an installed wine version\n", version);
+        return false;
+    }
+
+    // wineserver needs the directory, wine fills it on the first run
+    makePath(prefix);
+
+    if (!launchProfileLoad(version, &profile) || !launchProfileSet(&profile, "WINEPREFIX", prefix))
+    {
+        launchProfileFree(&profile);
+        return false;
+    }
+
+    // in the foreground so the pid we get is the server's
+    snprintf(option, sizeof(option), "-p%ld", timeout);
+    char* argv[] = { warm->server, "-f", option, NULL };
+
+    warm->pid = launchDetached(warm->server, argv, &profile);
+    launchProfileFree(&profile);
+
+    if (warm->pid <= 0) return false;
+
+    getCacheDir(path, sizeof(path));
+    strncat(path, "/prewarm", sizeof(path) - strlen(path) - 1);
+    makePath(path);
+
+    getRecordPath(path, sizeof(path), prefix);
+    snprintf(temp, sizeof(temp), "%s.%i", path, getpid());
+
+    FILE* file = fopen(temp, "w");
+    if (!file) return false;
+
+    fprintf(file, "version %s\nprefix %s\nserver %s\npid %i\ntimeout %ld\n",
+            warm->version, warm->prefix, warm->server, (int)warm->pid, warm->timeout);
+
+    if (fclose(file) || rename(temp, path))
+    {
+        unlink(temp);
+        return false;
+    }
+
+    return true;
+}
+
+// `wineserver -k' also ends the wine processes still using the prefix
+bool prewarmStop(const char* prefix)
+{
+    struct WarmServer warm;
+    struct LaunchProfile profile;
+    char path[RECORD_PATH_MAX];
+
+    if (!prewarmFind(prefix, &warm)) return false;
+
+    if (launchProfileLoad(warm.version, &profile) && launchProfileSet(&profile, "WINEPREFIX", prefix))
+    {
+        char* argv[] = { warm.server, "-k", NULL };
+        launchProgram(warm.server, argv, &profile, true);
+    }
+    launchProfileFree(&profile);
+
+    // it ignored -k
+    if (isRunning(&warm)) kill(warm.pid, SIGTERM);
+
+    getRecordPath(path, sizeof(path), prefix);
+    unlink(path);
+
+    return true;
+}
+
+void prewarmList(void)
+{
+    char path[PATH_MAX + 32];
+    DIR* dir;
+    struct dirent* ent;
+
+    getCacheDir(path, sizeof(path));
+    strncat(path, "/prewarm", sizeof(path) - strlen(path) - 1);
+
+    puts("Warm wineservers:");
+    if (!(dir = opendir(path))) return;
+
+    while ((ent = readdir(dir)))
+    {
+        char record[PATH_MAX + NAME_MAX + 64];
+        struct WarmServer warm;
+
+        if (ent->d_name[0] == '.') continue;
+
+        snprintf(record, sizeof(record), "%s/%s", path, ent->d_name);
+        if (readRecord(record, &warm) && prewarmFind(warm.prefix, &warm))
+        {
+            printf(" - %s\t%s (pid %i, idle timeout %lds)\n", warm.version, warm.prefix, (int)warm.pid, warm.timeout);
+        }
+    }
+
+    closedir(dir);
+}
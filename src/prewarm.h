@@ -0,0 +1,24 @@
+#ifndef PREWARM_H
+#define PREWARM_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <linux/limits.h>
+
+// a wineserver kept running for a prefix by `wine prewarm'
+struct WarmServer {
+    char version[NAME_MAX + 1];
+    char prefix[PATH_MAX];
+    char server[PATH_MAX];
+    pid_t pid;
+    long timeout;
+};
+
+void prewarmGetPrefix(const char* configured, char* prefix, size_t size);
+
+bool prewarmFind(const char* prefix, struct WarmServer*);
+bool prewarmStart(const char* version, const char* prefix, long timeout, struct WarmServer*);
+bool prewarmStop(const char* prefix);
+void prewarmList(void);
+
+#endif
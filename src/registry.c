@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "registry.h"
+#include "tar.h"
+#include "common.h"
+#include "config.h"
+
+/*
+ * <data dir>/.registry lists what was installed, one runner per line
+ *   type  name  url  sha256  bytes  files  installed
+ * tab separated, rewritten as a whole through a temporary file,
+ * writers serialize on <data dir>/.registry.lock
+ */
+
+#define REGISTRY_HEADER  "polecat-registry 1"
+#define SCAN_MAX_THREADS 16
+
+static void getRegistryPath(char* buffer, size_t size, const char* extension)
+{
+    getDataDir(buffer, size);
+    strncat(buffer, "/.registry", size - strlen(buffer) - 1);
+    strncat(buffer, extension, size - strlen(buffer) - 1);
+}
+
+static void adoptInstalled(void);
+
+// the first lock taken without a registry adopts the runners installed before it
+int registryLock(void)
+{
+    char path[PATH_MAX];
+    getRegistryPath(path, sizeof(path), ".lock");
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return fd;
+
+    flock(fd, LOCK_EX);
+
+    getRegistryPath(path, sizeof(path), "");
+    if (!isFile(path)) adoptInstalled();
+
+    return fd;
+}
+
+void registryUnlock(int lock)
+{
+    if (lock >= 0) close(lock);
+}
+
+static bool parseEntry(char* line, struct RegistryEntry* entry)
+{
+    char* fields[7];
+    size_t count = 0;
+
+    line[strcspn(line, "\n")] = '\0';
+
+    for (char* field; count < ARRAY_LEN(fields) && (field = strsep(&line, "\t")); ) fields[count++] = field;
+    if (count != ARRAY_LEN(fields)) return false;
+
+    memset(entry, 0, sizeof(struct RegistryEntry));
+    snprintf(entry->type, sizeof(entry->type), "%s", fields[0]);
+    snprintf(entry->name, sizeof(entry->name), "%s", fields[1]);
+    snprintf(entry->url, sizeof(entry->url), "%s", fields[2]);
+    snprintf(entry->sha256, sizeof(entry->sha256), "%s", fields[3]);
+    entry->bytes = strtoull(fields[4], NULL, 10);
+    entry->files = strtoull(fields[5], NULL, 10);
+    entry->installed = strtoll(fields[6], NULL, 10);
+
+    return entry->name[0];
+}
+
+// the caller frees the entries, NULL with `count' 0 when nothing is registered
+struct RegistryEntry* registryLoad(size_t* count)
+{
+    char path[PATH_MAX], line[PATH_MAX + 512];
+    struct RegistryEntry* entries = NULL;
+    FILE* file;
+
+    *count = 0;
+
+    getRegistryPath(path, sizeof(path), "");
+    if (!(file = fopen(path, "r"))) return NULL;
+
+    if (!fgets(line, sizeof(line), file) || strncmp(line, REGISTRY_HEADER, strlen(REGISTRY_HEADER)))
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), file))
+    {
+        struct RegistryEntry* grown = realloc(entries, (*count + 1) * sizeof(struct RegistryEntry));
+        if (!grown) break;
+
+        entries = grown;
+        if (parseEntry(line, &entries[*count])) ++*count;
+    }
+
+    fclose(file);
+
+    return entries;
+}
+
+bool registrySave(const struct RegistryEntry* entries, size_t count)
+{
+    char path[PATH_MAX], temp[PATH_MAX + 16];
+
+    getRegistryPath(path, sizeof(path), "");
+    snprintf(temp, sizeof(temp), "%s.%i", path, getpid());
+
+    FILE* file = fopen(temp, "w");
+    if (!file) return false;
+
+    fprintf(file, REGISTRY_HEADER "\n");
+    for (size_t i = 0; i < count; ++i)
+    {
+        fprintf(file, "%s\t%s\t%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%lld\n", entries[i].type, entries[i].name,
+                entries[i].url, entries[i].sha256, entries[i].bytes, entries[i].files, (long long)entries[i].installed);
+    }
+
+    if (fflush(file) || fsync(fileno(file)) || fclose(file) || rename(temp, path))
+    {
+        unlink(temp);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * counts the regular files of a tree and their size,
+ * directories are stat'ed by a pool of workers
+ */
+struct scanQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+
+    char** dirs;
+    size_t count;
+    size_t capacity;
+    size_t busy;
+    bool failed;
+
+    uint64_t files;
+    uint64_t bytes;
+};
+
+static bool pushDir(struct scanQueue* queue, const char* path)
+{
+    char* copy = strdup(path);
+
+    if (queue->count == queue->capacity)
+    {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        char** grown = realloc(queue->dirs, capacity * sizeof(char*));
+
+        if (!grown)
+        {
+            free(copy);
+            return false;
+        }
+
+        queue->dirs = grown;
+        queue->capacity = capacity;
+    }
+
+    if (!copy) return false;
+
+    queue->dirs[queue->count++] = copy;
+    pthread_cond_signal(&queue->work);
+
+    return true;
+}
+
+static void scanDir(struct scanQueue* queue, const char* path)
+{
+    DIR* dir = opendir(path);
+    struct dirent* ent;
+    uint64_t files = 0, bytes = 0;
+    bool failed = !dir;
+
+    while (dir && (ent = readdir(dir)))
+    {
+        char child[PATH_MAX];
+        struct stat sb;
+
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+
+        if (fstatat(dirfd(dir), ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+            failed = true;
+            continue;
+        }
+
+        if (S_ISREG(sb.st_mode))
+        {
+            files++;
+            bytes += sb.st_size;
+        }
+        else if (S_ISDIR(sb.st_mode))
+        {
+            snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+
+            pthread_mutex_lock(&queue->lock);
+            if (!pushDir(queue, child)) failed = true;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+
+    if (dir) closedir(dir);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->files += files;
+    queue->bytes += bytes;
+    if (failed) queue->failed = true;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void* scanWorker(void* data)
+{
+    struct scanQueue* queue = data;
+
+    pthread_mutex_lock(&queue->lock);
+
+    for (;;)
+    {
+        while (!queue->count && queue->busy) pthread_cond_wait(&queue->work, &queue->lock);
+
+        // nothing queued and nobody left who could queue more
+        if (!queue->count) break;
+
+        char* path = queue->dirs[--queue->count];
+        queue->busy++;
+        pthread_mutex_unlock(&queue->lock);
+
+        scanDir(queue, path);
+        free(path);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->busy--;
+        if (!queue->busy && !queue->count) pthread_cond_broadcast(&queue->work);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+bool registryScan(const char* path, uint64_t* files, uint64_t* bytes)
+{
+    struct scanQueue queue;
+    pthread_t threads[SCAN_MAX_THREADS];
+    size_t threadcount = 0;
+
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.work, NULL);
+
+    long wanted = sysconf(_SC_NPROCESSORS_ONLN);
+    if (wanted > SCAN_MAX_THREADS) wanted = SCAN_MAX_THREADS;
+
+    if (pushDir(&queue, path))
+    {
+        for (long i = 0; i < wanted; ++i)
+        {
+            if (pthread_create(&threads[threadcount], NULL, scanWorker, &queue)) break;
+            ++threadcount;
+        }
+
+        if (!threadcount) scanWorker(&queue);
+        for (size_t i = 0; i < threadcount; ++i) pthread_join(threads[i], NULL);
+    }
+    else
+    {
+        queue.failed = true;
+    }
+
+    for (size_t i = 0; i < queue.count; ++i) free(queue.dirs[i]);
+    free(queue.dirs);
+
+    pthread_cond_destroy(&queue.work);
+    pthread_mutex_destroy(&queue.lock);
+
+    *files = queue.files;
+    *bytes = queue.bytes;
+
+    return !queue.failed;
+}
+
+// appends the wine trees in the data dir that are not registered yet, `report' lists what else is there
+size_t registryAdopt(struct RegistryEntry** entries, size_t count, bool report)
+{
+    char datadir[PATH_MAX];
+    struct dirent* ent;
+    DIR* dir;
+
+    getDataDir(datadir, sizeof(datadir));
+    if (!(dir = opendir(datadir))) return count;
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        char path[PATH_MAX + NAME_MAX + 16];
+        size_t i;
+
+        if (ent->d_name[0] == '.') continue;
+
+        for (i = 0; i < count && strcmp((*entries)[i].name, ent->d_name); ++i);
+        if (i < count) continue;
+
+        snprintf(path, sizeof(path), "%s/%s/bin/wine", datadir, ent->d_name);
+        if (!isFile(path))
+        {
+            snprintf(path, sizeof(path), "%s/%s", datadir, ent->d_name);
+            if (report && isDir(path)) printf(" - %s: not installed by " NAME "\n", ent->d_name);
+            continue;
+        }
+
+        struct RegistryEntry* grown = realloc(*entries, (count + 1) * sizeof(struct RegistryEntry));
+        if (!grown) break;
+        *entries = grown;
+
+        struct RegistryEntry* entry = &grown[count++];
+        memset(entry, 0, sizeof(struct RegistryEntry));
+        strcpy(entry->type, "wine");
+        snprintf(entry->name, sizeof(entry->name), "%s", ent->d_name);
+
+        snprintf(path, sizeof(path), "%s/%s", datadir, ent->d_name);
+        entry->installed = getStat(path).st_mtime;
+        registryScan(path, &entry->files, &entry->bytes);
+
+        printf(" - %s: added to the registry\n", ent->d_name);
+    }
+    closedir(dir);
+
+    return count;
+}
+
+// only called with the lock held, an empty registry is saved too so this runs once
+static void adoptInstalled(void)
+{
+    struct RegistryEntry* entries = NULL;
+    size_t count = registryAdopt(&entries, 0, false);
+
+    registrySave(entries, count);
+    free(entries);
+}
+
+// records a runner extracted into the data dir, replacing an older entry of the same name
+bool registryInstall(const char* type, const char* URL, const struct ExtractResult* result)
+{
+    struct RegistryEntry entry, *entries;
+    char path[PATH_MAX];
+    size_t count, i;
+    bool success = false;
+
+    if (!result->root[0]) return false;
+
+    memset(&entry, 0, sizeof(entry));
+    snprintf(entry.type, sizeof(entry.type), "%s", type);
+    snprintf(entry.name, sizeof(entry.name), "%s", result->root);
+    snprintf(entry.url, sizeof(entry.url), "%s", URL);
+    memcpy(entry.sha256, result->sha256, sizeof(entry.sha256));
+    entry.installed = time(NULL);
+
+    getDataDir(path, sizeof(path));
+    strncat(path, "/", sizeof(path) - strlen(path) - 1);
+    strncat(path, entry.name, sizeof(path) - strlen(path) - 1);
+    registryScan(path, &entry.files, &entry.bytes);
+
+    int lock = registryLock();
+    entries = registryLoad(&count);
+
+    for (i = 0; i < count && strcmp(entries[i].name, entry.name); ++i);
+
+    if (i == count)
+    {
+        struct RegistryEntry* grown = realloc(entries, (count + 1) * sizeof(struct RegistryEntry));
+        if (grown)
+        {
+            entries = grown;
+            count++;
+        }
+    }
+
+    if (i < count)
+    {
+        entries[i] = entry;
+        success = registrySave(entries, count);
+    }
+
+    free(entries);
+    registryUnlock(lock);
+
+    return success;
+}
@@ -0,0 +1,35 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <linux/limits.h>
+
+#include "sha256.h"
+
+struct ExtractResult;
+
+// one installed runner below the data dir
+struct RegistryEntry {
+    char type[16];
+    char name[NAME_MAX + 1];
+    char url[PATH_MAX];
+    char sha256[SHA256_HEX_SIZE];
+    uint64_t bytes;
+    uint64_t files;
+    time_t installed;
+};
+
+int registryLock(void);
+void registryUnlock(int lock);
+
+struct RegistryEntry* registryLoad(size_t* count);
+bool registrySave(const struct RegistryEntry*, size_t count);
+
+bool registryScan(const char* path, uint64_t* files, uint64_t* bytes);
+size_t registryAdopt(struct RegistryEntry** entries, size_t count, bool report);
+bool registryInstall(const char* type, const char* URL, const struct ExtractResult*);
+
+#endif
@@ -0,0 +1,150 @@
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sha256.h"
+
+// FIPS 180-4, incremental so it can run inside write callbacks
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void transform(struct sha256* ctx, const uint8_t* block)
+{
+    uint32_t w[64], s[8];
+
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = (uint32_t)block[i*4] << 24 | (uint32_t)block[i*4+1] << 16 | (uint32_t)block[i*4+2] << 8 | block[i*4+3];
+    }
+
+    for (int i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    memcpy(s, ctx->state, sizeof(s));
+
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i];
+        uint32_t t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+        s[7] = s[6];
+        s[6] = s[5];
+        s[5] = s[4];
+        s[4] = s[3] + t1;
+        s[3] = s[2];
+        s[2] = s[1];
+        s[1] = s[0];
+        s[0] = t1 + t2;
+    }
+
+    for (int i = 0; i < 8; ++i) ctx->state[i] += s[i];
+}
+
+void sha256Init(struct sha256* ctx)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256Update(struct sha256* ctx, const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+
+    ctx->length += size;
+
+    if (ctx->used)
+    {
+        size_t amount = 64 - ctx->used;
+        if (amount > size) amount = size;
+
+        memcpy(ctx->buffer + ctx->used, bytes, amount);
+        ctx->used += amount;
+        bytes += amount;
+        size -= amount;
+
+        if (ctx->used < 64) return;
+
+        transform(ctx, ctx->buffer);
+        ctx->used = 0;
+    }
+
+    for (; size >= 64; size -= 64, bytes += 64) transform(ctx, bytes);
+
+    memcpy(ctx->buffer, bytes, size);
+    ctx->used = size;
+}
+
+void sha256Final(struct sha256* ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad = 0x80;
+
+    sha256Update(ctx, &pad, 1);
+
+    pad = 0;
+    while (ctx->used != 56) sha256Update(ctx, &pad, 1);
+
+    for (int i = 0; i < 8; ++i) ctx->buffer[56 + i] = bits >> (56 - i * 8);
+    transform(ctx, ctx->buffer);
+
+    for (int i = 0; i < 8; ++i)
+    {
+        digest[i*4]   = ctx->state[i] >> 24;
+        digest[i*4+1] = ctx->state[i] >> 16;
+        digest[i*4+2] = ctx->state[i] >> 8;
+        digest[i*4+3] = ctx->state[i];
+    }
+}
+
+void sha256Hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE])
+{
+    for (int i = 0; i < SHA256_DIGEST_SIZE; ++i) sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+// hashes a whole file, mapped so large runners don't go through a read buffer
+bool sha256File(int fd, char hex[SHA256_HEX_SIZE])
+{
+    struct sha256 ctx;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    struct stat sb;
+
+    if (fstat(fd, &sb) < 0) return false;
+
+    sha256Init(&ctx);
+
+    if (sb.st_size)
+    {
+        void* data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) return false;
+
+        madvise(data, sb.st_size, MADV_SEQUENTIAL);
+        sha256Update(&ctx, data, sb.st_size);
+        munmap(data, sb.st_size);
+    }
+
+    sha256Final(&ctx, digest);
+    sha256Hex(digest, hex);
+
+    return true;
+}
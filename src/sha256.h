@@ -0,0 +1,25 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE    (SHA256_DIGEST_SIZE * 2 + 1)
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[64];
+    size_t used;
+};
+
+void sha256Init(struct sha256*);
+void sha256Update(struct sha256*, const void*, size_t);
+void sha256Final(struct sha256*, uint8_t digest[SHA256_DIGEST_SIZE]);
+void sha256Hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE]);
+
+bool sha256File(int fd, char hex[SHA256_HEX_SIZE]);
+
+#endif
@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "staging.h"
+#include "memory.h"
+#include "sha256.h"
+#include "store.h"
+#include "net.h"
+#include "checksum.h"
+#include "common.h"
+#include "config.h"
+
+/*
+ * installer files between the download and the directives
+ * each one is known by the path the directives expect it at and is
+ *   memory  a small download, while POLECAT_STAGING_MEMORY MiB last
+ *   source  an object of the download store, read where it is
+ *   disk    streamed into the staging directory, which sits in the
+ *           target directory so moving it into place is a rename
+ * memory and source files only get written out once a directive needs
+ * the file itself, extracting works on them as they are
+ */
+
+enum stagedState {
+    STAGED_PENDING,
+    STAGED_MEMORY,
+    STAGED_SOURCE,
+    STAGED_DISK
+};
+
+struct stagedFile {
+    char* url;
+    char* path;
+    char source[PATH_MAX];
+    enum stagedState state;
+
+    struct MemoryStruct* memory;        // kept until the staging is closed
+    size_t reserved;                    // of the memory budget
+    int fd;                             // while it is downloaded to disk
+    struct sha256 hash;
+    char expected[SHA256_HEX_SIZE];     // empty when nothing is known
+
+    pthread_mutex_t lock;
+};
+
+struct Staging {
+    char dir[PATH_MAX];
+    struct stagedFile* files;
+    size_t count;
+
+    size_t budget;
+    size_t used;
+};
+
+struct fetchBatch {
+    struct Staging* staging;
+    size_t* indices;
+    bool mismatch;
+};
+
+// in `targetdir' so staged files are on the file system they end up on
+struct Staging* stagingOpen(const char* targetdir)
+{
+    struct Staging* staging = calloc(1, sizeof(struct Staging));
+    long budget = getConfigNumber("POLECAT_STAGING_MEMORY", 256);
+
+    if (!staging) return NULL;
+
+    makePath(targetdir);
+    snprintf(staging->dir, sizeof(staging->dir), "%s/.polecat-staging-XXXXXX", targetdir);
+
+    if (!mkdtemp(staging->dir))
+    {
+        free(staging);
+        return NULL;
+    }
+
+    staging->budget = budget < 0 ? 0 : (size_t)budget * 1024 * 1024;
+
+    return staging;
+}
+
+void stagingClose(struct Staging* staging)
+{
+    if (!staging) return;
+
+    for (size_t i = 0; i < staging->count; ++i)
+    {
+        struct stagedFile* file = &staging->files[i];
+
+        if (file->fd >= 0) close(file->fd);
+        memoryFree(file->memory);
+        free(file->url);
+        free(file->path);
+        pthread_mutex_destroy(&file->lock);
+    }
+
+    removePath(staging->dir);
+
+    free(staging->files);
+    free(staging);
+}
+
+const char* stagingDir(const struct Staging* staging)
+{
+    return staging->dir;
+}
+
+// `path' is where the directives look for the file, below stagingDir
+bool stagingAdd(struct Staging* staging, const char* URL, const char* path)
+{
+    struct stagedFile* files = realloc(staging->files, (staging->count + 1) * sizeof(struct stagedFile));
+    if (!files) return false;
+
+    staging->files = files;
+
+    struct stagedFile* file = &files[staging->count];
+    memset(file, 0, sizeof(struct stagedFile));
+
+    file->url = strdup(URL);
+    file->path = strdup(path);
+    file->fd = -1;
+    pthread_mutex_init(&file->lock, NULL);
+
+    staging->count++;
+
+    return file->url && file->path;
+}
+
+static struct stagedFile* findFile(struct Staging* staging, const char* path)
+{
+    for (size_t i = 0; i < staging->count; ++i)
+    {
+        if (!strcmp(staging->files[i].path, path)) return &staging->files[i];
+    }
+
+    return NULL;
+}
+
+static const char* fileName(const struct stagedFile* file)
+{
+    const char* name = strrchr(file->path, '/');
+
+    return name ? name + 1 : file->path;
+}
+
+static bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* bytes = data;
+
+    while (size)
+    {
+        ssize_t written = write(fd, bytes, size);
+
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        bytes += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+// moves a file that outgrew memory (or never fit) to disk
+static bool spill(struct Staging* staging, struct stagedFile* file)
+{
+    makeParentPath(file->path);
+
+    file->fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file->fd < 0)
+    {
+        printf("Cannot write %s: %s\n", file->path, strerror(errno));
+        return false;
+    }
+
+    if (file->memory)
+    {
+        for (struct MemoryChunk* chunk = file->memory->head; chunk; chunk = chunk->next)
+        {
+            if (!writeAll(file->fd, chunk->data, chunk->size)) return false;
+        }
+
+        memoryFree(file->memory);
+        file->memory = NULL;
+        staging->used -= file->reserved;
+        file->reserved = 0;
+    }
+
+    file->state = STAGED_DISK;
+
+    return true;
+}
+
+static bool stageWrite(size_t index, const void* contents, size_t size, int64_t length, void* data)
+{
+    struct fetchBatch* batch = data;
+    struct Staging* staging = batch->staging;
+    struct stagedFile* file = &staging->files[batch->indices[index]];
+
+    if (file->state == STAGED_PENDING)
+    {
+        sha256Init(&file->hash);
+
+        // only bodies of a known size can be promised memory
+        if (length >= 0 && (size_t)length <= staging->budget - staging->used && (file->memory = memoryNew())
+            && memoryReserve(file->memory, length ? length : 1))
+        {
+            file->reserved = length;
+            staging->used += length;
+            file->state = STAGED_MEMORY;
+        }
+        else if (!spill(staging, file))
+        {
+            return false;
+        }
+    }
+
+    sha256Update(&file->hash, contents, size);
+
+    // more than the server announced
+    if (file->state == STAGED_MEMORY && file->memory->size + size > file->reserved && !spill(staging, file)) return false;
+
+    if (file->state == STAGED_MEMORY) return memoryAppend(file->memory, contents, size) == size;
+
+    return writeAll(file->fd, contents, size);
+}
+
+static void stageDone(size_t index, bool success, void* data)
+{
+    struct fetchBatch* batch = data;
+    struct stagedFile* file = &batch->staging->files[batch->indices[index]];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+
+    if (!success)
+    {
+        printf("Failed to download %s\n", fileName(file));
+        return;
+    }
+
+    // an empty body never reached stageWrite
+    if (file->state == STAGED_PENDING)
+    {
+        sha256Init(&file->hash);
+        file->memory = memoryNew();
+        file->state = STAGED_MEMORY;
+    }
+
+    sha256Final(&file->hash, digest);
+    sha256Hex(digest, hex);
+
+    if (!checksumMatches(file->expected, hex))
+    {
+        printf("SHA-256 mismatch for %s\nexpected %s\n     got %s\n", fileName(file), file->expected, hex);
+        batch->mismatch = true;
+        return;
+    }
+
+    if (file->state == STAGED_MEMORY)
+    {
+        if (file->memory) storeInsertMemory(file->url, NULL, file->memory);
+    }
+    else
+    {
+        close(file->fd);
+        file->fd = -1;
+
+        storeInsertCopy(file->url, NULL, hex, file->path);
+    }
+
+    printf("Downloaded %s\n", fileName(file));
+}
+
+/*
+ * makes every added file available, from the download store
+ * or downloaded in parallel
+ */
+bool stagingFetch(struct Staging* staging)
+{
+    char** urls = malloc((staging->count + 1) * sizeof(char*));
+    size_t* indices = malloc((staging->count + 1) * sizeof(size_t));
+    struct fetchBatch batch = { .staging = staging, .indices = indices };
+    size_t missing = 0;
+    bool success;
+
+    if (!urls || !indices)
+    {
+        free(urls);
+        free(indices);
+        return false;
+    }
+
+    for (size_t i = 0; i < staging->count; ++i)
+    {
+        struct stagedFile* file = &staging->files[i];
+        char sha[SHA256_HEX_SIZE];
+        const char* source;
+
+        if (file->state != STAGED_PENDING) continue;
+
+        if (!checksumLookup(file->url, file->expected, &source)) file->expected[0] = '\0';
+
+        if (storeLookup(file->url, file->source, sizeof(file->source), sha) && checksumMatches(file->expected, sha))
+        {
+            printf("Using cached %s\n", fileName(file));
+            file->state = STAGED_SOURCE;
+        }
+        else
+        {
+            urls[missing] = file->url;
+            indices[missing++] = i;
+        }
+    }
+
+    if (missing) printf("Downloading %zu files...\n", missing);
+    success = downloadMany(urls, missing, stageWrite, stageDone, &batch) && !batch.mismatch;
+
+    // a failed batch leaves partial files, they go with the staging directory
+    for (size_t i = 0; i < staging->count; ++i)
+    {
+        if (staging->files[i].fd >= 0)
+        {
+            close(staging->files[i].fd);
+            staging->files[i].fd = -1;
+        }
+    }
+
+    free(urls);
+    free(indices);
+
+    return success;
+}
+
+static bool writeMemory(struct stagedFile* file)
+{
+    makeParentPath(file->path);
+
+    int fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool success = fd >= 0;
+
+    for (struct MemoryChunk* chunk = file->memory->head; success && chunk; chunk = chunk->next)
+    {
+        success = writeAll(fd, chunk->data, chunk->size);
+    }
+
+    if (fd >= 0 && close(fd)) success = false;
+
+    return success;
+}
+
+// gives a staged file a copy of its own at its path, called locked
+static bool materialize(struct stagedFile* file)
+{
+    bool success;
+
+    if (file->state != STAGED_SOURCE && file->state != STAGED_MEMORY) return true;
+
+    if (file->state == STAGED_SOURCE)
+    {
+        makeParentPath(file->path);
+
+        // a reflink where the store and the target share a file system
+        success = copyFile(file->source, file->path, 0644);
+    }
+    else
+    {
+        // the memory stays, a concurrent extract may still read it
+        success = writeMemory(file);
+    }
+
+    if (success) file->state = STAGED_DISK;
+    else printf("Cannot stage %s: %s\n", fileName(file), strerror(errno));
+
+    return success;
+}
+
+/*
+ * the path a directive should use for `path', which may be a staged file
+ * `modify' asks for files of their own at `path' and below it, that can
+ * be moved or changed, otherwise a store object may be read in place
+ */
+bool stagingResolve(struct Staging* staging, const char* path, bool modify, char* resolved, size_t size)
+{
+    size_t length = strlen(path);
+    bool success = true;
+
+    snprintf(resolved, size, "%s", path);
+
+    for (size_t i = 0; success && i < staging->count; ++i)
+    {
+        struct stagedFile* file = &staging->files[i];
+
+        if (strncmp(file->path, path, length) || (file->path[length] && file->path[length] != '/')) continue;
+
+        pthread_mutex_lock(&file->lock);
+
+        if (modify) success = materialize(file);
+        else if (file->state == STAGED_SOURCE && !file->path[length]) snprintf(resolved, size, "%s", file->source);
+
+        pthread_mutex_unlock(&file->lock);
+    }
+
+    return success;
+}
+
+// contents of a staged file that was never written out, NULL otherwise
+const struct MemoryStruct* stagingMemory(struct Staging* staging, const char* path)
+{
+    struct stagedFile* file = findFile(staging, path);
+    const struct MemoryStruct* memory = NULL;
+
+    if (!file) return NULL;
+
+    pthread_mutex_lock(&file->lock);
+    if (file->state == STAGED_MEMORY) memory = file->memory;
+    pthread_mutex_unlock(&file->lock);
+
+    return memory;
+}
@@ -0,0 +1,20 @@
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct Staging;
+struct MemoryStruct;
+
+struct Staging* stagingOpen(const char* targetdir);
+void stagingClose(struct Staging*);
+
+const char* stagingDir(const struct Staging*);
+bool stagingAdd(struct Staging*, const char* URL, const char* path);
+bool stagingFetch(struct Staging*);
+
+bool stagingResolve(struct Staging*, const char* path, bool modify, char* resolved, size_t size);
+const struct MemoryStruct* stagingMemory(struct Staging*, const char* path);
+
+#endif
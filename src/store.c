@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "store.h"
+#include "memory.h"
+#include "net.h"
+#include "common.h"
+#include "config.h"
+#include "metrics.h"
+
+/*
+ * content addressed download store in <cache dir>/store
+ *   objects/<sha256>  file contents, mtime is the last use
+ *   keys/<hash>       url, validator (ETag) and sha256 of an object
+ * several keys may point at the same object
+ */
+
+// false if the path did not fit into `buffer'
+static bool getStorePath(char* buffer, size_t size, const char* subdir, const char* name)
+{
+    char cachedir[PATH_MAX];
+    getCacheDir(cachedir, sizeof(cachedir));
+
+    return snprintf(buffer, size, "%s/store/%s/%s", cachedir, subdir, name) < size;
+}
+
+static bool getKeyPath(char* buffer, size_t size, const char* URL)
+{
+    char name[17];
+    snprintf(name, sizeof(name), "%016" PRIx64, hashString(URL));
+
+    return getStorePath(buffer, size, "keys", name);
+}
+
+static void makeStoreDirs(void)
+{
+    char path[PATH_MAX + NAME_MAX];
+
+    getStorePath(path, sizeof(path), "objects", "");
+    makePath(path);
+    getStorePath(path, sizeof(path), "keys", "");
+    makePath(path);
+}
+
+static bool readKey(const char* URL, char* etag, size_t etagsize, char sha[SHA256_HEX_SIZE])
+{
+    char path[PATH_MAX + NAME_MAX], line[PATH_MAX + 8], url[PATH_MAX] = {0};
+    FILE* file;
+
+    if (!getKeyPath(path, sizeof(path), URL) || !(file = fopen(path, "r"))) return false;
+
+    etag[0] = '\0';
+    sha[0] = '\0';
+    while (fgets(line, sizeof(line), file))
+    {
+        readKeyValue(line, "url", url, sizeof(url));
+        readKeyValue(line, "etag", etag, etagsize);
+        readKeyValue(line, "sha256", sha, SHA256_HEX_SIZE);
+    }
+    fclose(file);
+
+    return !strcmp(url, URL) && strlen(sha) == SHA256_HEX_SIZE - 1;
+}
+
+static bool writeKey(const char* URL, const char* etag, const char* sha)
+{
+    char path[PATH_MAX + NAME_MAX], temp[PATH_MAX + NAME_MAX + 16];
+
+    if (!getKeyPath(path, sizeof(path), URL)) return false;
+    snprintf(temp, sizeof(temp), "%s.%i", path, getpid());
+
+    FILE* file = fopen(temp, "w");
+    if (!file) return false;
+
+    fprintf(file, "url %s\netag %s\nsha256 %s\n", URL, etag ? etag : "", sha);
+
+    if (fclose(file) || rename(temp, path))
+    {
+        unlink(temp);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * finds the object stored for `URL', if the key has a validator and we
+ * are online a HEAD request makes sure the server still has that version
+ */
+static bool findObject(const char* URL, char* path, size_t size, char sha[SHA256_HEX_SIZE])
+{
+    char etag[256];
+
+    if (!readKey(URL, etag, sizeof(etag), sha)) return false;
+
+    if (!getStorePath(path, size, "objects", sha) || !isFile(path)) return false;
+
+    if (etag[0] && !netIsOffline())
+    {
+        char current[256];
+
+        if (requestETag(URL, current, sizeof(current)) && current[0] && strcmp(current, etag)) return false;
+    }
+
+    // mtime is what the LRU trim goes by
+    utimensat(AT_FDCWD, path, NULL, 0);
+
+    return true;
+}
+
+bool storeLookup(const char* URL, char* path, size_t size, char sha[SHA256_HEX_SIZE])
+{
+    if (!findObject(URL, path, size, sha))
+    {
+        metricsAdd(METRIC_CACHE_MISSES, 1);
+        return false;
+    }
+
+    metricsAdd(METRIC_CACHE_HITS, 1);
+    metricsAdd(METRIC_CACHED, getStat(path).st_size);
+
+    return true;
+}
+
+// the object with contents `sha', no matter which url it came from or whether that still serves it
+bool storeFind(const char* sha, char* path, size_t size)
+{
+    if (!sha[0] || !getStorePath(path, size, "objects", sha) || !isFile(path)) return false;
+
+    utimensat(AT_FDCWD, path, NULL, 0);
+
+    return true;
+}
+
+struct MemoryStruct* storeLoad(const char* URL)
+{
+    char path[PATH_MAX + NAME_MAX], sha[SHA256_HEX_SIZE];
+    struct MemoryStruct* mem = NULL;
+    struct stat sb;
+    FILE* file;
+
+    if (!storeLookup(URL, path, sizeof(path), sha)) return NULL;
+    if (!(file = fopen(path, "rb"))) return NULL;
+
+    if (!fstat(fileno(file), &sb) && (mem = memoryNew()) && memoryReserve(mem, sb.st_size ? sb.st_size : 1))
+    {
+        mem->tail->size = fread(mem->tail->data, 1, sb.st_size, file);
+        mem->size = mem->tail->size;
+
+        if (mem->size != (size_t)sb.st_size)
+        {
+            memoryFree(mem);
+            mem = NULL;
+        }
+    }
+    fclose(file);
+
+    return mem;
+}
+
+/*
+ * moves `file' into the store as object `sha', identical content
+ * fetched from another URL is kept only once
+ */
+bool storeInsertFile(const char* URL, const char* etag, const char* sha, const char* file, char* path, size_t size)
+{
+    makeStoreDirs();
+
+    if (!getStorePath(path, size, "objects", sha)) return false;
+
+    if (isFile(path)) unlink(file);
+    else if (rename(file, path)) return false;
+
+    utimensat(AT_FDCWD, path, NULL, 0);
+
+    if (!writeKey(URL, etag, sha)) return false;
+
+    storeTrim(storeBudget(), true);
+
+    return true;
+}
+
+bool storeInsertMemory(const char* URL, const char* etag, const struct MemoryStruct* mem)
+{
+    char temp[PATH_MAX + NAME_MAX], path[PATH_MAX + NAME_MAX], hex[SHA256_HEX_SIZE];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    struct sha256 ctx;
+    bool success = true;
+
+    makeStoreDirs();
+
+    getStorePath(temp, sizeof(temp), "objects", "");
+    snprintf(temp + strlen(temp), sizeof(temp) - strlen(temp), ".insert.%i", getpid());
+
+    FILE* file = fopen(temp, "wb");
+    if (!file) return false;
+
+    sha256Init(&ctx);
+    for (struct MemoryChunk* chunk = mem->head; chunk && success; chunk = chunk->next)
+    {
+        sha256Update(&ctx, chunk->data, chunk->size);
+        success = fwrite(chunk->data, 1, chunk->size, file) == chunk->size;
+    }
+    sha256Final(&ctx, digest);
+    sha256Hex(digest, hex);
+
+    if (fclose(file) || !success)
+    {
+        unlink(temp);
+        return false;
+    }
+
+    return storeInsertFile(URL, etag, hex, temp, path, sizeof(path));
+}
+
+/*
+ * keeps a copy of `file', which stays where it is,
+ * a reflink when it is on the file system of the store
+ */
+bool storeInsertCopy(const char* URL, const char* etag, const char* sha, const char* file)
+{
+    char temp[PATH_MAX + NAME_MAX], path[PATH_MAX + NAME_MAX];
+
+    if ((uint64_t)getStat(file).st_size > storeBudget()) return false;
+
+    makeStoreDirs();
+
+    getStorePath(temp, sizeof(temp), "objects", "");
+    snprintf(temp + strlen(temp), sizeof(temp) - strlen(temp), ".insert.%i", getpid());
+
+    if (!copyFile(file, temp, 0644))
+    {
+        unlink(temp);
+        return false;
+    }
+
+    return storeInsertFile(URL, etag, sha, temp, path, sizeof(path));
+}
+
+uint64_t storeBudget(void)
+{
+    long budget = getConfigNumber("POLECAT_CACHE_SIZE", 4096);
+
+    return budget < 0 ? 0 : (uint64_t)budget * 1024 * 1024;
+}
+
+struct storeObject {
+    char name[SHA256_HEX_SIZE];
+    time_t used;
+    uint64_t size;
+};
+
+static int compareObjects(const void* a, const void* b)
+{
+    const struct storeObject* x = a;
+    const struct storeObject* y = b;
+
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+// drops keys whose object is gone
+static void pruneKeys(void)
+{
+    char dirpath[PATH_MAX + NAME_MAX], path[PATH_MAX + NAME_MAX + 256], line[PATH_MAX + 8], sha[SHA256_HEX_SIZE], object[PATH_MAX + NAME_MAX];
+    struct dirent* ent;
+    DIR* dir;
+
+    getStorePath(dirpath, sizeof(dirpath), "keys", "");
+    if (!(dir = opendir(dirpath))) return;
+
+    while ((ent = readdir(dir)))
+    {
+        if (ent->d_name[0] == '.') continue;
+
+        snprintf(path, sizeof(path), "%s%s", dirpath, ent->d_name);
+        FILE* file = fopen(path, "r");
+        if (!file) continue;
+
+        sha[0] = '\0';
+        while (fgets(line, sizeof(line), file)) readKeyValue(line, "sha256", sha, sizeof(sha));
+        fclose(file);
+
+        getStorePath(object, sizeof(object), "objects", sha);
+        if (!sha[0] || !isFile(object)) unlink(path);
+    }
+
+    closedir(dir);
+}
+
+/*
+ * removes least recently used objects until the store fits
+ * into `budget' bytes, returns the number of bytes freed
+ */
+uint64_t storeTrim(uint64_t budget, bool keepNewest)
+{
+    char dirpath[PATH_MAX + NAME_MAX], path[PATH_MAX + NAME_MAX + 256];
+    struct storeObject* objects = NULL;
+    size_t count = 0, capacity = 0;
+    uint64_t total = 0, freed = 0;
+    struct dirent* ent;
+    DIR* dir;
+
+    getStorePath(dirpath, sizeof(dirpath), "objects", "");
+    if (!(dir = opendir(dirpath))) return 0;
+
+    while ((ent = readdir(dir)))
+    {
+        struct stat sb;
+
+        if (strlen(ent->d_name) != SHA256_HEX_SIZE - 1) continue;
+
+        snprintf(path, sizeof(path), "%s%s", dirpath, ent->d_name);
+        if (stat(path, &sb) || !S_ISREG(sb.st_mode)) continue;
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            struct storeObject* grown = realloc(objects, capacity * sizeof(struct storeObject));
+            if (!grown) break;
+            objects = grown;
+        }
+
+        strcpy(objects[count].name, ent->d_name);
+        objects[count].used = sb.st_mtime;
+        objects[count].size = sb.st_blocks * 512;
+        total += objects[count].size;
+        ++count;
+    }
+    closedir(dir);
+
+    if (total > budget)
+    {
+        qsort(objects, count, sizeof(struct storeObject), compareObjects);
+
+        // right after an insert the newest object is about to be used, it stays even if it alone is over budget
+        if (keepNewest && count) --count;
+
+        for (size_t i = 0; i < count && total > budget; ++i)
+        {
+            snprintf(path, sizeof(path), "%s%s", dirpath, objects[i].name);
+            if (!unlink(path))
+            {
+                total -= objects[i].size;
+                freed += objects[i].size;
+            }
+        }
+
+        pruneKeys();
+    }
+
+    free(objects);
+
+    return freed;
+}
@@ -0,0 +1,23 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sha256.h"
+
+struct MemoryStruct;
+
+bool storeLookup(const char* URL, char* path, size_t size, char sha[SHA256_HEX_SIZE]);
+bool storeFind(const char* sha, char* path, size_t size);
+struct MemoryStruct* storeLoad(const char* URL);
+
+bool storeInsertFile(const char* URL, const char* etag, const char* sha, const char* file, char* path, size_t size);
+bool storeInsertMemory(const char* URL, const char* etag, const struct MemoryStruct*);
+bool storeInsertCopy(const char* URL, const char* etag, const char* sha, const char* file);
+
+uint64_t storeTrim(uint64_t budget, bool keepNewest);
+uint64_t storeBudget(void);
+
+#endif
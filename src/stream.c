@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "stream.h"
+
+struct Stream* streamNew(void)
+{
+    struct Stream* stream = calloc(1, sizeof(struct Stream));
+
+    if (stream)
+    {
+        pthread_mutex_init(&stream->lock, NULL);
+        pthread_cond_init(&stream->readable, NULL);
+        pthread_cond_init(&stream->writable, NULL);
+    }
+
+    return stream;
+}
+
+void streamFree(struct Stream* stream)
+{
+    if (stream)
+    {
+        for (size_t i = 0; i < STREAM_BLOCK_COUNT; ++i) free(stream->blocks[i]);
+
+        pthread_cond_destroy(&stream->writable);
+        pthread_cond_destroy(&stream->readable);
+        pthread_mutex_destroy(&stream->lock);
+        free(stream);
+    }
+}
+
+/*
+ * waits until the block after the published ones is free
+ * and returns its index, or -1 if the consumer went away
+ */
+static ssize_t waitForBlock(struct Stream* stream)
+{
+    ssize_t index = -1;
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->count == STREAM_BLOCK_COUNT && !stream->aborted)
+    {
+        pthread_cond_wait(&stream->writable, &stream->lock);
+    }
+
+    if (!stream->aborted) index = (stream->head + stream->count) % STREAM_BLOCK_COUNT;
+    pthread_mutex_unlock(&stream->lock);
+
+    return index;
+}
+
+static void publishBlock(struct Stream* stream, size_t index)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->sizes[index] = stream->fill;
+    stream->count++;
+    stream->fill = 0;
+    pthread_cond_signal(&stream->readable);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+size_t streamWrite(struct Stream* stream, const void* data, size_t size)
+{
+    const uint8_t* source = data;
+    size_t written = 0;
+
+    while (written < size)
+    {
+        ssize_t index = waitForBlock(stream);
+        if (index < 0) return 0;
+
+        if (!stream->blocks[index])
+        {
+            stream->blocks[index] = malloc(STREAM_BLOCK_SIZE);
+            if (!stream->blocks[index]) return 0;
+        }
+
+        size_t amount = STREAM_BLOCK_SIZE - stream->fill;
+        if (amount > size - written) amount = size - written;
+
+        memcpy(stream->blocks[index] + stream->fill, source + written, amount);
+        stream->fill += amount;
+        written += amount;
+
+        if (stream->fill == STREAM_BLOCK_SIZE) publishBlock(stream, index);
+    }
+
+    return written;
+}
+
+void streamClose(struct Stream* stream, bool failed)
+{
+    if (stream->fill && !failed)
+    {
+        ssize_t index = waitForBlock(stream);
+        if (index >= 0) publishBlock(stream, index);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    stream->closed = true;
+    stream->failed = failed;
+    pthread_cond_broadcast(&stream->readable);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+ssize_t streamRead(struct Stream* stream, const void** buffer)
+{
+    ssize_t size;
+
+    pthread_mutex_lock(&stream->lock);
+
+    // the block handed out by the previous call may be reused now
+    if (stream->reading)
+    {
+        stream->head = (stream->head + 1) % STREAM_BLOCK_COUNT;
+        stream->count--;
+        stream->reading = false;
+        pthread_cond_signal(&stream->writable);
+    }
+
+    while (!stream->count && !stream->closed)
+    {
+        pthread_cond_wait(&stream->readable, &stream->lock);
+    }
+
+    if (stream->count)
+    {
+        stream->reading = true;
+        *buffer = stream->blocks[stream->head];
+        size = stream->sizes[stream->head];
+    }
+    else
+    {
+        *buffer = NULL;
+        size = stream->failed ? -1 : 0;
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+
+    return size;
+}
+
+void streamAbort(struct Stream* stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->aborted = true;
+    pthread_cond_broadcast(&stream->writable);
+    pthread_mutex_unlock(&stream->lock);
+}
@@ -0,0 +1,45 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define STREAM_BLOCK_SIZE  (64 * 1024)
+#define STREAM_BLOCK_COUNT 32
+
+/*
+ * bounded single producer / single consumer ring of fixed size blocks
+ * the producer (a curl write callback) blocks once all blocks are full,
+ * so memory use never exceeds STREAM_BLOCK_COUNT * STREAM_BLOCK_SIZE
+ */
+struct Stream {
+    uint8_t* blocks[STREAM_BLOCK_COUNT];
+    size_t sizes[STREAM_BLOCK_COUNT];
+
+    size_t head;
+    size_t count;
+    size_t fill;
+    bool reading;
+
+    bool closed;
+    bool failed;
+    bool aborted;
+
+    pthread_mutex_t lock;
+    pthread_cond_t readable;
+    pthread_cond_t writable;
+};
+
+struct Stream* streamNew(void);
+void streamFree(struct Stream*);
+
+size_t streamWrite(struct Stream*, const void*, size_t);
+void streamClose(struct Stream*, bool failed);
+
+ssize_t streamRead(struct Stream*, const void**);
+void streamAbort(struct Stream*);
+
+#endif
@@ -1,14 +1,42 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <archive.h>
 #include <archive_entry.h>
-#include <fcntl.h> 
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
 #include <linux/limits.h>
 
 #include "common.h"
+#include "config.h"
+#include "stream.h"
+#include "decompress.h"
+#include "dedupe.h"
+#include "sha256.h"
+#include "net.h"
 #include "tar.h"
+#include "trace.h"
+#include "metrics.h"
 
-static int copy_data(struct archive* ar, struct archive* aw)
+// holes of sparse files hash as the zeros they read back as
+static void hashZeros(struct sha256* hash, uint64_t until)
+{
+    static const uint8_t zeros[4096];
+
+    while (hash->length < until)
+    {
+        size_t amount = until - hash->length < sizeof(zeros) ? until - hash->length : sizeof(zeros);
+        sha256Update(hash, zeros, amount);
+    }
+}
+
+static int copy_data(struct archive* ar, struct archive* aw, struct sha256* hash)
 {
   int r;
   const void *buff;
@@ -19,53 +47,650 @@ static int copy_data(struct archive* ar, struct archive* aw)
     r = archive_read_data_block(ar, &buff, &size, &offset);
     if (r == ARCHIVE_EOF)
       return (ARCHIVE_OK);
-    if (r < ARCHIVE_OK)
+    if (r < ARCHIVE_OK) {
+      printf("%s\n", archive_error_string(ar));
       return (r);
+    }
     r = archive_write_data_block(aw, buff, size, offset);
     if (r < ARCHIVE_OK) {
       printf("%s\n", archive_error_string(aw));
       return (r);
     }
+    if (hash) {
+      hashZeros(hash, offset);
+      sha256Update(hash, buff, size);
+    }
   }
 }
 
-void extract(const struct MemoryStruct* tar, const char* outputdir)
+static ssize_t streamSource(void* data, const void** buffer)
+{
+    return streamRead((struct Stream*)data, buffer);
+}
+
+static ssize_t memorySource(void* data, const void** buffer)
+{
+    const struct MemoryChunk** chunk = data;
+
+    if (!*chunk) return 0;
+
+    *buffer = (*chunk)->data;
+    ssize_t size = (*chunk)->size;
+    *chunk = (*chunk)->next;
+
+    return size;
+}
+
+struct fileSource {
+    int fd;
+    uint8_t buffer[STREAM_BLOCK_SIZE];
+};
+
+static ssize_t fileSource(void* data, const void** buffer)
+{
+    struct fileSource* file = data;
+    ssize_t size;
+
+    do size = read(file->fd, file->buffer, sizeof(file->buffer));
+    while (size < 0 && errno == EINTR);
+
+    *buffer = file->buffer;
+
+    return size;
+}
+
+static la_ssize_t decompressReadCallback(struct archive* a, void* client_data, const void** buffer)
+{
+    ssize_t size = decompressorRead((struct Decompressor*)client_data, buffer);
+
+    if (size < 0)
+    {
+        archive_set_error(a, EIO, "reading the archive failed");
+        return ARCHIVE_FATAL;
+    }
+
+    return size;
+}
+
+#define WRITE_BUDGET      (64 * 1024 * 1024)
+#define WRITE_MAX_BUFFERED (8 * 1024 * 1024)
+#define WRITE_MAX_THREADS 16
+
+/*
+ * regular files are decompressed into memory by the reader
+ * and handed to a pool of writers, so the open/write/utimes/chmod
+ * syscalls of many small files no longer serialize behind the decompressor
+ */
+struct writeJob {
+    struct writeJob* next;
+    struct archive_entry* entry;
+    uint8_t* data;
+    size_t size;
+};
+
+struct writePool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+
+    struct writeJob* head;
+    struct writeJob* tail;
+    size_t queued;
+    size_t busy;
+
+    bool closing;
+    bool failed;
+    int flags;
+    const char* store;
+    extractHashed hashed;
+    void* data;
+    size_t prefix;                      // of entry paths, the staging directory
+
+    // hashes of the paths queued since the last drain, only the reader uses them
+    uint64_t* pending;
+    size_t pendingcount;
+    size_t pendingcapacity;
+    bool untracked;                     // a path could not be recorded
+};
+
+static struct archive* newWriter(int flags)
+{
+    struct archive* ext = archive_write_disk_new();
+    archive_write_disk_set_options(ext, flags);
+    archive_write_disk_set_standard_lookup(ext);
+
+    return ext;
+}
+
+static bool wantsHash(const struct writePool* pool)
+{
+    return pool->store || pool->hashed;
+}
+
+// the hash of a file written by now goes to the dedupe store and `hashed'
+static void hashedEntry(const struct writePool* pool, struct archive_entry* entry, struct sha256* hash)
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+    const char* path = archive_entry_pathname(entry);
+
+    hashZeros(hash, archive_entry_size(entry));
+    sha256Final(hash, digest);
+    sha256Hex(digest, hex);
+
+    if (pool->store && archive_entry_size(entry) > 0) dedupeFile(pool->store, path, hex);
+    if (pool->hashed) pool->hashed(path + pool->prefix, hex, archive_entry_size(entry), pool->data);
+}
+
+static bool writeJob(struct archive* ext, struct writeJob* job, const struct writePool* pool)
+{
+    uint64_t span = traceStart();
+    int r = archive_write_header(ext, job->entry);
+
+    if (r < ARCHIVE_OK)
+        printf("%s\n", archive_error_string(ext));
+
+    if (r >= ARCHIVE_WARN && job->size)
+    {
+        r = archive_write_data_block(ext, job->data, job->size, 0);
+        if (r < ARCHIVE_OK)
+            printf("%s\n", archive_error_string(ext));
+    }
+
+    if (r >= ARCHIVE_WARN)
+    {
+        r = archive_write_finish_entry(ext);
+        if (r < ARCHIVE_OK)
+            printf("%s\n", archive_error_string(ext));
+    }
+
+    if (r >= ARCHIVE_WARN && wantsHash(pool))
+    {
+        struct sha256 hash;
+
+        sha256Init(&hash);
+        if (job->size) sha256Update(&hash, job->data, job->size);
+        hashedEntry(pool, job->entry, &hash);
+    }
+
+    traceEnd("disk", "write", span, archive_entry_pathname(job->entry));
+
+    return r >= ARCHIVE_WARN;
+}
+
+static void* writeWorker(void* data)
+{
+    struct writePool* pool = data;
+    struct archive* ext = newWriter(pool->flags);
+
+    traceThread("extract writer");
+
+    for (;;)
+    {
+        struct writeJob* job;
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->head && !pool->closing) pthread_cond_wait(&pool->ready, &pool->lock);
+
+        job = pool->head;
+        if (job)
+        {
+            pool->head = job->next;
+            if (!pool->head) pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!job) break;
+
+        bool success = writeJob(ext, job, pool);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->queued -= job->size;
+        pool->busy--;
+        if (!success) pool->failed = true;
+        pthread_cond_broadcast(&pool->space);
+        pthread_mutex_unlock(&pool->lock);
+
+        archive_entry_free(job->entry);
+        free(job->data);
+        free(job);
+    }
+
+    archive_write_close(ext);
+    archive_write_free(ext);
+
+    return NULL;
+}
+
+// blocks while too much data is in flight, false once a writer failed
+static bool submitJob(struct writePool* pool, struct writeJob* job)
+{
+    bool failed;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->failed && pool->busy && pool->queued + job->size > WRITE_BUDGET)
+    {
+        pthread_cond_wait(&pool->space, &pool->lock);
+    }
+
+    failed = pool->failed;
+    if (!failed)
+    {
+        job->next = NULL;
+        if (pool->tail) pool->tail->next = job;
+        else pool->head = job;
+        pool->tail = job;
+
+        pool->queued += job->size;
+        pool->busy++;
+        pthread_cond_signal(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return !failed;
+}
+
+// waits for every queued write, false if any of them failed
+static bool drainPool(struct writePool* pool)
+{
+    bool failed;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy) pthread_cond_wait(&pool->space, &pool->lock);
+    failed = pool->failed;
+    pthread_mutex_unlock(&pool->lock);
+
+    memset(pool->pending, 0, pool->pendingcapacity * sizeof(uint64_t));
+    pool->pendingcount = 0;
+    pool->untracked = false;
+
+    return !failed;
+}
+
+/*
+ * an archive may carry a path twice, an appended update for example,
+ * the later copy must not be overtaken by a writer still on the older one
+ * open addressing on the path hash, a collision only costs a needless drain
+ */
+static bool isPending(const struct writePool* pool, const char* path)
 {
-    char cwd[PATH_MAX];
-    void* err = getcwd(cwd, sizeof(cwd));
+    uint64_t key = hashString(path) | 1;
+
+    if (pool->untracked) return true;
+    if (!pool->pendingcapacity) return false;
 
-    if (chdir(outputdir) < 0)
+    for (size_t i = key & (pool->pendingcapacity - 1); pool->pending[i]; i = (i + 1) & (pool->pendingcapacity - 1))
     {
-        printf("Cannot change to %s\n", outputdir);
+        if (pool->pending[i] == key) return true;
+    }
+
+    return false;
+}
+
+static void addPending(struct writePool* pool, const char* path)
+{
+    uint64_t key = hashString(path) | 1;
+
+    if (pool->untracked) return;
+
+    // kept at most half full
+    if ((pool->pendingcount + 1) * 2 > pool->pendingcapacity)
+    {
+        size_t capacity = pool->pendingcapacity ? pool->pendingcapacity * 2 : 1024;
+        uint64_t* grown = calloc(capacity, sizeof(uint64_t));
+
+        if (!grown)
+        {
+            pool->untracked = true;
+            return;
+        }
+
+        for (size_t i = 0; i < pool->pendingcapacity; ++i)
+        {
+            if (!pool->pending[i]) continue;
+
+            size_t j = pool->pending[i] & (capacity - 1);
+            while (grown[j]) j = (j + 1) & (capacity - 1);
+            grown[j] = pool->pending[i];
+        }
+
+        free(pool->pending);
+        pool->pending = grown;
+        pool->pendingcapacity = capacity;
+    }
+
+    size_t i = key & (pool->pendingcapacity - 1);
+    while (pool->pending[i] && pool->pending[i] != key) i = (i + 1) & (pool->pendingcapacity - 1);
+
+    if (!pool->pending[i]) pool->pendingcount++;
+    pool->pending[i] = key;
+}
+
+static struct writeJob* readJob(struct archive* a, struct archive_entry* entry)
+{
+    struct writeJob* job = calloc(1, sizeof(struct writeJob));
+    const void* buff;
+    size_t size;
+    la_int64_t offset;
+    int r;
+
+    if (!job) return NULL;
+
+    job->size = archive_entry_size(entry);
+    job->data = job->size ? calloc(1, job->size) : NULL;
+
+    if (job->size && !job->data)
+    {
+        free(job);
+        return NULL;
+    }
+
+    // holes of sparse files stay zero
+    while ((r = archive_read_data_block(a, &buff, &size, &offset)) == ARCHIVE_OK)
+    {
+        if (offset < 0 || (size_t)offset + size > job->size)
+        {
+            r = ARCHIVE_FATAL;
+            break;
+        }
+        memcpy(job->data + offset, buff, size);
+    }
+
+    if (r != ARCHIVE_EOF)
+    {
+        if (r < ARCHIVE_OK) printf("%s\n", archive_error_string(a));
+        else puts("archive entry does not match its size");
+
+        free(job->data);
+        free(job);
+        return NULL;
+    }
+
+    job->entry = archive_entry_clone(entry);
+
+    return job;
+}
+
+/*
+ * entries are written below a staging directory inside the target
+ * and only moved into place once the whole archive was extracted,
+ * so a failed extraction leaves nothing behind. No chdir, every
+ * path is prefixed, which makes extracting on many threads at once safe
+ * the staging directory stays locked while it is in use, one that is
+ * not was left by a crash or ^C and is removed by the next extraction
+ */
+#define STAGING_PREFIX ".polecat-"
+#define STAGING_ATTEMPTS 3
+
+struct extractTarget {
+    int dirfd;
+    int lockfd;                         // the staging directory, flocked
+    char staging[PATH_MAX];
+    const char* name;
+};
+
+static void sweepStaging(int dirfd)
+{
+    int fd = dup(dirfd);
+    DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+    struct dirent* entry;
+
+    if (!dir)
+    {
+        if (fd >= 0) close(fd);
         return;
     }
 
-    struct archive* a;
+    while ((entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, STAGING_PREFIX, strlen(STAGING_PREFIX))) continue;
+
+        int lockfd = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (lockfd < 0) continue;
+
+        if (!flock(lockfd, LOCK_EX | LOCK_NB)) removeAt(dirfd, entry->d_name);
+        close(lockfd);
+    }
+
+    closedir(dir);
+}
+
+static bool openTarget(struct extractTarget* target, const char* outputdir)
+{
+    target->dirfd = open(outputdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (target->dirfd < 0)
+    {
+        printf("Cannot open %s\n", outputdir);
+        return false;
+    }
+
+    sweepStaging(target->dirfd);
+
+    // another sweep may take a new directory before it is locked, then it is made again
+    for (int attempt = 0; attempt < STAGING_ATTEMPTS; ++attempt)
+    {
+        struct stat sb;
+
+        snprintf(target->staging, sizeof(target->staging), "%s/" STAGING_PREFIX "XXXXXX", outputdir);
+        if (!mkdtemp(target->staging)) break;
+
+        target->name = strrchr(target->staging, '/') + 1;
+        target->lockfd = openat(target->dirfd, target->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+        if (target->lockfd >= 0 && !flock(target->lockfd, LOCK_EX) && !fstat(target->lockfd, &sb) && sb.st_nlink) return true;
+
+        if (target->lockfd >= 0) close(target->lockfd);
+    }
+
+    printf("Cannot create a staging directory in %s\n", outputdir);
+    close(target->dirfd);
+
+    return false;
+}
+
+static bool prefixPath(const struct extractTarget* target, const char* name, char* path)
+{
+    // absolute entries end up inside the target as well
+    while (*name == '/') ++name;
+
+    return snprintf(path, PATH_MAX, "%s/%s", target->staging, name) < PATH_MAX;
+}
+
+static bool prefixEntry(const struct extractTarget* target, struct archive_entry* entry)
+{
+    char path[PATH_MAX];
+
+    if (!prefixPath(target, archive_entry_pathname(entry), path)) return false;
+    archive_entry_copy_pathname(entry, path);
+
+    if (archive_entry_hardlink(entry))
+    {
+        if (!prefixPath(target, archive_entry_hardlink(entry), path)) return false;
+        archive_entry_copy_hardlink(entry, path);
+    }
+
+    return true;
+}
+
+static bool mergeEntry(int fromfd, int tofd, const char* name);
+
+static bool mergeTree(int fromfd, int tofd, const char* name)
+{
+    int from = openat(fromfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int to = openat(tofd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = from < 0 || to < 0 ? NULL : fdopendir(from);
+    struct dirent* entry;
+    bool success = true;
+
+    if (!dir)
+    {
+        if (from >= 0) close(from);
+        if (to >= 0) close(to);
+        return false;
+    }
+
+    while (success && (entry = readdir(dir)))
+    {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) success = mergeEntry(from, to, entry->d_name);
+    }
+
+    closedir(dir);
+    close(to);
+
+    return success;
+}
+
+// moves `name' over what is in place, directories on both sides are merged
+static bool mergeEntry(int fromfd, int tofd, const char* name)
+{
+    struct stat from, to;
+
+    if (!renameat2(fromfd, name, tofd, name, RENAME_NOREPLACE)) return true;
+
+    // without renameat2 on this file system the target is looked at by hand
+    if (fstatat(tofd, name, &to, AT_SYMLINK_NOFOLLOW) < 0 || fstatat(fromfd, name, &from, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+        if (errno == ENOENT && !renameat(fromfd, name, tofd, name)) return true;
+    }
+    else if (S_ISDIR(from.st_mode) && S_ISDIR(to.st_mode))
+    {
+        return mergeTree(fromfd, tofd, name);
+    }
+    else
+    {
+        // rename only replaces a file with a file and a directory with an empty one
+        if (S_ISDIR(from.st_mode) || S_ISDIR(to.st_mode)) removeAt(tofd, name);
+        if (!renameat(fromfd, name, tofd, name)) return true;
+    }
+
+    printf("Cannot move %s into place: %s\n", name, strerror(errno));
+
+    return false;
+}
+
+/*
+ * moves everything from the staging directory into the target
+ * merged with what is there, with `replace' top level entries
+ * replace what was there as a whole
+ */
+static bool commitTarget(const struct extractTarget* target, struct ExtractResult* result, bool replace)
+{
+    int fd = openat(target->dirfd, target->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+    struct dirent* entry;
+    bool success = true;
+
+    if (!dir)
+    {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    while (success && (entry = readdir(dir)))
+    {
+        const char* name = entry->d_name;
+
+        if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+
+        if (result && !result->root[0])
+        {
+            struct stat sb;
+
+            if (!fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) && S_ISDIR(sb.st_mode))
+                snprintf(result->root, sizeof(result->root), "%s", name);
+        }
+
+        if (!replace)
+        {
+            success = mergeEntry(fd, target->dirfd, name);
+            continue;
+        }
+
+        if (!renameat2(fd, name, target->dirfd, name, RENAME_NOREPLACE)) continue;
+
+        // the old version is swapped into the staging directory and removed with it
+        if (errno == EEXIST && !renameat2(fd, name, target->dirfd, name, RENAME_EXCHANGE)) continue;
+
+        // no renameat2 on this file system
+        if (errno != EEXIST) removeAt(target->dirfd, name);
+
+        if (renameat(fd, name, target->dirfd, name) < 0)
+        {
+            printf("Cannot move %s into place: %s\n", name, strerror(errno));
+            success = false;
+        }
+    }
+
+    closedir(dir);
+
+    return success;
+}
+
+static void closeTarget(struct extractTarget* target)
+{
+    removeAt(target->dirfd, target->name);
+    close(target->lockfd);
+    close(target->dirfd);
+}
+
+static bool extractArchive(struct archive* a, struct Decompressor* source, const char* outputdir, const struct ExtractOptions* options)
+{
+    struct extractTarget target;
+
+    if (!openTarget(&target, outputdir)) return false;
+
     struct archive* ext;
     struct archive_entry* entry;
+    struct writePool pool;
+    pthread_t threads[WRITE_MAX_THREADS];
+    size_t threadcount = 0, entries = 0;
+    uint64_t bytes = 0;
+    struct timespec start, end;
     int flags, r;
+    bool success = false;
 
     /* Select which attributes we want to restore. */
     flags = ARCHIVE_EXTRACT_TIME;
     flags |= ARCHIVE_EXTRACT_PERM;
     flags |= ARCHIVE_EXTRACT_ACL;
     flags |= ARCHIVE_EXTRACT_FFLAGS;
+    flags |= ARCHIVE_EXTRACT_SECURE_NODOTDOT;
 
-    a = archive_read_new();
-    archive_read_support_format_all(a);
-    archive_read_support_filter_all(a);
+    // directories, links and big files are written here, in archive order
+    ext = newWriter(flags);
 
-    ext = archive_write_disk_new();
-    archive_write_disk_set_options(ext, flags);
-    archive_write_disk_set_standard_lookup(ext);
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.ready, NULL);
+    pthread_cond_init(&pool.space, NULL);
+    pool.flags = flags;
+    pool.store = options ? options->store : NULL;
+    pool.hashed = options ? options->hashed : NULL;
+    pool.data = options ? options->data : NULL;
+    pool.prefix = strlen(target.staging) + 1;
 
-    if ((r = archive_read_open_memory(a, tar->memory, tar->size))) return;
+    long threadwanted = getConfigNumber("POLECAT_EXTRACT_THREADS", sysconf(_SC_NPROCESSORS_ONLN));
+    if (threadwanted > WRITE_MAX_THREADS) threadwanted = WRITE_MAX_THREADS;
+
+    for (long i = 0; i < threadwanted; ++i)
+    {
+        if (pthread_create(&threads[threadcount], NULL, writeWorker, &pool)) break;
+        ++threadcount;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t extractSpan = traceStart();
 
     for (;;)
     {
+        uint64_t span = traceStart();
+
         r = archive_read_next_header(a, &entry);
+        traceEnd("archive", "header", span, NULL);
+
         if (r == ARCHIVE_EOF)
         {
+            success = true;
             break;
         }
 
@@ -76,9 +701,52 @@ void extract(const struct MemoryStruct* tar, const char* outputdir)
 
         if (r < ARCHIVE_WARN)
         {
-            return;
+            break;
+        }
+
+        if (!prefixEntry(&target, entry))
+        {
+            printf("Path too long: %s\n", archive_entry_pathname(entry));
+            break;
+        }
+
+        ++entries;
+        bytes += archive_entry_size(entry);
+
+        // whatever comes next for this path waits for the older copy
+        if (threadcount && isPending(&pool, archive_entry_pathname(entry)) && !drainPool(&pool)) break;
+
+        if (threadcount && archive_entry_filetype(entry) == AE_IFREG && !archive_entry_hardlink(entry)
+            && archive_entry_size(entry) <= WRITE_MAX_BUFFERED)
+        {
+            span = traceStart();
+            struct writeJob* job = readJob(a, entry);
+            traceEnd("archive", "read", span, archive_entry_pathname(entry));
+
+            if (!job) break;
+
+            addPending(&pool, archive_entry_pathname(entry));
+
+            if (!submitJob(&pool, job))
+            {
+                archive_entry_free(job->entry);
+                free(job->data);
+                free(job);
+                break;
+            }
+
+            continue;
         }
 
+        // the target of a hard link has to be on disk first
+        if (archive_entry_hardlink(entry) && !drainPool(&pool)) break;
+
+        bool hashing = wantsHash(&pool) && archive_entry_filetype(entry) == AE_IFREG && !archive_entry_hardlink(entry);
+        struct sha256 hash;
+
+        sha256Init(&hash);
+        span = traceStart();
+
         r = archive_write_header(ext, entry);
         if (r < ARCHIVE_OK)
         {
@@ -86,23 +754,340 @@ void extract(const struct MemoryStruct* tar, const char* outputdir)
         }
         else if (archive_entry_size(entry) > 0)
         {
-            r = copy_data(a, ext);
-            if (r < ARCHIVE_OK)
-                printf("%s\n", archive_error_string(ext));
+            r = copy_data(a, ext, hashing ? &hash : NULL);
             if (r < ARCHIVE_WARN)
-                return;
+                break;
         }
 
         r = archive_write_finish_entry(ext);
         if (r < ARCHIVE_OK)
             printf("%s\n", archive_error_string(ext));
         if (r < ARCHIVE_WARN)
-            return;
+            break;
+
+        if (hashing) hashedEntry(&pool, entry, &hash);
+        traceEnd("disk", "write", span, archive_entry_pathname(entry));
     }
-    archive_read_close(a);
-    archive_read_free(a);
+
+    if (!drainPool(&pool)) success = false;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.closing = true;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (size_t i = 0; i < threadcount; ++i) pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&pool.space);
+    pthread_cond_destroy(&pool.ready);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.pending);
+
+    // directory times are restored here, after all files inside them are written
     archive_write_close(ext);
     archive_write_free(ext);
 
-    if (err) chdir(cwd);
+    // nothing is moved into place before the source checked out
+    if (success && !decompressorDrain(source))
+    {
+        puts("The archive could not be read to its end");
+        success = false;
+    }
+
+    uint64_t span = traceStart();
+    if (success) success = commitTarget(&target, options ? options->result : NULL, options && options->replace);
+    closeTarget(&target);
+    traceEnd("disk", "commit", span, outputdir);
+    traceEnd("archive", "extract", extractSpan, outputdir);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (success)
+    {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (seconds <= 0) seconds = 1e-9;
+
+        metricsAdd(METRIC_EXTRACTED, bytes);
+        metricsAdd(METRIC_EXTRACTED_FILES, entries);
+        metricsAdd(METRIC_EXTRACT_TIME, seconds * 1e6);
+
+        printf("Extracted %zu entries (%.1f MiB) in %.2fs, %.0f entries/s, %.1f MiB/s\n",
+               entries, bytes / 1048576.0, seconds, entries / seconds, bytes / 1048576.0 / seconds);
+    }
+
+    return success;
+}
+
+static struct archive* newReader(void)
+{
+    struct archive* a = archive_read_new();
+    archive_read_support_format_all(a);
+    archive_read_support_filter_all(a);
+
+    return a;
+}
+
+/*
+ * xz and zstd are decompressed on all cores in front of libarchive,
+ * everything else goes through its own filters
+ */
+static bool extractSource(sourceRead read, void* data, const char* outputdir, const struct ExtractOptions* options)
+{
+    struct Decompressor* decompressor = decompressorNew(read, data);
+    struct archive* a;
+    bool success = false;
+
+    if (!decompressor) return false;
+
+    a = newReader();
+
+    if (archive_read_open(a, decompressor, NULL, decompressReadCallback, NULL) == ARCHIVE_OK)
+    {
+        success = extractArchive(a, decompressor, outputdir, options);
+        archive_read_close(a);
+    }
+    else
+    {
+        printf("%s\n", archive_error_string(a));
+    }
+
+    archive_read_free(a);
+    decompressorFree(decompressor);
+
+    return success;
+}
+
+bool extract(const struct MemoryStruct* tar, const char* outputdir, const struct ExtractOptions* options)
+{
+    const struct MemoryChunk* chunk = tar->head;
+
+    return extractSource(memorySource, &chunk, outputdir, options);
+}
+
+bool extractStream(struct Stream* stream, const char* outputdir, const struct ExtractOptions* options)
+{
+    bool success = extractSource(streamSource, stream, outputdir, options);
+
+    // trailing padding or a failed read, the producer must not block on a full ring
+    streamAbort(stream);
+
+    return success;
+}
+
+bool extractFile(const char* path, const char* outputdir, const struct ExtractOptions* options)
+{
+    struct fileSource* file = malloc(sizeof(struct fileSource));
+    bool success = false;
+
+    if (!file) return false;
+
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0)
+    {
+        printf("Cannot open %s\n", path);
+    }
+    else
+    {
+        success = extractSource(fileSource, file, outputdir, options);
+        close(file->fd);
+    }
+
+    free(file);
+
+    return success;
+}
+
+static int compareMember(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// writes one entry over what is in place, false on a write error
+static bool replaceEntry(struct archive* a, struct archive* ext, struct archive_entry* entry, const struct writePool* pool)
+{
+    struct sha256 hash;
+    int r = archive_write_header(ext, entry);
+
+    sha256Init(&hash);
+
+    if (r >= ARCHIVE_WARN && archive_entry_size(entry) > 0) r = copy_data(a, ext, pool->hashed ? &hash : NULL);
+    else if (r < ARCHIVE_OK) printf("%s\n", archive_error_string(ext));
+
+    if (r >= ARCHIVE_WARN) r = archive_write_finish_entry(ext);
+    if (r < ARCHIVE_WARN) return false;
+
+    if (pool->hashed) hashedEntry(pool, entry, &hash);
+
+    return true;
+}
+
+/*
+ * extracts only the regular files in `members' (sorted with strcmp, named as
+ * in the archive) from the archive at `path' straight into `outputdir',
+ * replacing them and leaving the rest of the tree alone, for repairs
+ */
+bool extractMembers(const char* path, const char* outputdir, const char* const* members, size_t count, const struct ExtractOptions* options)
+{
+    struct fileSource* file = malloc(sizeof(struct fileSource));
+    struct Decompressor* decompressor = NULL;
+    struct archive* a = NULL, *ext = NULL;
+    struct archive_entry* entry;
+    struct writePool pool;
+    size_t found = 0;
+    bool success = true;
+    int flags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_UNLINK;
+
+#ifdef ARCHIVE_EXTRACT_SAFE_WRITES
+    // a temporary file renamed over the damaged one
+    flags |= ARCHIVE_EXTRACT_SAFE_WRITES;
+#endif
+
+    if (!file) return false;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.hashed = options ? options->hashed : NULL;
+    pool.data = options ? options->data : NULL;
+    pool.prefix = strlen(outputdir) + 1;
+
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0)
+    {
+        printf("Cannot open %s\n", path);
+        free(file);
+        return false;
+    }
+
+    if ((decompressor = decompressorNew(fileSource, file)))
+    {
+        a = newReader();
+        ext = newWriter(flags);
+
+        if (archive_read_open(a, decompressor, NULL, decompressReadCallback, NULL) != ARCHIVE_OK)
+        {
+            printf("%s\n", archive_error_string(a));
+            success = false;
+        }
+    }
+    else
+    {
+        success = false;
+    }
+
+    while (success && found < count)
+    {
+        int r = archive_read_next_header(a, &entry);
+        char target[PATH_MAX];
+        const char* name;
+
+        if (r == ARCHIVE_EOF) break;
+
+        if (r < ARCHIVE_WARN)
+        {
+            printf("%s\n", archive_error_string(a));
+            success = false;
+            break;
+        }
+
+        name = archive_entry_pathname(entry);
+        while (*name == '/') ++name;
+
+        if (archive_entry_filetype(entry) != AE_IFREG || archive_entry_hardlink(entry)
+            || !bsearch(&name, members, count, sizeof(const char*), compareMember))
+            continue;
+
+        if (snprintf(target, sizeof(target), "%s/%s", outputdir, name) >= sizeof(target))
+        {
+            printf("Path too long: %s\n", name);
+            success = false;
+            break;
+        }
+
+        archive_entry_copy_pathname(entry, target);
+        success = replaceEntry(a, ext, entry, &pool);
+        ++found;
+    }
+
+    if (success && found < count)
+    {
+        printf("%zu of the files are not in %s\n", count - found, path);
+        success = false;
+    }
+
+    if (ext)
+    {
+        archive_write_close(ext);
+        archive_write_free(ext);
+    }
+
+    if (a)
+    {
+        archive_read_close(a);
+        archive_read_free(a);
+    }
+
+    decompressorFree(decompressor);
+    close(file->fd);
+    free(file);
+
+    return success;
+}
+
+struct downloadJob {
+    const char* url;
+    struct Stream* stream;
+    struct CachedFile file;
+    bool success;
+};
+
+static void* downloadThread(void* data)
+{
+    struct downloadJob* job = data;
+
+    job->success = downloadToCache(job->url, &job->file, job->stream);
+
+    return NULL;
+}
+
+/*
+ * extracts while downloading, the archive ends up in the download
+ * store at the same time so a broken transfer can resume and a
+ * reinstall does not need the network
+ */
+bool extractURL(const char* URL, const char* outputdir, const struct ExtractOptions* options)
+{
+    pthread_t thread;
+    struct downloadJob job;
+    bool success = false;
+
+    job.url = URL;
+    job.success = false;
+    job.file.expected = options ? options->sha256 : NULL;
+    job.stream = streamNew();
+    if (!job.stream) return false;
+
+    if (options && options->result) memset(options->result, 0, sizeof(struct ExtractResult));
+
+    if (!pthread_create(&thread, NULL, downloadThread, &job))
+    {
+        success = extractStream(job.stream, outputdir, options);
+        pthread_join(thread, NULL);
+
+        // the stream broke off when the server restarted the file, the copy on disk is whole
+        if (!success && job.success && job.file.restarted)
+        {
+            puts("Download was restarted, extracting from the cache");
+
+            if (options && options->result) memset(options->result, 0, sizeof(struct ExtractResult));
+            if (options && options->restart) options->restart(options->data);
+
+            success = extractFile(job.file.path, outputdir, options);
+        }
+
+        if (success && job.success && options && options->result)
+            memcpy(options->result->sha256, job.file.sha256, SHA256_HEX_SIZE);
+    }
+
+    streamFree(job.stream);
+
+    return success;
 }
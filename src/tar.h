@@ -1,6 +1,40 @@
 #ifndef TAR_H
 #define TAR_H
 
-void extract(const struct MemoryStruct* tar, const char* outputdir);
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/limits.h>
 
-#endif
\ No newline at end of file
+#include "sha256.h"
+
+struct Stream;
+struct MemoryStruct;
+
+struct ExtractResult {
+    char root[NAME_MAX + 1];            // first top level directory
+    char sha256[SHA256_HEX_SIZE];       // of the downloaded archive, empty if unknown
+};
+
+// `path' is relative to the output directory, called from several threads at once
+typedef void (*extractHashed)(const char* path, const char sha256[SHA256_HEX_SIZE], uint64_t size, void* data);
+// extractURL starts over from the cached download, what `hashed' got so far is void
+typedef void (*extractRestart)(void* data);
+
+// NULL extracts plain copies
+struct ExtractOptions {
+    const char* store;                  // link identical files to this dedupe store, see dedupe.h
+    struct ExtractResult* result;       // filled in on success
+    const char* sha256;                 // the download of extractURL must have, NULL takes any
+    extractHashed hashed;               // gets the SHA-256 of every regular file as it is written
+    extractRestart restart;             // before a second pass over the same files
+    void* data;                         // for `hashed' and `restart'
+    bool replace;                       // top level directories replace the old ones instead of merging, for runners
+};
+
+bool extract(const struct MemoryStruct* tar, const char* outputdir, const struct ExtractOptions*);
+bool extractStream(struct Stream*, const char* outputdir, const struct ExtractOptions*);
+bool extractFile(const char* path, const char* outputdir, const struct ExtractOptions*);
+bool extractURL(const char* URL, const char* outputdir, const struct ExtractOptions*);
+bool extractMembers(const char* path, const char* outputdir, const char* const* members, size_t count, const struct ExtractOptions*);
+
+#endif
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+/*
+ * spans of the install phases in Chrome's trace event format, load the
+ * file in chrome://tracing or ui.perfetto.dev
+ * events are kept in memory and written when polecat exits, categories
+ * and names have to be string literals, details are copied
+ * with tracing off every probe is a load and a branch
+ */
+
+struct traceEvent {
+    const char* category;               // NULL for a thread name
+    const char* name;
+    char* detail;
+    uint64_t start;
+    uint64_t end;
+    pid_t tid;
+};
+
+bool traceEnabled;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static struct traceEvent* events;
+static size_t eventCount, eventCapacity;
+static char* tracePath;
+
+// microseconds, the unit of the format
+uint64_t traceNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    // never 0, that is "not tracing" to traceEnd
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000 + 1;
+}
+
+static void addEvent(const char* category, const char* name, uint64_t start, uint64_t end, const char* detail)
+{
+    pthread_mutex_lock(&traceLock);
+
+    if (eventCount == eventCapacity)
+    {
+        size_t capacity = eventCapacity ? eventCapacity * 2 : 4096;
+        struct traceEvent* grown = realloc(events, capacity * sizeof(struct traceEvent));
+
+        if (!grown)
+        {
+            pthread_mutex_unlock(&traceLock);
+            return;
+        }
+
+        events = grown;
+        eventCapacity = capacity;
+    }
+
+    struct traceEvent* event = &events[eventCount++];
+
+    event->category = category;
+    event->name = name;
+    event->detail = detail ? strdup(detail) : NULL;
+    event->start = start;
+    event->end = end;
+    event->tid = gettid();
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+void traceSpan(const char* category, const char* name, uint64_t start, uint64_t end, const char* detail)
+{
+    if (traceEnabled) addEvent(category, name, start, end, detail);
+}
+
+// names the calling thread in the trace viewer
+void traceThread(const char* name)
+{
+    if (traceEnabled) addEvent(NULL, name, 0, 0, NULL);
+}
+
+static void writeString(FILE* file, const char* str)
+{
+    fputc('"', file);
+
+    for (; *str; ++str)
+    {
+        if (*str == '"' || *str == '\\') fprintf(file, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20) fprintf(file, "\\u%04x", *str);
+        else fputc(*str, file);
+    }
+
+    fputc('"', file);
+}
+
+static void traceWrite(void)
+{
+    FILE* file = fopen(tracePath, "w");
+    pid_t pid = getpid();
+
+    if (!file)
+    {
+        printf("Cannot write the trace to %s\n", tracePath);
+        return;
+    }
+
+    traceEnabled = false;
+    pthread_mutex_lock(&traceLock);
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+
+    for (size_t i = 0; i < eventCount; ++i)
+    {
+        const struct traceEvent* event = &events[i];
+
+        if (event->category)
+        {
+            fprintf(file, "{\"ph\":\"X\",\"pid\":%i,\"tid\":%i,\"ts\":%llu,\"dur\":%llu,\"cat\":", pid, event->tid,
+                    (unsigned long long)event->start, (unsigned long long)(event->end - event->start));
+            writeString(file, event->category);
+        }
+        else
+        {
+            fprintf(file, "{\"ph\":\"M\",\"pid\":%i,\"tid\":%i,\"name\":\"thread_name\",\"args\":{\"name\":", pid, event->tid);
+            writeString(file, event->name);
+            fputs("}}", file);
+            fputs(i + 1 < eventCount ? ",\n" : "\n", file);
+            continue;
+        }
+
+        fputs(",\"name\":", file);
+        writeString(file, event->name);
+
+        if (event->detail)
+        {
+            fputs(",\"args\":{\"detail\":", file);
+            writeString(file, event->detail);
+            fputc('}', file);
+        }
+
+        fputs(i + 1 < eventCount ? "},\n" : "}\n", file);
+        free(event->detail);
+    }
+
+    fputs("]}\n", file);
+
+    if (fclose(file)) printf("Cannot write the trace to %s\n", tracePath);
+
+    free(events);
+    events = NULL;
+    eventCount = eventCapacity = 0;
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+// records from now on, the trace is written to `path' at exit
+bool traceOpen(const char* path)
+{
+    if (traceEnabled || !(tracePath = strdup(path))) return false;
+
+    traceEnabled = true;
+    traceThread("main");
+
+    return !atexit(traceWrite);
+}
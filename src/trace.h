@@ -0,0 +1,25 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+extern bool traceEnabled;
+
+bool traceOpen(const char* path);
+uint64_t traceNow(void);
+void traceSpan(const char* category, const char* name, uint64_t start, uint64_t end, const char* detail);
+void traceThread(const char* name);
+
+// 0 while tracing is off, so traceEnd has nothing to record
+static inline uint64_t traceStart(void)
+{
+    return traceEnabled ? traceNow() : 0;
+}
+
+static inline void traceEnd(const char* category, const char* name, uint64_t start, const char* detail)
+{
+    if (start) traceSpan(category, name, start, traceNow(), detail);
+}
+
+#endif
@@ -2,25 +2,58 @@
 #include <stdio.h>
 #include <string.h>
 #include <json.h>
-#include <libgen.h>
 #include <unistd.h>
 #include <linux/limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
 
 #include "wine.h"
 #include "net.h"
 #include "tar.h"
 #include "common.h"
 #include "config.h"
+#include "dedupe.h"
+#include "sha256.h"
+#include "catalog.h"
+#include "registry.h"
+#include "launch.h"
+#include "prewarm.h"
+#include "metrics.h"
+#include "checksum.h"
+#include "manifest.h"
+#include "store.h"
+
+
+// all wine_list and wine_download look at
+static const char* const runnerKeys[] = { "versions", "version", "url", NULL };
+
+static bool runnerRecord(struct json_object* runner, size_t index, const char** name, const char** url)
+{
+    struct json_object* versions, *value, *field;
+
+    if (!json_object_object_get_ex(runner, "versions", &versions) || index >= json_object_array_length(versions))
+        return false;
 
+    value = json_object_array_get_idx(versions, index);
+
+    *name = json_object_object_get_ex(value, "version", &field) ? json_object_get_string(field) : NULL;
+    *url = json_object_object_get_ex(value, "url", &field) ? json_object_get_string(field) : NULL;
+
+    return true;
+}
 
 const static struct Command wine_commands[] = {
     { .name = "download",       .func = wine_download,  .description = "download and extract a wine version from lutris" },
     { .name = "list",           .func = wine_list,      .description = "list installable wine versions" },
     { .name = "run",            .func = wine_run,       .description = "run a installed wine version" },
-    { .name = "installed",      .func = wine_installed, .description = "list installed wine versions" },
+    { .name = "installed",      .func = wine_installed, .description = "list installed wine versions, --verify checks them" },
+    { .name = "prewarm",        .func = wine_prewarm,   .description = "keep a wineserver running for faster launches" },
+    { .name = "stop",           .func = wine_stop,      .description = "stop a wineserver started by prewarm" },
+    { .name = "dedupe",         .func = wine_dedupe,    .description = "store files shared by installed wine versions only once" },
+    { .name = "verify",         .func = wine_verify,    .description = "check the files of a installed wine version, --deep hashes all of them" },
 };
 
 int wine(int argc, char** argv)
@@ -39,47 +72,75 @@ int wine(int argc, char** argv)
 
 int wine_download(int argc, char** argv)
 {
-    if (argc == 2)
+    char pinned[SHA256_HEX_SIZE];
+
+    if (argc == 3 && !checksumParse(argv[2], pinned))
     {
-        struct json_object* runner = fetchJSON(WINE_API);
+        printf("`%s' is not a SHA-256\n", argv[2]);
+        return 1;
+    }
+
+    if (argc == 2 || argc == 3)
+    {
+        struct Catalog* runner = catalogOpen(WINE_API, runnerKeys, runnerRecord);
 
         if (runner)
         {
-            struct json_object* versions;
-            json_object_object_get_ex(runner, "versions", &versions);
-
             int choice = atoi(argv[1]);
 
-            if (choice > json_object_array_length(versions) - 1 || choice < 0)
+            if (choice < 0 || choice >= catalogCount(runner))
             {
                 printf("`%i' is not a valid ID\n\nrun `polecat wine list' to get a valid ID\n", choice);
             }
             else
             {
-                struct json_object* url;
-                struct json_object* value = json_object_array_get_idx(versions, choice);
-
-                json_object_object_get_ex(value, "url", &url);
-                char* name = basename((char*)json_object_get_string(url));
+                const char* url = catalogURL(runner, choice);
+                const char* name = strrchr(url, '/') ? strrchr(url, '/') + 1 : url;
 
                 char datadir[PATH_MAX];
-                char downloadpath[PATH_MAX];
-                struct MemoryStruct* tar;
 
                 getDataDir(datadir, sizeof(datadir));
                 makeDir(datadir);
 
-                strncpy(downloadpath, datadir, sizeof(downloadpath) - 1);
-                strncat(downloadpath, "/", sizeof(downloadpath) - strlen(downloadpath) - 1);
-                strncat(downloadpath, name, sizeof(downloadpath) - strlen(downloadpath) - 1);
-                
-                printf("Downloading %s\n", name);
+                struct ExtractOptions options = { .replace = true };
+                char store[PATH_MAX];
 
-                tar = downloadToRam(json_object_get_string(url));
-                if (tar)
+                if (getConfigNumber("POLECAT_DEDUPE", 0))
                 {
-                    printf("Extracting %s\n", name);
-                    extract(tar, datadir);
+                    getDedupeStore(store, sizeof(store));
+                    makeDir(store);
+                    options.store = store;
+                }
+
+                struct ExtractResult result;
+                struct Manifest* manifest = manifestNew();
+                options.result = &result;
+
+                // the hashes come with the extraction, `wine verify' checks against them
+                if (manifest)
+                {
+                    options.hashed = manifestAdd;
+                    options.restart = manifestClear;
+                    options.data = manifest;
+                }
+
+                char expected[SHA256_HEX_SIZE];
+                const char* source = "command line";
+
+                if (argc == 3) options.sha256 = pinned;
+                else if (checksumLookup(url, expected, &source)) options.sha256 = expected;
+
+                printf("Downloading and extracting %s\n", name);
+
+                uint64_t start = metricsClock();
+
+                if (extractURL(url, datadir, &options))
+                {
+                    metricsEvent(EVENT_INSTALL, catalogName(runner, choice), metricsClock() - start);
+                    if (options.sha256) printf("SHA-256 matches the %s\n", source);
+
+                    if (!registryInstall("wine", url, &result)) puts("Could not record the installation");
+                    if (!manifest || !manifestSave(manifest, datadir, result.root)) puts("Could not record the manifest");
                     puts("Done");
                 }
                 else
@@ -87,40 +148,33 @@ int wine_download(int argc, char** argv)
                     puts("Something went wrong. The tar is not valid");
                 }
 
-
-                free(tar->memory);
-                free(tar);
+                manifestFree(manifest);
             }
 
-            json_object_put(runner);
+            catalogClose(runner);
         }
     }
     else
     {
-        puts(USAGE_STR " wine download <ID>\n\nIDs are obtained via `" NAME " wine list' ");
+        puts(USAGE_STR " wine download <ID> [sha256]\n\nIDs are obtained via `" NAME " wine list' ");
     }
     return 0;
 }
 
 int wine_list(int argc, char** argv)
 {
-    struct json_object* runner = fetchJSON(WINE_API);
+    struct Catalog* runner = catalogOpen(WINE_API, runnerKeys, runnerRecord);
 
     if (runner)
     {
-        struct json_object* versions, *value, *val;
-        json_object_object_get_ex(runner, "versions", &versions);
-
         puts("Installable wine versions:");
 
-        for (size_t i = 0; i < json_object_array_length(versions); ++i)
+        for (size_t i = 0; i < catalogCount(runner); ++i)
         {
-            value = json_object_array_get_idx(versions, i);
-            json_object_object_get_ex(value, "version", &val);
-            printf(" [%zu]\t%s\n", i, json_object_get_string(val));
+            printf(" [%zu]\t%s\n", i, catalogName(runner, i));
         }
 
-        json_object_put(runner);
+        catalogClose(runner);
     }
 
     return 0;
@@ -140,12 +194,44 @@ int wine_run(int argc, char** argv)
 
         if (isFile(winepath))
         {
-            for (int i = 2; i < argc; ++i)
+            struct LaunchProfile profile;
+
+            if (!launchProfileLoad(winever, &profile))
             {
-                strncat(winepath, " ", sizeof(winepath) - strlen(winepath) - 1);
-                strncat(winepath, argv[i], sizeof(winepath) - strlen(winepath) - 1);
+                puts("Cannot load the launch profile");
+                launchProfileFree(&profile);
+                return 1;
             }
-            return system(winepath);
+
+            char prefix[PATH_MAX];
+            struct WarmServer warm;
+
+            // a warm server is picked up by wine on its own, unless it belongs to another version
+            prewarmGetPrefix(launchProfileGet(&profile, "WINEPREFIX"), prefix, sizeof(prefix));
+            if (prewarmFind(prefix, &warm))
+            {
+                if (strcmp(warm.version, winever))
+                {
+                    printf("Stopping the warm wineserver of %s for %s\n", warm.version, prefix);
+                    prewarmStop(prefix);
+                }
+#ifdef DEBUG
+                else
+                {
+                    printf("Using the warm wineserver (pid %i)\n", (int)warm.pid);
+                }
+#endif
+            }
+
+            metricsEvent(EVENT_LAUNCH, winever, 1);
+
+            // argv[1] becomes argv[0] of wine, the rest is passed as is
+            argv[1] = winepath;
+
+            int status = launchProgram(winepath, argv + 1, &profile, false);
+            launchProfileFree(&profile);
+
+            return status;
         }
         else
         {
@@ -162,34 +248,370 @@ int wine_run(int argc, char** argv)
     return 0;
 }
 
+int wine_prewarm(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        puts(USAGE_STR " wine prewarm <version> [prefix]\n");
+        prewarmList();
+        return 0;
+    }
+
+    struct LaunchProfile profile;
+    struct WarmServer warm;
+    char prefix[PATH_MAX];
+    long timeout = getConfigNumber("POLECAT_PREWARM_TIMEOUT", 600);
+
+    if (argc > 2)
+    {
+        prewarmGetPrefix(argv[2], prefix, sizeof(prefix));
+    }
+    else
+    {
+        launchProfileLoad(argv[1], &profile);
+        prewarmGetPrefix(launchProfileGet(&profile, "WINEPREFIX"), prefix, sizeof(prefix));
+        launchProfileFree(&profile);
+    }
+
+    if (prewarmFind(prefix, &warm))
+    {
+        if (!strcmp(warm.version, argv[1]))
+        {
+            printf("%s is already warm (pid %i)\n", prefix, (int)warm.pid);
+            return 0;
+        }
+
+        printf("Stopping the warm wineserver of %s\n", warm.version);
+        prewarmStop(prefix);
+    }
+
+    if (!prewarmStart(argv[1], prefix, timeout, &warm))
+    {
+        puts("Could not start wineserver");
+        return 1;
+    }
+
+    printf("Started wineserver %s for %s (pid %i), it exits after %lds without clients\n",
+           warm.version, prefix, (int)warm.pid, timeout);
+
+    return 0;
+}
+
+int wine_stop(int argc, char** argv)
+{
+    struct LaunchProfile profile;
+    char prefix[PATH_MAX];
+
+    if (argc > 1)
+    {
+        prewarmGetPrefix(argv[1], prefix, sizeof(prefix));
+    }
+    else
+    {
+        launchProfileLoad(NULL, &profile);
+        prewarmGetPrefix(launchProfileGet(&profile, "WINEPREFIX"), prefix, sizeof(prefix));
+        launchProfileFree(&profile);
+    }
+
+    if (prewarmStop(prefix)) printf("Stopped the wineserver for %s\n", prefix);
+    else printf("No warm wineserver for %s\n", prefix);
+
+    return 0;
+}
+
+/*
+ * checks every registered runner against its tree, drops the ones that
+ * are gone and adopts wine trees that were installed before the registry
+ */
+static void verifyInstalled(const char* datadir)
+{
+    int lock = registryLock();
+    size_t count, kept = 0;
+    struct RegistryEntry* entries = registryLoad(&count);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        char path[PATH_MAX + NAME_MAX + 1];
+        uint64_t files, bytes;
+
+        snprintf(path, sizeof(path), "%s/%s", datadir, entries[i].name);
+
+        if (!isDir(path))
+        {
+            printf(" - %s: missing, removed from the registry\n", entries[i].name);
+            continue;
+        }
+
+        if (!registryScan(path, &files, &bytes))
+        {
+            printf(" - %s: could not read all of it\n", entries[i].name);
+        }
+        else if (files != entries[i].files || bytes != entries[i].bytes)
+        {
+            printf(" - %s: changed, %" PRIu64 " files (%.1f MiB) instead of %" PRIu64 " (%.1f MiB)\n", entries[i].name,
+                   files, bytes / 1048576.0, entries[i].files, entries[i].bytes / 1048576.0);
+        }
+        else
+        {
+            printf(" - %s: ok\n", entries[i].name);
+        }
+
+        entries[kept++] = entries[i];
+    }
+
+    kept = registryAdopt(&entries, kept, true);
+
+    registrySave(entries, kept);
+
+    free(entries);
+    registryUnlock(lock);
+}
+
 int wine_installed(int argc, char** argv)
 {
     char datadir[PATH_MAX];
     getDataDir(datadir, sizeof(datadir));
 
-    DIR *dir;
-    struct dirent *ent;
+    if (argc > 1 && !strcmp(argv[1], "--verify"))
+    {
+        puts("Verifying installed runners:");
+        verifyInstalled(datadir);
+        return 0;
+    }
+
+    // under the lock, which adopts runners installed by an older version once
+    size_t count;
+    int lock = registryLock();
+    struct RegistryEntry* entries = registryLoad(&count);
+    registryUnlock(lock);
 
     printf("Installed wine versions:\n");
-    if ((dir = opendir(datadir)) != NULL)
+    for (size_t i = 0; i < count; ++i)
     {
-        while ((ent = readdir (dir)) != NULL)
+        char date[32];
+
+        if (strcmp(entries[i].type, "wine")) continue;
+
+        strftime(date, sizeof(date), "%Y-%m-%d", localtime(&entries[i].installed));
+        printf(" - %s (%.1f MiB, %" PRIu64 " files, installed %s)\n", entries[i].name,
+               entries[i].bytes / 1048576.0, entries[i].files, date);
+    }
+
+    free(entries);
+
+    return 0;
+}
+
+struct dedupeStats {
+    size_t files;
+    size_t linked;
+    uint64_t saved;
+};
+
+static void dedupeTree(const char* store, const char* path, struct dedupeStats* stats)
+{
+    DIR* dir = opendir(path);
+    struct dirent* ent;
+
+    if (!dir) return;
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        char child[PATH_MAX];
+        struct stat sb;
+
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+
+        snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+        if (lstat(child, &sb) < 0) continue;
+
+        if (S_ISDIR(sb.st_mode))
         {
-            /*
-             * WARNING: crusty
-             * d_type is only specified on glibc (including musl) and BSD
-             */
-            if (ent->d_name[0] != '.' && ent->d_type == DT_DIR)
+            dedupeTree(store, child, stats);
+        }
+        // files with more links are already shared, with the store or inside the archive
+        else if (S_ISREG(sb.st_mode) && sb.st_nlink == 1 && sb.st_size)
+        {
+            char sha[SHA256_HEX_SIZE];
+            int fd = open(child, O_RDONLY | O_CLOEXEC);
+
+            if (fd < 0) continue;
+
+            bool hashed = sha256File(fd, sha);
+            close(fd);
+
+            stats->files++;
+            if (hashed && dedupeFile(store, child, sha))
             {
-                printf(" - %s\n", ent->d_name);
+                stats->linked++;
+                stats->saved += sb.st_size;
             }
         }
-        closedir (dir);
-    } 
+    }
+
+    closedir(dir);
+}
+
+int wine_dedupe(int argc, char** argv)
+{
+    char datadir[PATH_MAX], store[PATH_MAX];
+    struct dedupeStats stats = { 0 };
+    DIR* dir;
+    struct dirent* ent;
+
+    getDataDir(datadir, sizeof(datadir));
+    getDedupeStore(store, sizeof(store));
+    makeDir(store);
+
+    if ((dir = opendir(datadir)) != NULL)
+    {
+        while ((ent = readdir(dir)) != NULL)
+        {
+            char path[PATH_MAX + 256];
+
+            // skips the store itself and unfinished extractions
+            if (ent->d_name[0] == '.') continue;
+
+            snprintf(path, sizeof(path), "%s/%s", datadir, ent->d_name);
+            if (!isDir(path)) continue;
+
+            printf("Deduplicating %s\n", ent->d_name);
+            dedupeTree(store, path, &stats);
+        }
+        closedir(dir);
+    }
+
+    uint64_t freed = dedupePrune(store);
+
+    printf("Linked %zu of %zu files, saved %.1f MiB", stats.linked, stats.files, stats.saved / 1048576.0);
+    if (freed) printf(", removed %.1f MiB of unused files", freed / 1048576.0);
+    putchar('\n');
 
     return 0;
 }
 
+const static char* const stateNames[] = {
+    [MANIFEST_OK] = "intact",
+    [MANIFEST_MISSING] = "missing",
+    [MANIFEST_CHANGED] = "size changed",
+    [MANIFEST_CORRUPT] = "contents changed",
+};
+
+// a repaired file is only counted when it hashed to what the manifest says
+static void repairHashed(const char* path, const char sha256[SHA256_HEX_SIZE], uint64_t size, void* data)
+{
+    struct ManifestEntry* entry = manifestFind(data, path);
+
+    if (entry && !strcmp(entry->sha256, sha256)) entry->state = MANIFEST_OK;
+}
+
+// extracts only the damaged files again, from the archive kept in the download cache
+static size_t repairVersion(struct Manifest* manifest, const char* datadir, const char* version)
+{
+    size_t count, damaged = 0;
+    struct RegistryEntry* entries = registryLoad(&count);
+    struct RegistryEntry* entry = NULL;
+    char archive[PATH_MAX + NAME_MAX], sha[SHA256_HEX_SIZE];
+    bool cached = false;
+
+    for (size_t i = 0; i < count && !entry; ++i)
+    {
+        if (!strcmp(entries[i].name, version)) entry = &entries[i];
+    }
+
+    // the object is named after its hash, only entries without one need the url and a HEAD request
+    if (entry && entry->sha256[0]) cached = storeFind(entry->sha256, archive, sizeof(archive));
+    else if (entry) cached = storeLookup(entry->url, archive, sizeof(archive), sha);
+
+    if (!cached)
+    {
+        printf("The archive of %s is no longer cached, run `" NAME " wine download' again\n", version);
+        free(entries);
+        return 0;
+    }
+
+    const char** members = malloc(manifest->count * sizeof(char*));
+
+    if (!members)
+    {
+        free(entries);
+        return 0;
+    }
+
+    // the manifest is sorted, so are the members
+    for (size_t i = 0; i < manifest->count; ++i)
+    {
+        if (manifest->entries[i].state != MANIFEST_OK) members[damaged++] = manifest->entries[i].path;
+    }
+
+    struct ExtractOptions options = { .hashed = repairHashed, .data = manifest };
+
+    printf("Extracting %zu files of %s again\n", damaged, version);
+    extractMembers(archive, datadir, members, damaged, &options);
+
+    free(members);
+    free(entries);
+
+    size_t repaired = 0;
+    for (size_t i = 0; i < manifest->count; ++i)
+    {
+        if (manifest->entries[i].state == MANIFEST_OK) repaired++;
+    }
+
+    return repaired - (manifest->count - damaged);
+}
+
+int wine_verify(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "--deep")))
+    {
+        puts(USAGE_STR " wine verify <version> [--deep]\n\nversions are obtained via `" NAME " wine installed'");
+        return 0;
+    }
+
+    const char* version = argv[1];
+    bool deep = argc == 3;
+    char datadir[PATH_MAX];
+    struct Manifest* manifest = manifestLoad(version);
+
+    getDataDir(datadir, sizeof(datadir));
+
+    if (!manifest)
+    {
+        printf("%s was installed without a manifest, run `" NAME " wine download' again to get one\n", version);
+        return 1;
+    }
+
+    printf("Verifying %zu files of %s\n", manifest->count, version);
+
+    size_t damaged = manifestCheck(manifest, datadir, deep);
+
+    for (size_t i = 0; i < manifest->count; ++i)
+    {
+        if (manifest->entries[i].state != MANIFEST_OK)
+            printf(" - %s: %s\n", manifest->entries[i].path, stateNames[manifest->entries[i].state]);
+    }
+
+    if (damaged)
+    {
+        size_t repaired = repairVersion(manifest, datadir, version);
+
+        printf("Repaired %zu of %zu damaged files\n", repaired, damaged);
+        damaged -= repaired;
+    }
+    else
+    {
+        printf("All %zu files are intact\n", manifest->count);
+    }
+
+    // files that were only touched get their new mtime so the next check skips them
+    if (!manifestSave(manifest, datadir, version)) puts("Could not update the manifest");
+
+    manifestFree(manifest);
+
+    return damaged != 0;
+}
+
 int wine_help(int argc, char** argv)
 {
     puts(USAGE_STR " wine <command>\n\nList of commands:");
@@ -6,6 +6,10 @@ int wine_download(int, char**);
 int wine_list(int, char**);
 int wine_run(int, char**);
 int wine_installed(int, char**);
+int wine_dedupe(int, char**);
+int wine_verify(int, char**);
+int wine_prewarm(int, char**);
+int wine_stop(int, char**);
 int wine_help(int, char**);
 
 #endif
\ No newline at end of file